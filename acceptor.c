@@ -0,0 +1,132 @@
+#define _GNU_SOURCE
+#include "acceptor.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define ACCEPTOR_DEFAULT_PER_TICK 64
+#define ACCEPTOR_RECHECK_MS 10
+
+static void acceptor_pause(struct acceptor *a);
+
+// reserve a slot in the global count. 0 : ok, -1 over the limit
+static int acceptor_admit(struct acceptor_limits *l)
+{
+  if (!l)
+    return 0;
+  if (l->max_conns <= 0) {
+    __atomic_add_fetch(&l->active, 1, __ATOMIC_RELAXED);
+    return 0;
+  }
+  int n = __atomic_load_n(&l->active, __ATOMIC_RELAXED);
+  do {
+    if (n >= l->max_conns)
+      return -1;
+  } while (!__atomic_compare_exchange_n(&l->active, &n, n + 1, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  return 0;
+}
+
+// close with RST, do not leave a TIME_WAIT behind
+static void acceptor_reset(int fd)
+{
+  struct linger lg = {
+    .l_onoff = 1,
+    .l_linger = 0,
+  };
+  setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+  close(fd);
+}
+
+static void acceptor_on_ready(struct reactor *r, int fd, uint32_t events, void *arg)
+{
+  struct acceptor *a = arg;
+  (void)r;
+  (void)events;
+  for (int i = 0; i < a->per_tick; i++) {
+    int over = acceptor_admit(a->limits) != 0;
+    if (over && !(a->flags & ACCEPTOR_F_SHED)) {
+      acceptor_pause(a);
+      return;
+    }
+    int cfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (cfd == -1) {
+      if (!over && a->limits)
+        acceptor_limits_release(a->limits);
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      // out of descriptors: back off instead of spinning on a ready listener
+      if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+        acceptor_pause(a);
+      return;
+    }
+    if (over) {
+      acceptor_reset(cfd);
+      a->stats.shed++;
+      continue;
+    }
+    a->stats.accepted++;
+    a->on_accept(a, cfd, a->arg);
+  }
+}
+
+static int acceptor_can_resume(const struct acceptor *a)
+{
+  const struct acceptor_limits *l = a->limits;
+  if (!l || l->max_conns <= 0)
+    return 1;
+  return __atomic_load_n(&l->active, __ATOMIC_RELAXED) <= l->resume_conns;
+}
+
+static void acceptor_on_timer(void *arg)
+{
+  struct acceptor *a = arg;
+  if (!acceptor_can_resume(a)) {
+    reactor_timer_start(a->r, &a->timer, ACCEPTOR_RECHECK_MS, acceptor_on_timer, a);
+    return;
+  }
+  if (reactor_modify(a->r, a->listen_fd, EPOLLIN) == 0)
+    a->paused = 0;
+  else
+    reactor_timer_start(a->r, &a->timer, ACCEPTOR_RECHECK_MS, acceptor_on_timer, a);
+}
+
+static void acceptor_pause(struct acceptor *a)
+{
+  if (a->paused)
+    return;
+  if (reactor_modify(a->r, a->listen_fd, 0) != 0)
+    return;
+  a->paused = 1;
+  a->stats.pauses++;
+  reactor_timer_start(a->r, &a->timer, ACCEPTOR_RECHECK_MS, acceptor_on_timer, a);
+}
+
+int acceptor_init(struct acceptor *a, struct reactor *r, int listen_fd,
+                  struct acceptor_limits *limits, int per_tick, int flags,
+                  acceptor_func on_accept, void *arg)
+{
+  memset(a, 0, sizeof(*a));
+  // accept4() runs until EAGAIN, a blocking listener would stall the loop
+  int fl = fcntl(listen_fd, F_GETFL);
+  if (fl == -1 || (!(fl & O_NONBLOCK) && fcntl(listen_fd, F_SETFL, fl | O_NONBLOCK) == -1))
+    return -1;
+  a->r = r;
+  a->listen_fd = listen_fd;
+  a->per_tick = per_tick > 0 ? per_tick : ACCEPTOR_DEFAULT_PER_TICK;
+  a->flags = flags;
+  a->limits = limits;
+  a->on_accept = on_accept;
+  a->arg = arg;
+  reactor_timer_init(&a->timer);
+  return reactor_add(r, listen_fd, EPOLLIN, acceptor_on_ready, a);
+}
+
+void acceptor_close(struct acceptor *a)
+{
+  reactor_timer_stop(a->r, &a->timer);
+  reactor_remove(a->r, a->listen_fd);
+}
@@ -0,0 +1,79 @@
+#ifndef XNET_ACCEPTOR_H_
+#define XNET_ACCEPTOR_H_
+
+#include <stdint.h>
+#include "reactor.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Batched accept with admission control.
+//
+// On every readiness event the acceptor calls accept4(SOCK_NONBLOCK |
+// SOCK_CLOEXEC) until EAGAIN or per_tick connections, so a connection
+// storm cannot starve the established ones on the same reactor. All
+// acceptors sharing one acceptor_limits obey a global connection cap:
+// at max_conns they stop accepting (or shed, see ACCEPTOR_F_SHED) and only
+// resume once the count went down to resume_conns.
+
+// shared by all acceptors of the process, may be used from any thread
+struct acceptor_limits {
+  int max_conns;     // 0: unlimited
+  int resume_conns;  // hysteresis, below max_conns. 0: 90% of max_conns
+  int active;        // current connections, atomic
+};
+
+static inline void acceptor_limits_init(struct acceptor_limits *l, int max_conns, int resume_conns)
+{
+  l->max_conns = max_conns;
+  l->resume_conns = resume_conns > 0 ? resume_conns : max_conns - max_conns / 10;
+  if (l->resume_conns >= max_conns)
+    l->resume_conns = max_conns - 1;
+  l->active = 0;
+}
+// call whenever an accepted connection is closed, thread-safe
+static inline void acceptor_limits_release(struct acceptor_limits *l)
+{
+  __atomic_sub_fetch(&l->active, 1, __ATOMIC_RELAXED);
+}
+
+struct acceptor;
+// fd is non-blocking and counted in limits, release it when it is closed
+typedef void (*acceptor_func)(struct acceptor *a, int fd, void *arg);
+
+// over the limit, accept and reset connections instead of leaving them in
+// the kernel queue, clients fail fast instead of timing out
+#define ACCEPTOR_F_SHED (1<<0)
+
+struct acceptor_stats {
+  uint64_t accepted;
+  uint64_t shed;
+  uint64_t pauses;
+};
+
+struct acceptor {
+  struct reactor *r;
+  int listen_fd;
+  int per_tick;
+  int flags;
+  int paused;
+  struct acceptor_limits *limits;
+  acceptor_func on_accept;
+  void *arg;
+  struct reactor_timer timer;  // polls the limits while paused
+  struct acceptor_stats stats;
+};
+
+// per_tick <= 0 uses the default. limits may be NULL (no cap).
+// listen_fd is switched to non-blocking. 0 : success, -1 fail
+int acceptor_init(struct acceptor *a, struct reactor *r, int listen_fd,
+                  struct acceptor_limits *limits, int per_tick, int flags,
+                  acceptor_func on_accept, void *arg);
+// stop watching listen_fd, the caller closes it
+void acceptor_close(struct acceptor *a);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,326 @@
+#include "balancer.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BALANCER_CACHELINE 64
+#define BALANCER_EWMA_SHIFT 3  // weight 1/8 for a new sample
+
+// one cache line each, the counters of busy backends do not false-share
+struct balancer_backend {
+  struct Endpoint ep;
+  int outstanding;
+  int failures;           // consecutive connect failures
+  int ejections;          // consecutive ejections, scales the next one
+  int64_t ewma_ns;
+  uint64_t ejected_until; // monotonic ms, 0: in rotation
+} __attribute__((aligned(BALANCER_CACHELINE)));
+
+struct balancer {
+  int policy;
+  int n;
+  int eject_failures;
+  int eject_ms;
+  int max_eject_ms;
+  int max_ejected;
+  int nejected;
+  struct balancer_backend *backends;
+};
+
+static __thread uint64_t tls_rng;
+
+static uint64_t balancer_rand(void)
+{
+  uint64_t x = tls_rng;
+  if (x == 0)
+    x = ((uint64_t)time(NULL) ^ (uint64_t)(uintptr_t)&tls_rng) | 1;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  tls_rng = x;
+  return x * 0x2545F4914F6CDD1DULL;
+}
+
+// [0, n) without a division
+static int balancer_bound(uint32_t r, int n)
+{
+  return (int)(((uint64_t)r * (uint32_t)n) >> 32);
+}
+
+static uint64_t balancer_now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static int backend_ejected(struct balancer *b, struct balancer_backend *be)
+{
+  uint64_t until = __atomic_load_n(&be->ejected_until, __ATOMIC_ACQUIRE);
+  if (until == 0)
+    return 0;
+  if (balancer_now_ms() < until)
+    return 1;
+  // the ejection ran out, whoever clears it first returns the slot
+  if (__atomic_compare_exchange_n(&be->ejected_until, &until, 0, false,
+                                  __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    __atomic_sub_fetch(&b->nejected, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+static int is_ejected(struct balancer *b, int i)
+{
+  // nothing ejected is the common case, no clock read
+  if (__atomic_load_n(&b->nejected, __ATOMIC_RELAXED) == 0)
+    return 0;
+  return backend_ejected(b, &b->backends[i]);
+}
+
+// first backend in rotation from start on, -1 if all are ejected
+static int next_healthy(struct balancer *b, int start)
+{
+  for (int k = 0; k < b->n; k++) {
+    int i = (start + k) % b->n;
+    if (!is_ejected(b, i))
+      return i;
+  }
+  return -1;
+}
+
+static uint64_t backend_load(const struct balancer *b, int i)
+{
+  const struct balancer_backend *be = &b->backends[i];
+  uint64_t outstanding = (uint64_t)__atomic_load_n(&be->outstanding, __ATOMIC_RELAXED);
+  if (b->policy != BALANCER_EWMA)
+    return outstanding;
+  uint64_t ewma = (uint64_t)__atomic_load_n(&be->ewma_ns, __ATOMIC_RELAXED);
+  return (ewma + 1) * (outstanding + 1);
+}
+
+static int pick_p2c(struct balancer *b)
+{
+  uint64_t r = balancer_rand();
+  int i = balancer_bound((uint32_t)r, b->n);
+  int j = balancer_bound((uint32_t)(r >> 32), b->n - 1);
+  if (j >= i)
+    j++;
+  int ei = is_ejected(b, i), ej = is_ejected(b, j);
+  if (ei || ej) {
+    if (!ej)
+      return j;
+    if (!ei)
+      return i;
+    int k = next_healthy(b, i);
+    return k >= 0 ? k : i;
+  }
+  return backend_load(b, j) < backend_load(b, i) ? j : i;
+}
+
+// Lamping & Veach, "A Fast, Minimal Memory, Consistent Hash Algorithm"
+static int jump_hash(uint64_t key, int n)
+{
+  int64_t h = -1, j = 0;
+  while (j < n) {
+    h = j;
+    key = key * 2862933555777941757ULL + 1;
+    j = (int64_t)((double)(h + 1) * ((double)(1LL << 31) / (double)((key >> 33) + 1)));
+  }
+  return (int)h;
+}
+
+static uint64_t mix64(uint64_t x)
+{
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return x;
+}
+
+static int pick_hash(struct balancer *b, uint64_t key)
+{
+  int i = jump_hash(key, b->n);
+  if (!is_ejected(b, i))
+    return i;
+  // rehash, a key only moves while its own backend is out
+  uint64_t k = key;
+  for (int attempt = 0; attempt < b->n; attempt++) {
+    k = mix64(k + 1);
+    int j = jump_hash(k, b->n);
+    if (!is_ejected(b, j))
+      return j;
+  }
+  int j = next_healthy(b, i);
+  return j >= 0 ? j : i;
+}
+
+int balancer_pick(struct balancer *b, uint64_t key)
+{
+  if (b->n == 1)
+    return 0;
+  if (b->policy == BALANCER_HASH)
+    return pick_hash(b, key);
+  return pick_p2c(b);
+}
+
+void balancer_begin(struct balancer *b, int backend)
+{
+  __atomic_add_fetch(&b->backends[backend].outstanding, 1, __ATOMIC_RELAXED);
+}
+
+void balancer_end(struct balancer *b, int backend, int64_t latency_ns)
+{
+  struct balancer_backend *be = &b->backends[backend];
+  __atomic_sub_fetch(&be->outstanding, 1, __ATOMIC_RELAXED);
+  if (latency_ns <= 0)
+    return;
+  int64_t old = __atomic_load_n(&be->ewma_ns, __ATOMIC_RELAXED);
+  int64_t v = old == 0 ? latency_ns : old + ((latency_ns - old) >> BALANCER_EWMA_SHIFT);
+  __atomic_store_n(&be->ewma_ns, v > 0 ? v : 1, __ATOMIC_RELAXED);
+}
+
+static void backend_eject(struct balancer *b, struct balancer_backend *be)
+{
+  int n = __atomic_load_n(&b->nejected, __ATOMIC_RELAXED);
+  do {
+    if (n >= b->max_ejected)
+      return;
+  } while (!__atomic_compare_exchange_n(&b->nejected, &n, n + 1, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  int times = __atomic_fetch_add(&be->ejections, 1, __ATOMIC_RELAXED);
+  uint64_t ms = (uint64_t)b->eject_ms << (times < 16 ? times : 16);
+  if (ms > (uint64_t)b->max_eject_ms)
+    ms = (uint64_t)b->max_eject_ms;
+  uint64_t zero = 0;
+  if (!__atomic_compare_exchange_n(&be->ejected_until, &zero, balancer_now_ms() + ms, false,
+                                   __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    // somebody else ejected it meanwhile
+    __atomic_sub_fetch(&be->ejections, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&b->nejected, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  __atomic_store_n(&be->failures, 0, __ATOMIC_RELAXED);
+}
+
+void balancer_report(struct balancer *b, int backend, int ok)
+{
+  struct balancer_backend *be = &b->backends[backend];
+  if (ok) {
+    if (__atomic_load_n(&be->failures, __ATOMIC_RELAXED) != 0)
+      __atomic_store_n(&be->failures, 0, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&be->ejections, __ATOMIC_RELAXED) != 0 && !backend_ejected(b, be))
+      __atomic_store_n(&be->ejections, 0, __ATOMIC_RELAXED);
+    return;
+  }
+  if (__atomic_add_fetch(&be->failures, 1, __ATOMIC_RELAXED) >= b->eject_failures &&
+      !backend_ejected(b, be))
+    backend_eject(b, be);
+}
+
+int balancer_ejected(const struct balancer *b, int backend)
+{
+  return is_ejected((struct balancer *)b, backend);
+}
+
+int balancer_size(const struct balancer *b)
+{
+  return b->n;
+}
+
+const struct Endpoint *balancer_endpoint(const struct balancer *b, int backend)
+{
+  return &b->backends[backend].ep;
+}
+
+struct balancer *balancer_create(const char *network, const char *const *addresses, int n,
+                                 const struct balancer_options *opts)
+{
+  static const struct balancer_options defaults;
+  struct balancer *b;
+  if (n <= 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+  if (!opts)
+    opts = &defaults;
+  b = calloc(1, sizeof(*b));
+  if (!b)
+    return NULL;
+  if (posix_memalign((void **)&b->backends, BALANCER_CACHELINE,
+                     sizeof(struct balancer_backend) * (size_t)n) != 0) {
+    free(b);
+    return NULL;
+  }
+  memset(b->backends, 0, sizeof(struct balancer_backend) * (size_t)n);
+  b->policy = opts->policy;
+  b->eject_failures = opts->eject_failures > 0 ? opts->eject_failures : 5;
+  b->eject_ms = opts->eject_ms > 0 ? opts->eject_ms : 1000;
+  b->max_eject_ms = opts->max_eject_ms > 0 ? opts->max_eject_ms : 30000;
+  b->max_ejected = n * (opts->max_eject_percent > 0 ? opts->max_eject_percent : 50) / 100;
+  for (int i = 0; i < n; i++) {
+    if (ResolveEndpoint(&b->backends[i].ep, network, addresses[i], 0) != 0) {
+      balancer_destroy(b);
+      return NULL;
+    }
+    b->n = i + 1;
+  }
+  return b;
+}
+
+void balancer_destroy(struct balancer *b)
+{
+  for (int i = 0; i < b->n; i++)
+    EndpointFree(&b->backends[i].ep);
+  free(b->backends);
+  free(b);
+}
+
+// params copy handed to DialEndpoint, the error hook finds the caller's
+struct balancer_dial {
+  struct BuildNetParams params;  // first member
+  const struct BuildNetParams *user;
+};
+
+static void balancer_on_error(const struct BuildNetParams *params,
+                              const struct addrinfo *dest, int err)
+{
+  const struct balancer_dial *d = (const struct balancer_dial *)params;
+  if (d->user && d->user->error_call)
+    d->user->error_call(params, dest, err);
+}
+
+int BalancerDial(struct balancer *b, uint64_t key, const struct BuildNetParams *params,
+                 int *backend)
+{
+  struct balancer_dial d;
+  int first = balancer_pick(b, key);
+  memset(&d, 0, sizeof(d));
+  if (params)
+    d.params = *params;
+  d.params.error_call = balancer_on_error;
+  d.user = params;
+  // fail over to the following backends, keyed requests stay predictable
+  for (int k = 0; k < b->n; k++) {
+    int i = (first + k) % b->n;
+    if (k > 0 && is_ejected(b, i))
+      continue;
+    int fd = DialEndpoint(&b->backends[i].ep, NULL, &d.params);
+    if (fd == -1) {
+      // one failure per dial, however many addresses the backend has
+      int err = errno;
+      balancer_report(b, i, 0);
+      errno = err;
+      continue;
+    }
+    // a connect in progress has not succeeded yet, the caller reports it
+    if (!(d.params.flags & XNET_F_NONBLOCK))
+      balancer_report(b, i, 1);
+    if (backend)
+      *backend = i;
+    return fd;
+  }
+  return -1;
+}
\ No newline at end of file
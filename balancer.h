@@ -0,0 +1,71 @@
+#ifndef XNET_BALANCER_H_
+#define XNET_BALANCER_H_
+
+#include <stdint.h>
+#include "base_net.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Client-side load balancing over a fixed set of backends.
+//
+// The backend set is resolved once and never changes, all per-backend state
+// is updated with atomics: balancer_pick() takes no lock and usually no
+// syscall, any thread may call any function. Counters are advisory, a lost
+// update under a race only makes one pick slightly less informed.
+//
+// Outlier ejection: a backend that failed to connect eject_failures times
+// in a row is skipped for eject_ms, doubled on every repeated ejection.
+// At most max_eject_percent of the backends are ejected at once; if every
+// candidate is ejected the pick ignores ejection rather than failing.
+
+enum {
+  BALANCER_P2C,   // power of two choices, fewer requests in flight wins
+  BALANCER_EWMA,  // power of two choices on latency EWMA * (in flight + 1)
+  BALANCER_HASH,  // jump consistent hash of the key, for cache affinity
+};
+
+struct balancer_options {
+  int policy;
+  int eject_failures;     // 0: 5
+  int eject_ms;           // 0: 1000
+  int max_eject_ms;       // 0: 30000
+  int max_eject_percent;  // 0: 50
+};
+
+struct balancer;
+
+// network and addresses as for Dial(). opts may be NULL (P2C, defaults).
+// NULL on failure, e.g. an address did not resolve
+struct balancer *balancer_create(const char *network, const char *const *addresses, int n,
+                                 const struct balancer_options *opts);
+void balancer_destroy(struct balancer *b);
+int balancer_size(const struct balancer *b);
+const struct Endpoint *balancer_endpoint(const struct balancer *b, int backend);
+
+// the backend for the next request. key is only used by BALANCER_HASH.
+int balancer_pick(struct balancer *b, uint64_t key);
+
+// bracket every request sent to backend, feeds P2C and EWMA
+void balancer_begin(struct balancer *b, int backend);
+// latency_ns <= 0: no sample (e.g. the request failed)
+void balancer_end(struct balancer *b, int backend, int64_t latency_ns);
+
+// outcome of a connect attempt, drives the ejection
+void balancer_report(struct balancer *b, int backend, int ok);
+int balancer_ejected(const struct balancer *b, int backend);
+
+// pick a backend and dial it, another pick on failure. A backend none of
+// whose addresses connects counts one failure. With XNET_F_NONBLOCK only
+// such an immediate failure is reported: once WaitConnected() or EPOLLOUT
+// tells how the connect ended, report it with balancer_report().
+// *backend (may be NULL) is the backend of the returned fd.
+// return fd, -1 error
+int BalancerDial(struct balancer *b, uint64_t key, const struct BuildNetParams *params,
+                 int *backend);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -3,13 +3,20 @@
 #include <arpa/inet.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/errno.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/un.h>
+#include <netinet/in.h>
 #include <string.h>
 #include <netdb.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <time.h>
 #include <unistd.h>
 
 static void log_error(const char *fmt, ...)
@@ -21,88 +28,230 @@ static void log_error(const char *fmt, ...)
   if (fmt[strlen(fmt)-1] != '\n')
     printf("\n");
 }
-static int split_address(const char *address, char *node, char *service)
+// split "host:port", "[v6]:port" or "host" in place, no copies.
+// leading blanks of the address and trailing blanks of the port are ignored
+static int split_address(const char *address, const char **host, size_t *hostlen,
+                         const char **service, size_t *servlen)
 {
   while (*address == ' ')
     address++;
-  size_t n = strlen(address);
-  if (n >= NI_MAXHOST + NI_MAXSERV + 3 || n<1)
+  if (*address == '\0')
     return -1;
-  service[0] = '\0';
+  *service = "";
   if (address[0] == '[') {
-    char *br = strchr(address, ']');
+    const char *br = strchr(address, ']');
     // invalid ipv6 address in brace, or empty in []
     if (br == NULL || address + 1 == br)
       return -1;
-    if ((size_t)(br - address - 1) >= NI_MAXHOST)
-      return -1; // too long host
-    memcpy(node, address + 1, br - address - 1);
-    node[br - address] = '\0';
-    if (br[1] == ':') {
-      if (strlen(br+2) >= NI_MAXSERV)
-        return -1; // too long serv/port
-      strcpy(service, br+2);
-    } else if (br[1] != '\0') {
+    *host = address + 1;
+    *hostlen = (size_t)(br - address - 1);
+    if (br[1] == ':')
+      *service = br + 2;
+    else if (br[1] != '\0')
       return -1;
-    }
   } else {
-    char *br = strrchr(address, ':');
+    const char *br = strrchr(address, ':');
+    *host = address;
     if (br) {
-      n = (size_t)(br - address);
-      if (n >= NI_MAXHOST)
-        return -1; // too long host
-      memcpy(node, address, n);
-      node[n] = '\0';
-      if (strlen(br + 1) >= NI_MAXSERV)
-        return -1;
-      strcpy(service, br + 1);
+      *hostlen = (size_t)(br - address);
+      *service = br + 1;
     } else {
-      if (n >= NI_MAXHOST)
-        return -1;
-      memcpy(node, address, n);
+      *hostlen = strlen(address);
     }
   }
-  n = strlen(service);
-  for (int i = (int)(n - 1); i >= 0; i--) {
-    if (service[i] != ' ')
-      break;
-    service[i] = '\0';
+  size_t n = strlen(*service);
+  while (n > 0 && (*service)[n - 1] == ' ')
+    n--;
+  *servlen = n;
+  if (*hostlen >= NI_MAXHOST || n >= NI_MAXSERV)
+    return -1;
+  return 0;
+}
+
+// decimal port, the empty port is 0. -1 : a service name, -2 : out of range
+static int parse_port(const char *s, size_t n)
+{
+  long port = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (s[i] < '0' || s[i] > '9')
+      return -1;
+    if (port <= 65535)
+      port = port * 10 + (s[i] - '0');
   }
-  if (service[0] == '\0') {
-    service[0] = '0';
-    service[1] = '\0';
+  return port <= 65535 ? (int)port : -2;
+}
+
+// strict dotted quad. Leading zeros are left to the resolver, which reads
+// them as octal.
+static int parse_ipv4(const char *s, size_t n, struct in_addr *addr)
+{
+  uint32_t ip = 0;
+  unsigned octet = 0;
+  int digits = 0, dots = 0;
+  for (size_t i = 0; i < n; i++) {
+    char c = s[i];
+    if (c >= '0' && c <= '9') {
+      if (digits == 1 && octet == 0)
+        return -1;
+      octet = octet * 10 + (unsigned)(c - '0');
+      if (++digits > 3 || octet > 255)
+        return -1;
+    } else if (c == '.' && digits > 0 && dots < 3) {
+      ip = ip << 8 | octet;
+      octet = 0;
+      digits = 0;
+      dots++;
+    } else {
+      return -1;
+    }
   }
+  if (dots != 3 || digits == 0)
+    return -1;
+  addr->s_addr = htonl(ip << 8 | octet);
   return 0;
 }
 
+static int parse_ipv6(const char *s, size_t n, struct in6_addr *addr)
+{
+  char buf[INET6_ADDRSTRLEN];
+  // a zone ("fe80::1%eth0") needs if_nametoindex(), leave it to the resolver
+  if (n == 0 || n >= sizeof(buf) || memchr(s, '%', n))
+    return -1;
+  memcpy(buf, s, n);
+  buf[n] = '\0';
+  return inet_pton(AF_INET6, buf, addr) == 1 ? 0 : -1;
+}
+
+static char *format_uint(char *p, unsigned v)
+{
+  char tmp[10];
+  int n = 0;
+  do {
+    tmp[n++] = (char)('0' + v % 10);
+    v /= 10;
+  } while (v);
+  while (n)
+    *p++ = tmp[--n];
+  return p;
+}
+
 // format the sockaddr into buffer with style:
 // "xx.yy.zz.ww:port" for IPv4
 // "[::1]:port" for IPv6
+// the path (or "@name" if abstract) for unix sockets
+// no allocation and no resolver, cheap enough for logging on the hot path.
+// return the length of the string, -1 unknown family or buffer too small
 int format_sockaddr(const struct sockaddr *sa, char *buffer, int size)
 {
-  char        host[NI_MAXHOST];
-  char        port[NI_MAXSERV];
-  int rc;
+  char tmp[INET6_ADDRSTRLEN + 20];
+  char *p = tmp;
+  switch (sa->sa_family) {
+    case AF_INET: {
+      const struct sockaddr_in *in = (const struct sockaddr_in *)sa;
+      const unsigned char *b = (const unsigned char *)&in->sin_addr;
+      for (int i = 0; i < 4; i++) {
+        p = format_uint(p, b[i]);
+        *p++ = i < 3 ? '.' : ':';
+      }
+      p = format_uint(p, ntohs(in->sin_port));
+      break;
+    }
+    case AF_INET6: {
+      const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)sa;
+      *p++ = '[';
+      if (inet_ntop(AF_INET6, &in6->sin6_addr, p, INET6_ADDRSTRLEN) == NULL)
+        return -1;
+      p += strlen(p);
+      if (in6->sin6_scope_id) {
+        *p++ = '%';
+        p = format_uint(p, in6->sin6_scope_id);
+      }
+      *p++ = ']';
+      *p++ = ':';
+      p = format_uint(p, ntohs(in6->sin6_port));
+      break;
+    }
+    case AF_UNIX: {
+      const struct sockaddr_un *un = (const struct sockaddr_un *)sa;
+      size_t n = strnlen(un->sun_path, sizeof(un->sun_path));
+      // abstract, an unbound socket formats as ""
+      if (n == 0 && un->sun_path[1] != '\0')
+        n = strnlen(un->sun_path + 1, sizeof(un->sun_path) - 1) + 1;
+      if ((int)n >= size)
+        return -1;
+      memcpy(buffer, un->sun_path, n);
+      if (n > 0 && buffer[0] == '\0')
+        buffer[0] = '@';
+      buffer[n] = '\0';
+      return (int)n;
+    }
+    default:
+      return -1;
+  }
+  int n = (int)(p - tmp);
+  if (n >= size)
+    return -1;
+  memcpy(buffer, tmp, (size_t)n);
+  buffer[n] = '\0';
+  return n;
+}
 
-  rc = getnameinfo(sa, sa->sa_len,
-      host, sizeof(host),
-      port, sizeof(port),
-      NI_NUMERICHOST | NI_NUMERICSERV);
-  if (rc != 0) {
-    snprintf(buffer, size, "?host?:?port?");
-  } else {
-    if (sa->sa_family == AF_INET6)
-      snprintf(buffer, size, "[%s]:%s", host, port);
-    else
-      snprintf(buffer, size, "%s:%s", host, port);
+int WaitConnected(int sockfd, int ms)
+{
+  struct pollfd pfd = {
+    .fd = sockfd,
+    .events = POLLOUT,
+  };
+  int rc, err = 0;
+  socklen_t len = sizeof(err);
+  do {
+    rc = poll(&pfd, 1, ms);
+  } while (rc == -1 && errno == EINTR);
+  if (rc == 0) {
+    errno = ETIMEDOUT;
+    return -1;
+  }
+  if (rc == -1 || getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+    return -1;
+  if (err != 0) {
+    errno = err;
+    return -1;
+  }
+  return 0;
+}
 
+int SetBusyPoll(int sockfd, int usecs, int prefer)
+{
+  if (setsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) == -1)
+    return -1;
+#ifdef SO_PREFER_BUSY_POLL
+  prefer = prefer != 0;
+  if (setsockopt(sockfd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer)) == -1)
+    return -1;
+#else
+  if (prefer) {
+    errno = ENOPROTOOPT;
+    return -1;
   }
-  return rc;
+#endif
+  return 0;
 }
 
-int DialTimeout(const char *network, const char *address, int ms)
+int IncomingNapiId(int sockfd)
 {
-  return -1;
+  unsigned id = 0;
+  socklen_t len = sizeof(id);
+  if (getsockopt(sockfd, SOL_SOCKET, SO_INCOMING_NAPI_ID, &id, &len) == -1)
+    return -1;
+  return (int)id;
+}
+
+int NapiGroup(int sockfd, int ngroups)
+{
+  int id = IncomingNapiId(sockfd);
+  if (id <= 0 || ngroups <= 0)
+    return -1;
+  return id % ngroups;
 }
 
 int Listen_ex(const struct BuildNetParams *params)
@@ -110,133 +259,448 @@ int Listen_ex(const struct BuildNetParams *params)
   assert(params && params->network);
   const char *network = params->network;
   switch(network[0]) {
-    case 't': return ListenTCP_ex(params);
+    case 't':
+              // tls[4|6]: ListenTLS()
+              if (network[1] != 'c')
+                break;
+              return ListenTCP_ex(params);
     case 'u':
               return network[1]=='d' ? ListenUDP_ex(params)
                 : ListenUNIX_ex(params);
     default:
               break;
   }
+  errno = EINVAL;
   return -1;
 }
-static struct addrinfo *_getaddrinfo(const char *node_service, const struct addrinfo *hints)
-{
-  char node_[NI_MAXHOST], service[NI_MAXSERV];
-  char *node = node_;
-  struct addrinfo *result;
-  int rc;
-  rc = split_address(node_service, node_, service);
-  if (rc != 0)
-    return NULL;
-  if (node_[0] == '\0' || strcmp(node_, "*") == 0)
-    node = NULL;
-  rc = getaddrinfo(node, service, hints, &result);
-  if (rc != 0)
-    return NULL;
-  return result;
-}
-static int _connect(const struct addrinfo *hints, const struct BuildNetParams *params)
-{
-  struct addrinfo *result, *rp;
-  int sockfd = -1;
-  const char *remote = params->remote_address;
-  result = _getaddrinfo(remote, hints);
-  if (result == NULL)
+static int _socket(int family, int socktype, int protocol, const struct BuildNetParams *params)
+{
+  if (params->flags & XNET_F_NONBLOCK)
+    socktype |= SOCK_NONBLOCK;
+  return socket(family, socktype, protocol);
+}
+// a non-blocking connect in progress counts as success
+static int _connect_to(int sockfd, const struct sockaddr *sa, socklen_t len,
+                       const struct BuildNetParams *params)
+{
+  if (connect(sockfd, sa, len) == 0)
+    return 0;
+  return (params->flags & XNET_F_NONBLOCK) && errno == EINPROGRESS ? 0 : -1;
+}
+static int _backlog(const struct BuildNetParams *params)
+{
+  return params->backlog > 0 ? params->backlog : XNET_DEFAULT_BACKLOG;
+}
+
+static int endpoint_network(const char *network, int *family, int *socktype)
+{
+  static const struct {
+    const char *name;
+    int family;
+    int socktype;
+  } networks[] = {
+    { "tcp", AF_UNSPEC, SOCK_STREAM },
+    { "tcp4", AF_INET, SOCK_STREAM },
+    { "tcp6", AF_INET6, SOCK_STREAM },
+    { "udp", AF_UNSPEC, SOCK_DGRAM },
+    { "udp4", AF_INET, SOCK_DGRAM },
+    { "udp6", AF_INET6, SOCK_DGRAM },
+    { "unix", AF_UNIX, SOCK_STREAM },
+    { "unixgram", AF_UNIX, SOCK_DGRAM },
+    { "unixpacket", AF_UNIX, SOCK_SEQPACKET },
+  };
+  for (size_t i = 0; i < sizeof(networks) / sizeof(networks[0]); i++) {
+    if (strcmp(network, networks[i].name) == 0) {
+      *family = networks[i].family;
+      *socktype = networks[i].socktype;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+static struct endpoint_addr *endpoint_push(struct Endpoint *ep, int family, int socktype)
+{
+  struct endpoint_addr *e = &ep->addrs[ep->count++];
+  memset(e, 0, sizeof(*e));
+  e->family = family;
+  e->socktype = socktype;
+  e->addr.ss_family = (sa_family_t)family;
+  e->addrlen = family == AF_INET ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+  return e;
+}
+static void endpoint_push_in(struct Endpoint *ep, int socktype, struct in_addr addr, int port)
+{
+  struct sockaddr_in *in = (struct sockaddr_in *)&endpoint_push(ep, AF_INET, socktype)->addr;
+  in->sin_addr = addr;
+  in->sin_port = htons((uint16_t)port);
+}
+static void endpoint_push_in6(struct Endpoint *ep, int socktype, const struct in6_addr *addr, int port)
+{
+  struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&endpoint_push(ep, AF_INET6, socktype)->addr;
+  in6->sin6_addr = *addr;
+  in6->sin6_port = htons((uint16_t)port);
+}
+
+// numeric host and port. 1 : resolved, 0 : needs the resolver, -1 fail
+static int endpoint_literal(struct Endpoint *ep, int family, int socktype, int passive,
+                            const char *host, size_t hostlen, int port)
+{
+  struct in_addr in;
+  struct in6_addr in6;
+  if (hostlen == 0 || (hostlen == 1 && host[0] == '*')) {
+    // same order as getaddrinfo(NULL, ...)
+    if (passive) {
+      in.s_addr = htonl(INADDR_ANY);
+      in6 = in6addr_any;
+      if (family != AF_INET6)
+        endpoint_push_in(ep, socktype, in, port);
+      if (family != AF_INET)
+        endpoint_push_in6(ep, socktype, &in6, port);
+    } else {
+      in.s_addr = htonl(INADDR_LOOPBACK);
+      in6 = in6addr_loopback;
+      if (family != AF_INET)
+        endpoint_push_in6(ep, socktype, &in6, port);
+      if (family != AF_INET6)
+        endpoint_push_in(ep, socktype, in, port);
+    }
+    return 1;
+  }
+  if (parse_ipv4(host, hostlen, &in) == 0) {
+    if (family != AF_INET6) {
+      endpoint_push_in(ep, socktype, in, port);
+      return 1;
+    }
+    // AI_V4MAPPED
+    memset(&in6, 0, sizeof(in6));
+    in6.s6_addr[10] = 0xff;
+    in6.s6_addr[11] = 0xff;
+    memcpy(&in6.s6_addr[12], &in, 4);
+    endpoint_push_in6(ep, socktype, &in6, port);
+    return 1;
+  }
+  if (parse_ipv6(host, hostlen, &in6) == 0) {
+    if (family == AF_INET) {
+      errno = EAFNOSUPPORT;
+      return -1;
+    }
+    endpoint_push_in6(ep, socktype, &in6, port);
+    return 1;
+  }
+  return 0;
+}
+
+static int endpoint_lookup(struct Endpoint *ep, int family, int socktype, int passive,
+                           const char *host, size_t hostlen, const char *service, size_t servlen)
+{
+  char node[NI_MAXHOST], serv[NI_MAXSERV];
+  struct addrinfo hints, *result, *rp;
+  int rc, n = 0;
+  memcpy(node, host, hostlen);
+  node[hostlen] = '\0';
+  memcpy(serv, service, servlen);
+  serv[servlen] = '\0';
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = family;
+  hints.ai_socktype = socktype;
+  hints.ai_flags = (passive ? AI_PASSIVE : 0) | (family == AF_INET6 ? AI_V4MAPPED : 0);
+  rc = getaddrinfo(hostlen == 0 || strcmp(node, "*") == 0 ? NULL : node, serv, &hints, &result);
+  if (rc != 0) {
+    if (rc != EAI_SYSTEM)
+      errno = rc == EAI_MEMORY ? ENOMEM : EHOSTUNREACH;
+    return -1;
+  }
+  for (rp = result; rp; rp = rp->ai_next)
+    n++;
+  ep->addrs = malloc(sizeof(*ep->addrs) * (size_t)n);
+  if (ep->addrs == NULL) {
+    freeaddrinfo(result);
     return -1;
+  }
   for (rp = result; rp; rp = rp->ai_next) {
-    sockfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-    if (sockfd == -1) continue;
-    if ((params->pre_call == NULL || params->pre_call(sockfd, params) == 0) &&
-        connect(sockfd, rp->ai_addr, rp->ai_addrlen) == 0 &&
-        (params->post_call == NULL || params->post_call(sockfd, params, NULL, rp) == 0))
-      break;
-    close(sockfd);
+    struct endpoint_addr *e = &ep->addrs[ep->count];
+    if (rp->ai_addrlen > sizeof(e->addr))
+      continue;
+    memset(e, 0, sizeof(*e));
+    memcpy(&e->addr, rp->ai_addr, rp->ai_addrlen);
+    e->addrlen = rp->ai_addrlen;
+    e->family = rp->ai_family;
+    e->socktype = rp->ai_socktype;
+    e->protocol = rp->ai_protocol;
+    ep->count++;
   }
   freeaddrinfo(result);
-  return rp ? sockfd : -1;
+  return 0;
 }
-int BindConnect(const struct addrinfo *hints, const struct BuildNetParams *params)
+
+static int endpoint_unix(struct Endpoint *ep, int socktype, const char *path)
 {
-  struct addrinfo *result_remote, *rp_remote = NULL;
-  struct addrinfo *result_local, *rp_local;
-  const char *local = params->local_address;
-  const char *remote = params->remote_address;
-  int sockfd = -1;
-  if (local == NULL)
-    return _connect(hints, params);
+  struct sockaddr_un *un;
+  size_t n = strlen(path);
+  if (n >= sizeof(un->sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  ep->addrs = malloc(sizeof(*ep->addrs));
+  if (ep->addrs == NULL)
+    return -1;
+  struct endpoint_addr *e = &ep->addrs[ep->count++];
+  memset(e, 0, sizeof(*e));
+  e->family = AF_UNIX;
+  e->socktype = socktype;
+  un = (struct sockaddr_un *)&e->addr;
+  un->sun_family = AF_UNIX;
+  memcpy(un->sun_path, path, n + 1);
+  e->addrlen = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + n + 1);
+  return 0;
+}
+
+static int endpoint_resolve(struct Endpoint *ep, int family, int socktype, int passive,
+                            const char *address)
+{
+  const char *host, *service;
+  size_t hostlen, servlen;
+  int rc, port;
+  ep->count = 0;
+  ep->addrs = NULL;
+  if (family == AF_UNIX)
+    return endpoint_unix(ep, socktype, address);
+  if (split_address(address, &host, &hostlen, &service, &servlen) != 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  port = parse_port(service, servlen);
+  if (port == -2) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (port >= 0) {
+    ep->addrs = malloc(sizeof(*ep->addrs) * 2);
+    if (ep->addrs == NULL)
+      return -1;
+    rc = endpoint_literal(ep, family, socktype, passive, host, hostlen, port);
+    if (rc != 0) {
+      if (rc == -1)
+        EndpointFree(ep);
+      return rc == 1 ? 0 : -1;
+    }
+    free(ep->addrs);
+    ep->addrs = NULL;
+  }
+  rc = endpoint_lookup(ep, family, socktype, passive, host, hostlen, service, servlen);
+  if (rc == 0 && ep->count == 0) {
+    EndpointFree(ep);
+    errno = EHOSTUNREACH;
+    return -1;
+  }
+  return rc;
+}
+
+int ResolveEndpoint(struct Endpoint *ep, const char *network, const char *address, int passive)
+{
+  int family, socktype;
+  assert(ep && network && address);
+  if (endpoint_network(network, &family, &socktype) != 0) {
+    ep->count = 0;
+    ep->addrs = NULL;
+    errno = EINVAL;
+    return -1;
+  }
+  return endpoint_resolve(ep, family, socktype, passive, address);
+}
+
+void EndpointFree(struct Endpoint *ep)
+{
+  free(ep->addrs);
+  ep->addrs = NULL;
+  ep->count = 0;
+}
 
-  result_local = _getaddrinfo(local, hints);
-  result_remote = _getaddrinfo(remote, hints);
-  if (result_local == NULL || result_remote == NULL)
-    goto null_out;
+// the hooks still see an addrinfo
+static void endpoint_addrinfo(const struct endpoint_addr *e, struct addrinfo *ai)
+{
+  memset(ai, 0, sizeof(*ai));
+  ai->ai_family = e->family;
+  ai->ai_socktype = e->socktype;
+  ai->ai_protocol = e->protocol;
+  ai->ai_addrlen = e->addrlen;
+  ai->ai_addr = (struct sockaddr *)&e->addr;
+}
 
-  for (rp_remote = result_remote; rp_remote; rp_remote = rp_remote->ai_next) {
-    for (rp_local = result_local; rp_local; rp_local = rp_local->ai_next) {
-      if (rp_remote->ai_family != rp_local->ai_family)
+static int endpoint_connect(const struct endpoint_addr *remote, const struct endpoint_addr *local,
+                            const struct BuildNetParams *params)
+{
+  struct addrinfo src, dest;
+  int err, sockfd;
+  endpoint_addrinfo(remote, &dest);
+  if (local)
+    endpoint_addrinfo(local, &src);
+  sockfd = _socket(remote->family, remote->socktype, remote->protocol, params);
+  if (sockfd != -1) {
+    if ((params->pre_call == NULL || params->pre_call(sockfd, params) == 0) &&
+        (local == NULL || bind(sockfd, src.ai_addr, src.ai_addrlen) == 0) &&
+        _connect_to(sockfd, dest.ai_addr, dest.ai_addrlen, params) == 0 &&
+        (params->post_call == NULL || params->post_call(sockfd, params, local ? &src : NULL, &dest) == 0))
+      return sockfd;
+    err = errno;
+    close(sockfd);
+  } else {
+    err = errno;
+  }
+  if (params->error_call)
+    params->error_call(params, &dest, err);
+  errno = err;
+  return -1;
+}
+
+int DialEndpoint(const struct Endpoint *remote, const struct Endpoint *local,
+                 const struct BuildNetParams *params)
+{
+  static const struct BuildNetParams defaults;
+  int sockfd;
+  if (params == NULL)
+    params = &defaults;
+  errno = EADDRNOTAVAIL;
+  for (int i = 0; i < remote->count; i++) {
+    const struct endpoint_addr *r = &remote->addrs[i];
+    if (local == NULL) {
+      sockfd = endpoint_connect(r, NULL, params);
+      if (sockfd != -1)
+        return sockfd;
+      continue;
+    }
+    for (int j = 0; j < local->count; j++) {
+      if (local->addrs[j].family != r->family)
         continue;
+      sockfd = endpoint_connect(r, &local->addrs[j], params);
+      if (sockfd != -1)
+        return sockfd;
+    }
+  }
+  return -1;
+}
 
-      sockfd = socket(rp_remote->ai_family, rp_remote->ai_socktype, rp_remote->ai_protocol);
-      if (sockfd == -1)
-        break;
-      if ((params->pre_call == NULL || params->pre_call(sockfd, params) == 0) &&
-          bind(sockfd, rp_local->ai_addr, rp_local->ai_addrlen) == 0 &&
-          connect(sockfd, rp_remote->ai_addr, rp_remote->ai_addrlen) == 0 &&
-          (params->post_call == NULL || params->post_call(sockfd, params, rp_local, rp_remote) == 0))
+// every address gets an even share of the time left, at least this much,
+// so one that does not answer leaves time for the others
+#define DIAL_MIN_ATTEMPT_MS 2000
+
+static int64_t monotonic_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int DialTimeout(const char *network, const char *address, int ms)
+{
+  static const struct BuildNetParams params = {
+    .flags = XNET_F_NONBLOCK,
+  };
+  struct Endpoint remote;
+  int sockfd = -1, flags, err = EADDRNOTAVAIL;
+  if (!network || ResolveEndpoint(&remote, network, address, 0) != 0)
+    return -1;
+  int64_t deadline = monotonic_ms() + ms;
+  for (int i = 0; i < remote.count; i++) {
+    int wait = -1;
+    if (ms >= 0) {
+      int64_t left = deadline - monotonic_ms();
+      if (left <= 0) {
+        err = ETIMEDOUT;
         break;
-      close(sockfd);
+      }
+      int64_t share = left / (remote.count - i);
+      if (share < DIAL_MIN_ATTEMPT_MS)
+        share = left < DIAL_MIN_ATTEMPT_MS ? left : DIAL_MIN_ATTEMPT_MS;
+      wait = (int)share;
+    }
+    sockfd = endpoint_connect(&remote.addrs[i], NULL, &params);
+    if (sockfd == -1) {
+      err = errno;
+      continue;
     }
-    if (sockfd != -1 && rp_local)
+    // the caller gets a blocking fd, like Dial()
+    if (WaitConnected(sockfd, wait) == 0 &&
+        (flags = fcntl(sockfd, F_GETFL)) != -1 &&
+        fcntl(sockfd, F_SETFL, flags & ~O_NONBLOCK) != -1)
       break;
+    err = errno;
+    close(sockfd);
+    sockfd = -1;
   }
-null_out:
-  if (result_remote)
-    freeaddrinfo(result_remote);
-  if (result_local)
-    freeaddrinfo(result_local);
-  return rp_remote ? sockfd : -1;
+  EndpointFree(&remote);
+  if (sockfd == -1)
+    errno = err;
+  return sockfd;
 }
-int DialTCP_ex(const struct BuildNetParams *params)
+
+int ListenEndpoint(const struct Endpoint *local, const struct BuildNetParams *params)
+{
+  static const struct BuildNetParams defaults;
+  struct addrinfo ai;
+  if (params == NULL)
+    params = &defaults;
+  errno = EADDRNOTAVAIL;
+  for (int i = 0; i < local->count; i++) {
+    const struct endpoint_addr *e = &local->addrs[i];
+    int sockfd = _socket(e->family, e->socktype, e->protocol, params);
+    if (sockfd == -1)
+      continue;
+    endpoint_addrinfo(e, &ai);
+    if ((params->pre_call == NULL || params->pre_call(sockfd, params) == 0) &&
+        bind(sockfd, ai.ai_addr, ai.ai_addrlen) == 0 &&
+        (e->socktype == SOCK_DGRAM || listen(sockfd, _backlog(params)) == 0) &&
+        (params->post_call == NULL || params->post_call(sockfd, params, &ai, NULL) == 0))
+      return sockfd;
+    int err = errno;
+    close(sockfd);
+    errno = err;
+  }
+  return -1;
+}
+
+int BindConnect(const struct addrinfo *hints, const struct BuildNetParams *params)
+{
+  struct Endpoint remote, local;
+  int sockfd = -1;
+  if (endpoint_resolve(&remote, hints->ai_family, hints->ai_socktype, 0,
+                       params->remote_address) != 0)
+    return -1;
+  if (params->local_address == NULL) {
+    sockfd = DialEndpoint(&remote, NULL, params);
+  } else if (endpoint_resolve(&local, hints->ai_family, hints->ai_socktype, 1,
+                              params->local_address) == 0) {
+    sockfd = DialEndpoint(&remote, &local, params);
+    EndpointFree(&local);
+  }
+  EndpointFree(&remote);
+  return sockfd;
+}
+
+static int _dial_ip(const struct BuildNetParams *params)
 {
-  assert(params && params->network && params->remote_address);
-  assert(memcmp(params->network, "tcp", 3) == 0);
-  //  const char *network, const char *local_address, const char *remote_address, setsockopt_fn fn
-  const char *network = params->network;
   struct addrinfo hints;
   memset(&hints, 0, sizeof(hints));
-  hints.ai_socktype = SOCK_STREAM;
-  hints.ai_flags = AI_V4MAPPED;
-  if (strcmp(network, "tcp") == 0) {
-    hints.ai_family = AF_UNSPEC;
-  } else if (strcmp(network, "tcp4") == 0) {
-    hints.ai_family = AF_INET;
-  } else if (strcmp(network, "tcp6") == 0) {
-    hints.ai_family = AF_INET6;
-  } else {
-    log_error("invalid network:%s\n", network);
+  if (endpoint_network(params->network, &hints.ai_family, &hints.ai_socktype) != 0 ||
+      hints.ai_family == AF_UNIX) {
+    log_error("invalid network:%s\n", params->network);
     return -1;
   }
   return BindConnect(&hints, params);
 }
+int DialTCP_ex(const struct BuildNetParams *params)
+{
+  assert(params && params->network && params->remote_address);
+  assert(memcmp(params->network, "tcp", 3) == 0);
+  return _dial_ip(params);
+}
 
 int DialUDP_ex(const struct BuildNetParams *params)
 {
   assert(params->network != NULL);
   assert(params->remote_address != NULL);
-  const char *network = params->network;
-  struct addrinfo hints;
-  memset(&hints, 0, sizeof(hints));
-  hints.ai_socktype = SOCK_DGRAM;
-  if (strcmp(network, "udp") == 0) {
-    hints.ai_family = AF_UNSPEC;
-  } else if (strcmp(network, "udp4") == 0) {
-    hints.ai_family = AF_INET;
-  } else if (strcmp(network, "udp6") == 0) {
-    hints.ai_family = AF_INET6;
-  } else {
-    log_error("invalid network:%s\n", network);
-    return -1;
-  }
-  return BindConnect(&hints, params);
+  return _dial_ip(params);
 }
 
 static int unix_common_prepare(const struct BuildNetParams *params, struct addrinfo *info)
@@ -249,7 +713,7 @@ static int unix_common_prepare(const struct BuildNetParams *params, struct addri
   const char *address = params->remote_address;
   if (address == NULL)
     address = params->local_address;
-  struct sockaddr_un sockaddr;
+  struct sockaddr_un *sockaddr = (struct sockaddr_un *)info->ai_addr;
   int sockfd;
 
   if (strcmp(network, "unix") == 0)
@@ -262,22 +726,22 @@ static int unix_common_prepare(const struct BuildNetParams *params, struct addri
     log_error("unknown network for unix-socket(%s)", network);
     return -1;
   }
-  if (strlen(address) >= sizeof(sockaddr.sun_path)) {
+  if (strlen(address) >= sizeof(sockaddr->sun_path)) {
     log_error("address(%s) is too long(%d)", address, strlen(address));
     return -1;
   }
-  sockfd = socket(AF_UNIX, info->ai_socktype, info->ai_protocol);
+  sockfd = _socket(AF_UNIX, info->ai_socktype, info->ai_protocol, params);
   if (sockfd == -1) {
     log_error("socket failed:%s", strerror(errno));
     return -1;
   }
 
-  sockaddr.sun_family = AF_UNIX;
-  strcpy(sockaddr.sun_path, address);
+  sockaddr->sun_family = AF_UNIX;
+  strcpy(sockaddr->sun_path, address);
 
   return sockfd;
 }
-int DialUnix_ex(const struct BuildNetParams *params)
+int DialUNIX_ex(const struct BuildNetParams *params)
 {
   struct sockaddr_un sockaddr = {
     .sun_family = AF_UNIX,
@@ -293,7 +757,7 @@ int DialUnix_ex(const struct BuildNetParams *params)
 
   if ((params->pre_call == NULL || params->pre_call(sockfd, params) == 0) &&
       (params->local_address == NULL || bind(sockfd, info.ai_addr, info.ai_addrlen) == 0) &&
-      connect(sockfd, info.ai_addr, info.ai_addrlen) == 0 &&
+      _connect_to(sockfd, info.ai_addr, info.ai_addrlen, params) == 0 &&
       (params->post_call == NULL || params->post_call(sockfd, params, &info, &info) == 0))
     return sockfd;
 
@@ -303,91 +767,28 @@ int DialUnix_ex(const struct BuildNetParams *params)
 }
 
 
+static int _listen_ip(const struct BuildNetParams *params)
+{
+  struct Endpoint ep;
+  int sockfd;
+  if (ResolveEndpoint(&ep, params->network, params->local_address, 1) != 0)
+    return -1;
+  sockfd = ListenEndpoint(&ep, params);
+  EndpointFree(&ep);
+  return sockfd;
+}
 int ListenTCP_ex(const struct BuildNetParams *params)
 {
-
   assert(params && params->network && params->local_address);
   assert(memcmp(params->network, "tcp", 3) == 0);
-  const char *network = params->network;
-  const char *address = params->local_address;
-  struct addrinfo hints;
-  struct addrinfo *result, *rp;
-  int sockfd=-1;
-  memset(&hints, 0, sizeof(hints));
-  hints.ai_socktype = SOCK_STREAM;
-  hints.ai_flags = AI_PASSIVE | AI_V4MAPPED;
-  switch (network[3]) {
-    case '\0': hints.ai_family = AF_UNSPEC;
-               break;
-    case '4': hints.ai_family = AF_INET;
-              break;
-    case '6': hints.ai_family = AF_INET6;
-              break;
-    default:
-              return -1;
-  }
-
-  result = _getaddrinfo(address, &hints);
-  if (result == NULL)
-    return -1;
-
-  for (rp = result; rp != NULL; rp = rp->ai_next) {
-    sockfd = socket(rp->ai_family, rp->ai_socktype,
-        rp->ai_protocol);
-    if (sockfd == -1)
-      continue;
-    if ((params->pre_call == NULL || params->pre_call(sockfd, params) == 0) &&
-        bind(sockfd, rp->ai_addr, rp->ai_addrlen) == 0 &&
-        listen(sockfd, 128) == 0 &&
-        (params->post_call == NULL || params->post_call(sockfd, params, rp, NULL) == 0))
-      break;
-    close(sockfd);
-  }
-  freeaddrinfo(result);           /* No longer needed */
-  return rp ? sockfd : -1;
+  return _listen_ip(params);
 }
 // if address is not null, bind address to the socket, so
 int ListenUDP_ex(const struct BuildNetParams *params)
 {
-  const char *network;
-  const char *address;
   assert(params && params->network && params->local_address);
   assert(memcmp(params->network, "udp", 3) == 0);
-  network = params->network;
-  address = params->local_address;
-  struct addrinfo hints;
-  struct addrinfo *result, *rp;
-  int rc, sockfd=-1;
-  memset(&hints, 0, sizeof(hints));
-  hints.ai_socktype = SOCK_DGRAM;
-  hints.ai_flags = AI_PASSIVE | AI_V4MAPPED;
-  switch (network[3]) {
-    case '\0': hints.ai_family = AF_UNSPEC;
-               break;
-    case '4': hints.ai_family = AF_INET;
-              break;
-    case '6': hints.ai_family = AF_INET6;
-              break;
-    default:
-              return -1;
-  }
-
-  result = _getaddrinfo(address, &hints);
-  if (result == NULL)
-    return -1;
-
-  for (rp = result; rp != NULL; rp = rp->ai_next) {
-    sockfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-    if (sockfd == -1)
-      continue;
-    if ((params->pre_call == NULL || params->pre_call(sockfd, params) == 0) &&
-        bind(sockfd, rp->ai_addr, rp->ai_addrlen) == 0 &&
-        (params->post_call == NULL && params->post_call(sockfd, params, rp, NULL) == 0))
-      break;
-    close(sockfd);
-  }
-  freeaddrinfo(result);           /* No longer needed */
-  return rp ? sockfd : -1;
+  return _listen_ip(params);
 }
 int ListenUNIX_ex(const struct BuildNetParams *params)
 {
@@ -406,7 +807,7 @@ int ListenUNIX_ex(const struct BuildNetParams *params)
 
   if ((params->pre_call == NULL || params->pre_call(sockfd, params) == 0) &&
       bind(sockfd, info.ai_addr, info.ai_addrlen) == 0 &&
-      (info.ai_socktype == SOCK_DGRAM || listen(sockfd, 128) == 0) &&
+      (info.ai_socktype == SOCK_DGRAM || listen(sockfd, _backlog(params)) == 0) &&
       (params->post_call == NULL || params->post_call(sockfd, params, &info, &info) == 0))
     return sockfd;
 
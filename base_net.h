@@ -1,16 +1,26 @@
 #ifndef XNET_BASE_NET_H_
 #define XNET_BASE_NET_H_
 
+#include <errno.h>
+#include <sys/socket.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 struct addrinfo;
-struct sockaddr;
+
+// socket() with SOCK_NONBLOCK, Dial* returns as soon as connect() is in
+// progress, wait for writable and check SO_ERROR before using the fd
+#define XNET_F_NONBLOCK (1<<0)
+
+#define XNET_DEFAULT_BACKLOG 128
 
 struct BuildNetParams {
   const char *network;
   const char *local_address;
   const char *remote_address;
+  int flags;  // XNET_F_*
+  int backlog;  // listen() backlog, 0 uses XNET_DEFAULT_BACKLOG
 
   // HOOK function: 0 <==> OK, -1 <==> FAIL
   // hook function after socket(), before any bind
@@ -21,15 +31,70 @@ struct BuildNetParams {
   int (*post_call)(int sockfd, const struct BuildNetParams *params,
                    const struct addrinfo *src, const struct addrinfo *dest);
 
+  // notification: connecting to dest failed with err, the next address
+  // (if any) is tried afterwards. Called by BindConnect()/DialEndpoint().
+  void (*error_call)(const struct BuildNetParams *params, const struct addrinfo *dest, int err);
+
   void *arg;
 };
 
+// "a.b.c.d:port", "[v6]:port" or the unix path, no allocation.
+// return the length, -1 unknown family or buffer too small
 int format_sockaddr(const struct sockaddr *sa, char *buffer, int size);
 
+// one resolved address, ready for socket()/bind()/connect()
+struct endpoint_addr {
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  int family;
+  int socktype;
+  int protocol;
+};
+
+// network + address parsed and resolved once, then used for any number of
+// dials or binds without touching the resolver again.
+struct Endpoint {
+  int count;
+  struct endpoint_addr *addrs;
+};
+
+// network, address: as for Dial()/Listen(). passive: the address is to bind,
+// an empty host or "*" is the wildcard instead of loopback.
+// numeric hosts and ports are parsed inline, only names go to getaddrinfo().
+// 0 : success, -1 fail
+int ResolveEndpoint(struct Endpoint *ep, const char *network, const char *address, int passive);
+void EndpointFree(struct Endpoint *ep);
+
+// try the addresses of remote in order. local may be NULL, otherwise the
+// socket is bound to a local address of the same family.
+// params may be NULL, its network and addresses are ignored.
+// return fd, -1 error
+int DialEndpoint(const struct Endpoint *remote, const struct Endpoint *local,
+                 const struct BuildNetParams *params);
+// return fd, -1 error
+int ListenEndpoint(const struct Endpoint *local, const struct BuildNetParams *params);
+
 // ALL network is NOT NULL
 // ALL address is NOT NULL
-// return fd, -1 error
+// the addresses of a name are tried in order, each within a share of the
+// time left. ms < 0 waits forever.
+// return fd, -1 error (errno is ETIMEDOUT if ms expired)
 int DialTimeout(const char *network, const char *address, int ms);
+// wait for a connect() started with XNET_F_NONBLOCK. ms < 0 waits forever.
+// 0 : connected, -1 fail
+int WaitConnected(int sockfd, int ms);
+
+// busy polling: a read or poll on sockfd polls the device queue for up to
+// usecs instead of sleeping. prefer asks the kernel to defer the
+// interrupts of that queue while the application keeps polling (Linux
+// 5.11). Above net.core.busy_read it needs CAP_NET_ADMIN. 0 : success, -1 fail
+int SetBusyPoll(int sockfd, int usecs, int prefer);
+// NAPI id of the rx queue the socket's packets arrive on, 0 if unknown
+// (loopback, nothing received yet), -1 fail
+int IncomingNapiId(int sockfd);
+// reactor for sockfd among ngroups, so every reactor busy polls a single
+// rx queue. -1 if the socket has no NAPI id, spread it some other way
+int NapiGroup(int sockfd, int ngroups);
 
 
 int Listen_ex(const struct BuildNetParams *params);
@@ -74,17 +139,22 @@ static inline int ListenUNIX(const char *network, const char *socket_address) {
 // address: tcp[4|6], udp[4|6] host:port, port must be number
 //          ip[4|6] not supported now
 //          unix[gram|packet] socket file path
+// tls[4|6] needs the handshake of ktls.h, use ListenTLS()/DialTLS(). Here
+// it fails with EINVAL like any unknown network
 static inline int Listen(const char *network, const char *address) {
   if (!network)
     return -1;
   switch (network[0]) {
     case 't':
+      if (network[1] != 'c')
+        break;
       return ListenTCP(network, address);
     case 'u':
       return network[1] == 'd' ? ListenUDP(network, address) : ListenUNIX(network, address);
     default:
       break;
   }
+  errno = EINVAL;
   return -1;
 }
 
@@ -140,17 +210,21 @@ static inline int DialUnix2(const char *network, const char *address) {
   return DialUNIX_ex(&params);
 }
 
+// network, address: as for Listen()
 static inline int Dial(const char *network, const char *address) {
   if (!network)
     return -1;
   switch (network[0]) {
     case 't':
+      if (network[1] != 'c')
+        break;
       return DialTCP(network, address);
     case 'u':
       return network[1] == 'd' ? DialUDP(network, address) : DialUnix(network, address);
     default:
       break;
   }
+  errno = EINVAL;
   return -1;
 }
 
@@ -0,0 +1,114 @@
+//
+// Microbenchmark of balancer_pick().
+//
+// Every thread picks in a tight loop, once with the pick alone and once
+// bracketed by balancer_begin()/balancer_end() the way a request would
+// be, for each policy. With several threads the backend counters are
+// shared, which is what the per-backend cache lines are for.
+//
+// usage: balancer_bench [-b backends] [-t threads] [-n picks] [-e ejected]
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "../balancer.h"
+
+struct bench {
+  struct balancer *b;
+  long picks;
+  int bracket;
+  uint64_t sink;
+};
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void *bench_main(void *arg)
+{
+  struct bench *t = arg;
+  uint64_t sink = 0;
+  for (long i = 0; i < t->picks; i++) {
+    int k = balancer_pick(t->b, (uint64_t)i * 0x9E3779B97F4A7C15ULL);
+    if (t->bracket) {
+      balancer_begin(t->b, k);
+      balancer_end(t->b, k, 100000 + (i & 1023));
+    }
+    sink += (uint64_t)k;
+  }
+  t->sink = sink;
+  return NULL;
+}
+
+static void run(int policy, int nbackends, int nthreads, long picks, int nejected)
+{
+  static const char *const names[] = { "p2c", "ewma", "hash" };
+  struct balancer_options opts = { .policy = policy, .eject_failures = 1,
+                                   .eject_ms = 600000, .max_eject_ms = 600000,
+                                   .max_eject_percent = 100 };
+  char **addrs = malloc(sizeof(char *) * (size_t)nbackends);
+  for (int i = 0; i < nbackends; i++) {
+    addrs[i] = malloc(32);
+    snprintf(addrs[i], 32, "127.0.0.1:%d", 20000 + i);
+  }
+  struct balancer *b = balancer_create("tcp4", (const char *const *)addrs, nbackends, &opts);
+  if (!b) {
+    perror("balancer_create");
+    exit(1);
+  }
+  // ejected backends make every pick read the clock
+  for (int i = 0; i < nejected && i < nbackends; i++)
+    balancer_report(b, i, 0);
+
+  for (int bracket = 0; bracket < 2; bracket++) {
+    struct bench *t = calloc((size_t)nthreads, sizeof(*t));
+    pthread_t *th = malloc(sizeof(pthread_t) * (size_t)nthreads);
+    uint64_t start = now_ns();
+    for (int i = 0; i < nthreads; i++) {
+      t[i].b = b;
+      t[i].picks = picks;
+      t[i].bracket = bracket;
+      pthread_create(&th[i], NULL, bench_main, &t[i]);
+    }
+    for (int i = 0; i < nthreads; i++)
+      pthread_join(th[i], NULL);
+    double ns = (double)(now_ns() - start);
+    printf("%-5s %-13s %6.1f ns/pick per thread, %.1f M picks/s\n",
+           names[policy], bracket ? "begin+end" : "pick", ns / (double)picks,
+           picks * nthreads / ns * 1e3);
+    free(th);
+    free(t);
+  }
+  balancer_destroy(b);
+  for (int i = 0; i < nbackends; i++)
+    free(addrs[i]);
+  free(addrs);
+}
+
+int main(int ac, char *av[])
+{
+  int nbackends = 16, nthreads = 1, nejected = 0, opt;
+  long picks = 10000000;
+  while ((opt = getopt(ac, av, "b:t:n:e:")) != -1) {
+    switch (opt) {
+      case 'b': nbackends = atoi(optarg); break;
+      case 't': nthreads = atoi(optarg); break;
+      case 'n': picks = atol(optarg); break;
+      case 'e': nejected = atoi(optarg); break;
+      default:
+        fprintf(stderr, "usage: %s [-b backends] [-t threads] [-n picks] [-e ejected]\n", av[0]);
+        return 1;
+    }
+  }
+  if (nbackends < 1 || nthreads < 1 || picks < 1)
+    return 1;
+  printf("backends=%d threads=%d picks=%ld ejected=%d\n", nbackends, nthreads, picks, nejected);
+  run(BALANCER_P2C, nbackends, nthreads, picks, nejected);
+  run(BALANCER_EWMA, nbackends, nthreads, picks, nejected);
+  run(BALANCER_HASH, nbackends, nthreads, picks, nejected);
+  return 0;
+}
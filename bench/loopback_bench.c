@@ -0,0 +1,604 @@
+//
+// Loopback benchmark: one client and one server thread over 127.0.0.1.
+//
+//   stream  the client sends -n messages of -s bytes, the server reads them
+//           with zb_appendSocket(); reports throughput
+//   pingpong the server echoes every message; reports round-trip latency
+//
+// usage: loopback_bench [-m plain|tls] [-t stream|pingpong] [-s size] [-n count]
+//                       [-z none|frame|batch] [-l level] [-r MB/s] [-p repeat|text|random]
+//                       [-k] [-b spin_us]
+//
+// "tls" needs a build with XNET_WITH_KTLS and a kernel with the tls module;
+// it uses an in-memory self-signed certificate.
+//
+// -z needs a build with XNET_WITH_CODEC (zlib). It runs the stream test
+// through the codec stage, one block per message
+// or per 64K batch; -l is the zlib level, -r the link rate the adaptive
+// skip assumes, -p the payload. Reports the ratio and the CPU time of
+// both threads per GB of payload.
+//
+// -k runs the pingpong server on a reactor with kernel software timestamps
+// and breaks its latency down into kernel queue, loop wait and handler
+// time for the requests, qdisc and driver time for the echoes.
+//
+// -b runs both ends of pingpong on a reactor that spins up to spin_us
+// before it parks in epoll_wait (reactor_set_spin()), 0 parks right away.
+// Compare -b 0 with -b 50 for what the wakeups cost: spinning only pays
+// when client and server have a core each.
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "../base_net.h"
+#include "../packet.h"
+#include "../reactor.h"
+#include "../tstamp.h"
+#ifdef XNET_WITH_CODEC
+#include "../codec.h"
+#endif
+#ifdef XNET_WITH_KTLS
+#include <openssl/evp.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include "../ktls.h"
+#endif
+
+enum { MODE_PLAIN, MODE_TLS };
+enum { TEST_STREAM, TEST_PINGPONG };
+enum { CODEC_NONE = -1 };
+#ifndef XNET_WITH_CODEC
+enum { CODEC_PER_FRAME, CODEC_PER_BATCH };
+#endif
+enum { PAYLOAD_REPEAT, PAYLOAD_TEXT, PAYLOAD_RANDOM };
+
+struct bench {
+  int mode;
+  int test;
+  int size;
+  long count;
+  int listen_fd;
+  int codec;  // CODEC_NONE or CODEC_PER_*
+  int level;
+  int64_t link_rate;
+  int payload;
+  uint64_t received;  // plain bytes decoded by the server
+  int stamp;
+  struct ts_latency *latency;  // -k, filled by the server
+  int spin_us;                 // -b, -1: blocking reads, no reactor
+#ifdef XNET_WITH_KTLS
+  struct ktls_ctx *server_ctx;
+  struct ktls_ctx *client_ctx;
+#endif
+};
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static int write_all(int fd, const char *data, int len)
+{
+  while (len > 0) {
+    ssize_t n = send(fd, data, (size_t)len, MSG_NOSIGNAL);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    data += n;
+    len -= (int)n;
+  }
+  return 0;
+}
+
+// read exactly n bytes into zb
+static int read_full(int fd, struct zbytes *zb, int n)
+{
+  zb_zero(zb);
+  while (zb_available(zb) < n) {
+    if (zb_appendSocket(fd, zb) <= 0)
+      return -1;
+  }
+  return 0;
+}
+
+#ifdef XNET_WITH_KTLS
+static int load_selfsigned(struct ktls_ctx *ctx)
+{
+  SSL_CTX *ssl_ctx = ktls_ctx_ssl_ctx(ctx);
+  EVP_PKEY *pkey = EVP_EC_gen("P-256");
+  X509 *x509 = X509_new();
+  int ok = pkey && x509 &&
+      X509_set_version(x509, 2) &&
+      ASN1_INTEGER_set(X509_get_serialNumber(x509), 1) &&
+      X509_gmtime_adj(X509_getm_notBefore(x509), 0) &&
+      X509_gmtime_adj(X509_getm_notAfter(x509), 3600) &&
+      X509_set_pubkey(x509, pkey) &&
+      X509_NAME_add_entry_by_txt(X509_get_subject_name(x509), "CN", MBSTRING_ASC,
+                                 (const unsigned char *)"localhost", -1, -1, 0) &&
+      X509_set_issuer_name(x509, X509_get_subject_name(x509)) &&
+      X509_sign(x509, pkey, EVP_sha256()) &&
+      SSL_CTX_use_certificate(ssl_ctx, x509) == 1 &&
+      SSL_CTX_use_PrivateKey(ssl_ctx, pkey) == 1;
+  X509_free(x509);
+  EVP_PKEY_free(pkey);
+  return ok ? 0 : -1;
+}
+#endif
+
+// messages are taken at varying offsets of a pool, a batch does not
+// compress better just because it repeats the same message
+#define PAYLOAD_POOL (1 << 20)
+
+static const char *payload_at(const char *pool, long i)
+{
+  return pool + (size_t)(i * 65537) % PAYLOAD_POOL;
+}
+
+static void fill_payload(char *msg, int size, int payload)
+{
+  static const char *const words[] = {
+    "the ", "request ", "backend ", "latency ", "buffer ", "of ", "and ", "socket ",
+    "GET /api/v1/items ", "200 OK ", "content-length: ", "1024\r\n", "user_id=", "42, ",
+  };
+  uint64_t x = 0x9E3779B97F4A7C15ULL;
+  int i = 0;
+  if (payload == PAYLOAD_REPEAT) {
+    memset(msg, 'x', (size_t)size);
+    return;
+  }
+  while (i < size) {
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    uint64_t r = x * 0x2545F4914F6CDD1DULL;
+    if (payload == PAYLOAD_RANDOM) {
+      for (int k = 0; k < 8 && i < size; k++)
+        msg[i++] = (char)(r >> (k * 8));
+    } else {
+      const char *w = words[r % (sizeof(words) / sizeof(words[0]))];
+      while (*w && i < size)
+        msg[i++] = *w++;
+    }
+  }
+}
+
+static uint64_t cpu_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+#ifdef XNET_WITH_CODEC
+// stream test through the codec stage
+static void server_decode(struct bench *b, int fd)
+{
+  struct codec codec;
+  struct zbytes in, plain;
+  codec_init(&codec, NULL);
+  zb_init(&in, 1 << 17);
+  zb_init(&plain, 1 << 17);
+  for (;;) {
+    if (zb_free_size(&in) == 0 && zb_reserve(&in, 1 << 16) != 0)
+      break;
+    if (zb_appendSocket(fd, &in) <= 0)
+      break;
+    int n = codec_decode(&codec, &in, &plain);
+    if (n < 0) {
+      perror("codec_decode");
+      break;
+    }
+    b->received += (uint64_t)n;
+    zb_zero(&plain);
+  }
+  codec_destroy(&codec);
+  zb_destroy(&in);
+  zb_destroy(&plain);
+  codec_thread_release();
+}
+
+static int client_encode(struct bench *b, int fd, const char *msg, struct codec_stats *stats)
+{
+  struct codec_options opts = {
+    .mode = b->codec,
+    .level = b->level,
+    .link_bytes_per_sec = b->link_rate,
+  };
+  struct codec codec;
+  struct zbytes wire;
+  int rc = 0;
+  codec_init(&codec, &opts);
+  zb_init(&wire, 1 << 17);
+  for (long i = 0; i < b->count && rc == 0; i++) {
+    rc = codec_encode(&codec, &wire, payload_at(msg, i), b->size);
+    if (rc == 0 && !zb_empty(&wire)) {
+      rc = write_all(fd, zb_data(&wire), zb_available(&wire));
+      zb_zero(&wire);
+    }
+  }
+  if (rc == 0 && codec_flush(&codec, &wire) == 0 && !zb_empty(&wire))
+    rc = write_all(fd, zb_data(&wire), zb_available(&wire));
+  *stats = codec.stats;
+  codec_destroy(&codec);
+  zb_destroy(&wire);
+  codec_thread_release();
+  return rc;
+}
+#endif
+
+// pingpong on a reactor, -k or -b
+struct reactor_server {
+  struct bench *b;
+  struct zbytes zb;
+  struct ts_tx tx;
+  long echoed;
+  int done;
+};
+
+static void server_on_io(struct reactor *r, int fd, uint32_t events, void *arg)
+{
+  struct reactor_server *s = arg;
+  uint64_t rx_ns = 0, read_ns = 0;
+  int n;
+  if ((events & EPOLLERR) && s->b->stamp)
+    ts_tx_drain(fd, &s->tx, s->b->latency);
+  if (!(events & (EPOLLIN | EPOLLHUP)))
+    return;
+  if (zb_free_size(&s->zb) == 0)
+    zb_move(&s->zb);
+  if (s->b->stamp) {
+    read_ns = ts_now_ns();
+    n = zb_appendSocketTs(fd, &s->zb, &rx_ns);
+  } else {
+    n = zb_appendSocket(fd, &s->zb);
+  }
+  if (n <= 0) {
+    s->done = 1;
+    return;
+  }
+  while (zb_available(&s->zb) >= s->b->size) {
+    uint64_t start = s->b->stamp ? ts_now_ns() : 0;
+    if (write_all(fd, zb_data(&s->zb), s->b->size) != 0) {
+      s->done = 1;
+      return;
+    }
+    if (s->b->stamp)
+      ts_tx_sent(&s->tx, s->b->size, start);
+    zb_skip(&s->zb, s->b->size);
+    s->echoed++;
+  }
+  zb_move(&s->zb);
+  if (s->b->stamp)
+    ts_latency_rx(s->b->latency, rx_ns, reactor_wake_ns(r), read_ns, ts_now_ns());
+  if (s->echoed == s->b->count)
+    s->done = 1;
+}
+
+static struct reactor *bench_reactor(struct bench *b)
+{
+  struct reactor *r = reactor_create(0);
+  if (r && b->spin_us > 0 && reactor_set_spin(r, 0, b->spin_us) != 0) {
+    reactor_destroy(r);
+    return NULL;
+  }
+  return r;
+}
+
+static void print_spin(struct reactor *r, const char *who)
+{
+  struct reactor_spin_stats st;
+  reactor_get_spin_stats(r, &st);
+  if (st.hits + st.parks)
+    printf("%s spin: hits=%lu parks=%lu spun=%.3fs budget=%dus\n", who,
+           (unsigned long)st.hits, (unsigned long)st.parks, st.spin_ns / 1e9, st.budget_us);
+}
+
+static void server_reactor(struct bench *b, int fd)
+{
+  struct reactor_server s = { .b = b };
+  struct reactor *r = bench_reactor(b);
+  if (!r || (b->stamp && ts_enable(fd, TS_RX | TS_TX) != 0)) {
+    perror("server reactor");
+    if (r)
+      reactor_destroy(r);
+    return;
+  }
+  zb_init(&s.zb, b->size > (1 << 16) ? b->size : (1 << 16));
+  ts_tx_init(&s.tx, 1);
+  reactor_stamp_wakeups(r, b->stamp);
+  reactor_add(r, fd, EPOLLIN, server_on_io, &s);
+  while (!s.done && reactor_run_once(r, -1) != -1)
+    ;
+  // stamps of the last echoes
+  if (b->stamp)
+    ts_tx_drain(fd, &s.tx, b->latency);
+  print_spin(r, "server");
+  reactor_remove(r, fd);
+  reactor_destroy(r);
+  zb_destroy(&s.zb);
+}
+
+static int bench_accept(struct bench *b)
+{
+#ifdef XNET_WITH_KTLS
+  if (b->mode == MODE_TLS)
+    return AcceptTLS(b->listen_fd, b->server_ctx);
+#endif
+  return accept(b->listen_fd, NULL, NULL);
+}
+
+static int bench_dial(struct bench *b, const char *address)
+{
+#ifdef XNET_WITH_KTLS
+  if (b->mode == MODE_TLS)
+    return DialTLS("tls4", address, b->client_ctx);
+#endif
+  return DialTCP("tcp4", address);
+}
+
+static void *server_main(void *arg)
+{
+  struct bench *b = arg;
+  struct zbytes zb;
+  int fd = bench_accept(b);
+  if (fd == -1) {
+    perror("server accept");
+    return NULL;
+  }
+  zb_init(&zb, b->size > (1 << 16) ? b->size : (1 << 16));
+#ifdef XNET_WITH_CODEC
+  if (b->test == TEST_STREAM && b->codec != CODEC_NONE) {
+    server_decode(b, fd);
+  } else
+#endif
+  if (b->stamp || b->spin_us >= 0) {
+    server_reactor(b, fd);
+  } else if (b->test == TEST_STREAM) {
+    // drain everything, the buffer is reused once it is full
+    for (;;) {
+      if (zb_free_size(&zb) == 0)
+        zb_zero(&zb);
+      if (zb_appendSocket(fd, &zb) <= 0)
+        break;
+    }
+  } else {
+    for (long i = 0; i < b->count; i++) {
+      if (read_full(fd, &zb, b->size) != 0 || write_all(fd, zb_data(&zb), b->size) != 0)
+        break;
+    }
+  }
+  zb_destroy(&zb);
+  close(fd);
+  return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+struct reactor_client {
+  struct zbytes *zb;
+  int failed;
+};
+
+static void client_on_io(struct reactor *r, int fd, uint32_t events, void *arg)
+{
+  struct reactor_client *c = arg;
+  (void)r;
+  (void)events;
+  if (zb_appendSocket(fd, c->zb) <= 0)
+    c->failed = 1;
+}
+
+// pingpong client on a reactor, -b
+static int client_reactor(struct bench *b, int fd, const char *msg, struct zbytes *zb,
+                          uint64_t *rtt)
+{
+  struct reactor_client c = { .zb = zb };
+  struct reactor *r = bench_reactor(b);
+  if (!r || reactor_add(r, fd, EPOLLIN, client_on_io, &c) != 0) {
+    perror("client reactor");
+    if (r)
+      reactor_destroy(r);
+    return -1;
+  }
+  for (long i = 0; i < b->count && !c.failed; i++) {
+    uint64_t start = now_ns();
+    zb_zero(zb);
+    if (write_all(fd, msg, b->size) != 0)
+      break;
+    while (zb_available(zb) < b->size && !c.failed) {
+      if (reactor_run_once(r, -1) == -1)
+        c.failed = 1;
+    }
+    rtt[i] = now_ns() - start;
+  }
+  print_spin(r, "client");
+  reactor_remove(r, fd);
+  reactor_destroy(r);
+  return c.failed ? -1 : 0;
+}
+
+static int client_run(struct bench *b, const char *address)
+{
+  struct zbytes zb;
+  char *msg = malloc((size_t)b->size + PAYLOAD_POOL);
+  fill_payload(msg, b->size + PAYLOAD_POOL, b->payload);
+  int fd = bench_dial(b, address);
+  if (fd == -1) {
+    perror("dial");
+    return -1;
+  }
+  zb_init(&zb, b->size);
+  if (b->test == TEST_STREAM) {
+#ifdef XNET_WITH_CODEC
+    struct codec_stats cs = { 0 };
+#endif
+    uint64_t start = now_ns(), cpu = cpu_ns();
+#ifdef XNET_WITH_CODEC
+    if (b->codec != CODEC_NONE) {
+      if (client_encode(b, fd, msg, &cs) != 0)
+        return -1;
+    } else
+#endif
+    {
+      for (long i = 0; i < b->count; i++) {
+        if (write_all(fd, payload_at(msg, i), b->size) != 0)
+          return -1;
+      }
+    }
+    shutdown(fd, SHUT_WR);
+    while (zb_appendSocket(fd, &zb) > 0)
+      zb_zero(&zb);
+    double sec = (now_ns() - start) / 1e9;
+    double total = b->size * (double)b->count;
+    printf("stream   size=%d count=%ld  %.2f MB/s  %.0f msg/s  cpu %.2f s/GB\n",
+           b->size, b->count, total / sec / 1e6, b->count / sec,
+           (cpu_ns() - cpu) / 1e9 / (total / 1e9));
+#ifdef XNET_WITH_CODEC
+    if (b->codec != CODEC_NONE)
+      printf("codec    wire=%.2f MB ratio=%.2f  deflated=%lu stored=%lu skipped=%lu  %.2f s/GB deflating\n",
+             cs.wire_bytes / 1e6, cs.wire_bytes ? (double)cs.plain_bytes / cs.wire_bytes : 0.0,
+             (unsigned long)cs.deflated, (unsigned long)cs.stored, (unsigned long)cs.skipped,
+             cs.deflate_ns / 1e9 / (total / 1e9));
+#endif
+  } else {
+    uint64_t *rtt = malloc(sizeof(uint64_t) * (size_t)b->count);
+    if (b->spin_us >= 0) {
+      if (client_reactor(b, fd, msg, &zb, rtt) != 0)
+        return -1;
+    } else {
+      for (long i = 0; i < b->count; i++) {
+        uint64_t start = now_ns();
+        if (write_all(fd, msg, b->size) != 0 || read_full(fd, &zb, b->size) != 0)
+          return -1;
+        rtt[i] = now_ns() - start;
+      }
+    }
+    qsort(rtt, (size_t)b->count, sizeof(uint64_t), cmp_u64);
+    printf("pingpong size=%d count=%ld  p50=%.1fus p99=%.1fus p99.9=%.1fus\n",
+           b->size, b->count, rtt[b->count / 2] / 1e3,
+           rtt[(long)(b->count * 0.99)] / 1e3, rtt[(long)(b->count * 0.999)] / 1e3);
+    free(rtt);
+  }
+  zb_destroy(&zb);
+  close(fd);
+  free(msg);
+  return 0;
+}
+
+int main(int ac, char *av[])
+{
+  struct bench b = {
+    .mode = MODE_PLAIN,
+    .test = TEST_STREAM,
+    .size = 16384,
+    .count = 100000,
+    .codec = CODEC_NONE,
+    .spin_us = -1,
+  };
+  int opt;
+  while ((opt = getopt(ac, av, "m:t:s:n:z:l:r:p:kb:")) != -1) {
+    switch (opt) {
+      case 'm': b.mode = strcmp(optarg, "tls") == 0 ? MODE_TLS : MODE_PLAIN; break;
+      case 't': b.test = strcmp(optarg, "pingpong") == 0 ? TEST_PINGPONG : TEST_STREAM; break;
+      case 's': b.size = atoi(optarg); break;
+      case 'n': b.count = atol(optarg); break;
+      case 'z': b.codec = strcmp(optarg, "frame") == 0 ? CODEC_PER_FRAME :
+                          strcmp(optarg, "batch") == 0 ? CODEC_PER_BATCH : CODEC_NONE; break;
+      case 'l': b.level = atoi(optarg); break;
+      case 'r': b.link_rate = atol(optarg) * 1000000L; break;
+      case 'p': b.payload = strcmp(optarg, "text") == 0 ? PAYLOAD_TEXT :
+                            strcmp(optarg, "random") == 0 ? PAYLOAD_RANDOM : PAYLOAD_REPEAT; break;
+      case 'k': b.stamp = 1; break;
+      case 'b': b.spin_us = atoi(optarg); break;
+      default:
+        fprintf(stderr, "usage: %s [-m plain|tls] [-t stream|pingpong] [-s size] [-n count]\n"
+                        "          [-z none|frame|batch] [-l level] [-r MB/s] [-p repeat|text|random]\n"
+                        "          [-k] [-b spin_us]\n", av[0]);
+        return 1;
+    }
+  }
+  if (b.size <= 0 || b.count <= 0)
+    return 1;
+  if (b.codec != CODEC_NONE && b.test != TEST_STREAM) {
+    fprintf(stderr, "-z needs -t stream\n");
+    return 1;
+  }
+  if (b.stamp && (b.test != TEST_PINGPONG || b.mode != MODE_PLAIN)) {
+    fprintf(stderr, "-k needs -t pingpong and -m plain\n");
+    return 1;
+  }
+  if (b.spin_us >= 0 && b.test != TEST_PINGPONG) {
+    fprintf(stderr, "-b needs -t pingpong\n");
+    return 1;
+  }
+#ifndef XNET_WITH_CODEC
+  if (b.codec != CODEC_NONE) {
+    fprintf(stderr, "built without XNET_WITH_CODEC\n");
+    return 1;
+  }
+#endif
+#ifdef XNET_WITH_KTLS
+  if (b.mode == MODE_TLS) {
+    b.server_ctx = ktls_ctx_server(NULL, NULL);
+    b.client_ctx = ktls_ctx_client(NULL);
+    if (!b.server_ctx || !b.client_ctx || load_selfsigned(b.server_ctx) != 0) {
+      fprintf(stderr, "tls setup failed\n");
+      return 1;
+    }
+  }
+#else
+  if (b.mode == MODE_TLS) {
+    fprintf(stderr, "built without XNET_WITH_KTLS\n");
+    return 1;
+  }
+#endif
+
+  b.listen_fd = ListenTCP("tcp4", "127.0.0.1:0");
+  struct sockaddr_in sin;
+  socklen_t len = sizeof(sin);
+  if (b.listen_fd == -1 || getsockname(b.listen_fd, (struct sockaddr *)&sin, &len) == -1) {
+    perror("listen");
+    return 1;
+  }
+  char address[32];
+  snprintf(address, sizeof(address), "127.0.0.1:%d", ntohs(sin.sin_port));
+
+  if (b.stamp) {
+    b.latency = malloc(sizeof(*b.latency));
+    ts_latency_init(b.latency);
+  }
+
+  pthread_t server;
+  pthread_create(&server, NULL, server_main, &b);
+  printf("mode=%s\n", b.mode == MODE_TLS ? "tls" : "plain");
+  int rc = client_run(&b, address);
+  pthread_join(server, NULL);
+  if (b.codec != CODEC_NONE && b.received != (uint64_t)b.size * (uint64_t)b.count) {
+    fprintf(stderr, "server decoded %lu bytes\n", (unsigned long)b.received);
+    rc = -1;
+  }
+  if (b.stamp) {
+    printf("server latency breakdown, us\n");
+    ts_latency_print(b.latency, stdout);
+    free(b.latency);
+  }
+  close(b.listen_fd);
+#ifdef XNET_WITH_KTLS
+  ktls_ctx_free(b.server_ctx);
+  ktls_ctx_free(b.client_ctx);
+#endif
+  return rc == 0 ? 0 : 1;
+}
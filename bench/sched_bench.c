@@ -0,0 +1,242 @@
+//
+// Skewed-load benchmark for the connection task scheduler.
+//
+// An open-loop producer writes requests to a set of socket pairs whose
+// load follows a zipf distribution. A reactor thread owns the read ends:
+// it reads them with zb_appendSocket() and hands the buffer to the
+// scheduler as a sched_conn_task, re-arming the read interest once the
+// task is done. Connection i is homed on worker i % workers, the way
+// SO_REUSEPORT hashing would spread them over reactors. The same trace
+// runs with static hashing (SCHED_F_NOSTEAL) and with work stealing, and
+// the request latency percentiles of both runs are printed.
+//
+// usage: sched_bench [-w workers] [-c connections] [-n requests]
+//                    [-u work_us] [-s zipf_skew] [-l load_factor]
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "../reactor.h"
+#include "../sched.h"
+
+// a request carries the time it was due to be sent, ns
+#define REQUEST_SIZE 8
+
+struct bench_conn {
+  struct sched_conn_task ct;
+  struct handler h;
+  struct reactor *r;
+  struct sched *s;
+  int wfd;
+  int in_flight;  // reactor thread only
+};
+
+static uint64_t g_work_ns;
+static uint64_t *g_latency;
+static int g_completed;
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void spin_ns(uint64_t ns)
+{
+  uint64_t end = now_ns() + ns;
+  while (now_ns() < end)
+    ;
+}
+
+static int request_frame(const struct zbytes *zb)
+{
+  return zb_available(zb) >= REQUEST_SIZE ? REQUEST_SIZE : 0;
+}
+
+static int request_process(char *data, int length)
+{
+  uint64_t due;
+  (void)length;
+  memcpy(&due, data, sizeof(due));
+  spin_ns(g_work_ns);
+  int i = __atomic_fetch_add(&g_completed, 1, __ATOMIC_RELAXED);
+  // latency is measured from the intended send time (open loop)
+  g_latency[i] = now_ns() - due;
+  return 0;
+}
+
+// reactor thread: the task gave the buffer back
+static void conn_rearm(void *arg)
+{
+  struct bench_conn *c = arg;
+  c->in_flight = 0;
+  reactor_modify(c->r, c->h.sockfd, EPOLLIN);
+}
+
+// worker thread
+static void conn_done(struct sched_conn_task *ct, int rc)
+{
+  struct bench_conn *c = ct->arg;
+  if (rc < 0)
+    fprintf(stderr, "conn %d: framing failed\n", c->h.sockfd);
+  reactor_post(c->r, conn_rearm, c);
+}
+
+static void conn_on_io(struct reactor *r, int fd, uint32_t events, void *arg)
+{
+  struct bench_conn *c = arg;
+  (void)events;
+  if (c->in_flight)
+    return;
+  if (zb_free_size(&c->h.buffer) == 0)
+    zb_move(&c->h.buffer);
+  if (zb_appendSocket(fd, &c->h.buffer) <= 0)
+    return;
+  // one task per connection in flight, the socket buffers the rest
+  c->in_flight = 1;
+  reactor_modify(r, fd, 0);
+  sched_submit(c->s, &c->ct.task);
+}
+
+static void *reactor_main(void *arg)
+{
+  reactor_run(arg);
+  return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void run(const char *name, int flags, int workers, int nconns, int nreq,
+                const int *trace, uint64_t interval_ns)
+{
+  struct bench_conn *conns = calloc((size_t)nconns, sizeof(*conns));
+  struct reactor *r = reactor_create(0);
+  struct sched *s = sched_create(workers, flags);
+  if (!conns || !r || !s) {
+    fprintf(stderr, "setup failed\n");
+    exit(1);
+  }
+  for (int i = 0; i < nconns; i++) {
+    struct bench_conn *c = &conns[i];
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+      perror("socketpair");
+      exit(1);
+    }
+    fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+    zb_init(&c->h.buffer, 1 << 12);
+    c->h.sockfd = sv[0];
+    c->wfd = sv[1];
+    c->r = r;
+    c->s = s;
+    sched_conn_task_init(&c->ct, &c->h, request_frame, request_process, conn_done, c);
+    // home on i % workers rather than on the fd, pairs use two fds each
+    c->ct.task.affinity = (unsigned)i;
+    reactor_add(r, sv[0], EPOLLIN, conn_on_io, c);
+  }
+  g_completed = 0;
+  pthread_t loop;
+  pthread_create(&loop, NULL, reactor_main, r);
+
+  uint64_t begin = now_ns();
+  for (int i = 0; i < nreq; i++) {
+    uint64_t due = begin + interval_ns * (uint64_t)i;
+    // sleep rather than spin, the producer must not take a worker's core
+    if (now_ns() < due) {
+      struct timespec ts = { (time_t)(due / 1000000000ULL), (long)(due % 1000000000ULL) };
+      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+    }
+    if (write(conns[trace[i]].wfd, &due, sizeof(due)) != sizeof(due)) {
+      perror("write");
+      exit(1);
+    }
+  }
+  while (__atomic_load_n(&g_completed, __ATOMIC_RELAXED) < nreq)
+    usleep(1000);
+  uint64_t elapsed = now_ns() - begin;
+
+  struct sched_stats stats;
+  sched_get_stats(s, &stats);
+  sched_destroy(s);
+  reactor_stop(r);
+  pthread_join(loop, NULL);
+
+  qsort(g_latency, (size_t)nreq, sizeof(uint64_t), cmp_u64);
+  printf("%-8s req/s=%.0f p50=%.1fus p99=%.1fus p99.9=%.1fus max=%.1fus stolen=%llu\n",
+         name, nreq * 1e9 / (double)elapsed,
+         g_latency[nreq / 2] / 1e3,
+         g_latency[(int)(nreq * 0.99)] / 1e3,
+         g_latency[(int)(nreq * 0.999)] / 1e3,
+         g_latency[nreq - 1] / 1e3,
+         (unsigned long long)stats.stolen);
+
+  for (int i = 0; i < nconns; i++) {
+    reactor_remove(r, conns[i].h.sockfd);
+    close(conns[i].h.sockfd);
+    close(conns[i].wfd);
+    zb_destroy(&conns[i].h.buffer);
+  }
+  reactor_destroy(r);
+  free(conns);
+}
+
+int main(int ac, char *av[])
+{
+  int workers = 4, nconns = 64, nreq = 200000, opt;
+  double work_us = 20, skew = 1.2, load = 0.7;
+  while ((opt = getopt(ac, av, "w:c:n:u:s:l:")) != -1) {
+    switch (opt) {
+      case 'w': workers = atoi(optarg); break;
+      case 'c': nconns = atoi(optarg); break;
+      case 'n': nreq = atoi(optarg); break;
+      case 'u': work_us = atof(optarg); break;
+      case 's': skew = atof(optarg); break;
+      case 'l': load = atof(optarg); break;
+      default:
+        fprintf(stderr, "usage: %s [-w workers] [-c connections] [-n requests] "
+                        "[-u work_us] [-s zipf_skew] [-l load_factor]\n", av[0]);
+        return 1;
+    }
+  }
+  if (workers < 1 || nconns < 1 || nreq < 1 || load <= 0)
+    return 1;
+
+  // zipf cdf over connections, the heaviest ones are the lowest ids
+  double *cdf = malloc(sizeof(double) * (size_t)nconns), sum = 0;
+  for (int i = 0; i < nconns; i++) {
+    sum += 1.0 / pow(i + 1, skew);
+    cdf[i] = sum;
+  }
+  int *trace = malloc(sizeof(int) * (size_t)nreq);
+  srand(42);
+  for (int i = 0; i < nreq; i++) {
+    double x = sum * rand() / ((double)RAND_MAX + 1);
+    int c = 0;
+    while (c < nconns - 1 && cdf[c] < x)
+      c++;
+    trace[i] = c;
+  }
+  g_latency = malloc(sizeof(uint64_t) * (size_t)nreq);
+  g_work_ns = (uint64_t)(work_us * 1000);
+  uint64_t interval_ns = (uint64_t)(work_us * 1000 / (workers * load));
+
+  printf("workers=%d connections=%d requests=%d work=%.1fus skew=%.2f load=%.2f\n",
+         workers, nconns, nreq, work_us, skew, load);
+  run("static", SCHED_F_NOSTEAL, workers, nconns, nreq, trace, interval_ns);
+  run("steal", 0, workers, nconns, nreq, trace, interval_ns);
+
+  free(g_latency);
+  free(trace);
+  free(cdf);
+  return 0;
+}
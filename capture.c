@@ -0,0 +1,462 @@
+#include "capture.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define CAPTURE_MAGIC "XNETCAP1"
+#define CAPTURE_DEFAULT_SEGMENT (64LL << 20)
+#define CAPTURE_MIN_SEGMENT (64LL << 10)
+// a chunk is split over two segments only if at least this much fits
+#define CAPTURE_MIN_PIECE 512
+
+struct capture_header {
+  char magic[8];
+  uint64_t index;
+  uint64_t used;  // record bytes, set when the segment is finished
+  uint64_t start_ns;       // CLOCK_REALTIME when the segment was started
+  uint64_t start_mono_ns;  // CLOCK_MONOTONIC at the same moment, 0: none
+  uint64_t reserved[3];
+};
+
+struct capture_record_header {
+  uint64_t ns;  // CLOCK_MONOTONIC
+  uint64_t conn;
+  uint32_t type;
+  uint32_t len;
+};
+
+#define CAPTURE_HEADER_SIZE ((int64_t)sizeof(struct capture_header))
+#define CAPTURE_RECORD_SIZE ((int64_t)sizeof(struct capture_record_header))
+#define CAPTURE_ALIGN(n) (((int64_t)(n) + 7) & ~7LL)
+
+struct capture {
+  char *prefix;
+  int64_t segment_bytes;
+  int max_segments;
+  unsigned index;  // current segment
+  unsigned first;  // oldest segment still on disk
+  int fd;
+  char *base;
+  int64_t off;
+  int failed;
+  struct capture_stats stats;
+};
+
+static uint64_t capture_now_ns(clockid_t clock)
+{
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void segment_name(char *buf, size_t size, const char *prefix, unsigned index)
+{
+  snprintf(buf, size, "%s.%06u", prefix, index);
+}
+
+static int segment_start(struct capture *c)
+{
+  char name[4096];
+  segment_name(name, sizeof(name), c->prefix, c->index);
+  c->fd = open(name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (c->fd == -1)
+    return -1;
+  // sparse, the pages are only allocated as records reach them
+  if (ftruncate(c->fd, c->segment_bytes) == -1)
+    goto fail;
+  c->base = mmap(NULL, (size_t)c->segment_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, c->fd, 0);
+  if (c->base == MAP_FAILED)
+    goto fail;
+  struct capture_header *h = (struct capture_header *)c->base;
+  memcpy(h->magic, CAPTURE_MAGIC, sizeof(h->magic));
+  h->index = c->index;
+  h->start_ns = capture_now_ns(CLOCK_REALTIME);
+  h->start_mono_ns = capture_now_ns(CLOCK_MONOTONIC);
+  c->off = CAPTURE_HEADER_SIZE;
+  c->stats.segments++;
+  while (c->max_segments > 0 && c->index - c->first >= (unsigned)c->max_segments) {
+    segment_name(name, sizeof(name), c->prefix, c->first++);
+    unlink(name);
+  }
+  return 0;
+
+fail:
+  close(c->fd);
+  c->fd = -1;
+  c->base = NULL;
+  return -1;
+}
+
+static void segment_finish(struct capture *c)
+{
+  if (!c->base)
+    return;
+  ((struct capture_header *)c->base)->used = (uint64_t)(c->off - CAPTURE_HEADER_SIZE);
+  munmap(c->base, (size_t)c->segment_bytes);
+  ftruncate(c->fd, c->off);
+  close(c->fd);
+  c->base = NULL;
+  c->fd = -1;
+}
+
+struct capture *capture_open(const char *prefix, const struct capture_options *opts)
+{
+  struct capture *c = calloc(1, sizeof(*c));
+  if (!c)
+    return NULL;
+  c->prefix = strdup(prefix);
+  c->segment_bytes = opts && opts->segment_bytes > 0 ? opts->segment_bytes : CAPTURE_DEFAULT_SEGMENT;
+  if (c->segment_bytes < CAPTURE_MIN_SEGMENT)
+    c->segment_bytes = CAPTURE_MIN_SEGMENT;
+  c->segment_bytes &= ~7LL;
+  c->max_segments = opts ? opts->max_segments : 0;
+  c->fd = -1;
+  if (!c->prefix || segment_start(c) != 0) {
+    free(c->prefix);
+    free(c);
+    return NULL;
+  }
+  return c;
+}
+
+void capture_close(struct capture *c)
+{
+  segment_finish(c);
+  free(c->prefix);
+  free(c);
+}
+
+int capture_record(struct capture *c, uint64_t conn, int type, const void *data, int len)
+{
+  const char *p = data;
+  // a wall clock step would distort the pacing of the replay
+  uint64_t ns = capture_now_ns(CLOCK_MONOTONIC);
+  if (c->failed) {
+    errno = EIO;
+    return -1;
+  }
+  // OPEN and CLOSE have no data but still take one record
+  for (;;) {
+    int64_t room = c->segment_bytes - c->off - CAPTURE_RECORD_SIZE;
+    if (room < 0 || (room < len && room < CAPTURE_MIN_PIECE)) {
+      segment_finish(c);
+      c->index++;
+      if (segment_start(c) != 0) {
+        c->failed = 1;
+        return -1;
+      }
+      continue;
+    }
+    // a stream may be split anywhere, the rest goes to the next segment
+    int piece = len < room ? len : (int)room;
+    struct capture_record_header h = {
+      .ns = ns,
+      .conn = conn,
+      .type = (uint32_t)type,
+      .len = (uint32_t)piece,
+    };
+    memcpy(c->base + c->off, &h, sizeof(h));
+    if (piece > 0)
+      memcpy(c->base + c->off + CAPTURE_RECORD_SIZE, p, (size_t)piece);
+    c->off += CAPTURE_RECORD_SIZE + CAPTURE_ALIGN(piece);
+    c->stats.records++;
+    c->stats.bytes += (uint64_t)piece;
+    p += piece;
+    len -= piece;
+    if (len == 0)
+      break;
+  }
+  return 0;
+}
+
+int capture_appendSocket(struct capture *c, uint64_t conn, int fd, struct zbytes *zb)
+{
+  int n = zb_appendSocket(fd, zb);
+  if (n > 0)
+    capture_record(c, conn, CAPTURE_DATA, zb->data + zb->limit - n, n);
+  return n;
+}
+
+void capture_get_stats(const struct capture *c, struct capture_stats *stats)
+{
+  *stats = c->stats;
+}
+
+//// READ
+struct capture_reader {
+  glob_t segments;
+  size_t next;  // segment to open next
+  char *base;
+  int64_t size;
+  int64_t off;
+  uint64_t start_ns;       // of the mapped segment
+  uint64_t start_mono_ns;
+};
+
+struct capture_reader *capture_reader_open(const char *prefix)
+{
+  char pattern[4096];
+  struct capture_reader *rd = calloc(1, sizeof(*rd));
+  if (!rd)
+    return NULL;
+  // zero-padded, glob() sorts them oldest first
+  snprintf(pattern, sizeof(pattern), "%s.[0-9][0-9][0-9][0-9][0-9][0-9]", prefix);
+  if (glob(pattern, 0, NULL, &rd->segments) != 0) {
+    free(rd);
+    errno = ENOENT;
+    return NULL;
+  }
+  return rd;
+}
+
+static void reader_unmap(struct capture_reader *rd)
+{
+  if (rd->base)
+    munmap(rd->base, (size_t)rd->size);
+  rd->base = NULL;
+}
+
+static int reader_map(struct capture_reader *rd, const char *name)
+{
+  struct stat st;
+  int fd = open(name, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return -1;
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return -1;
+  }
+  if (st.st_size < CAPTURE_HEADER_SIZE) {
+    close(fd);
+    errno = EPROTO;
+    return -1;
+  }
+  rd->size = st.st_size;
+  rd->base = mmap(NULL, (size_t)rd->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (rd->base == MAP_FAILED) {
+    rd->base = NULL;
+    return -1;
+  }
+  if (memcmp(rd->base, CAPTURE_MAGIC, 8) != 0) {
+    reader_unmap(rd);
+    errno = EPROTO;
+    return -1;
+  }
+  madvise(rd->base, (size_t)rd->size, MADV_SEQUENTIAL);
+  const struct capture_header *h = (const struct capture_header *)rd->base;
+  rd->start_ns = h->start_ns;
+  rd->start_mono_ns = h->start_mono_ns;
+  rd->off = CAPTURE_HEADER_SIZE;
+  return 0;
+}
+
+int capture_reader_next(struct capture_reader *rd, struct capture_record *rec)
+{
+  for (;;) {
+    if (!rd->base) {
+      if (rd->next == rd->segments.gl_pathc)
+        return 0;
+      if (reader_map(rd, rd->segments.gl_pathv[rd->next++]) != 0)
+        return -1;
+    }
+    struct capture_record_header h;
+    if (rd->size - rd->off < CAPTURE_RECORD_SIZE) {
+      reader_unmap(rd);
+      continue;
+    }
+    memcpy(&h, rd->base + rd->off, sizeof(h));
+    if (h.type == CAPTURE_END) {
+      reader_unmap(rd);
+      continue;
+    }
+    if (h.type > CAPTURE_CLOSE || (int64_t)h.len > rd->size - rd->off - CAPTURE_RECORD_SIZE) {
+      errno = EPROTO;
+      return -1;
+    }
+    rec->ns = h.ns;
+    // the piece of a chunk continued from the last segment is a little
+    // older than this one, the unsigned difference still wraps right
+    rec->realtime_ns = rd->start_mono_ns ? rd->start_ns + (h.ns - rd->start_mono_ns) : h.ns;
+    rec->conn = h.conn;
+    rec->type = (int)h.type;
+    rec->len = (int)h.len;
+    rec->data = rd->base + rd->off + CAPTURE_RECORD_SIZE;
+    rd->off += CAPTURE_RECORD_SIZE + CAPTURE_ALIGN(h.len);
+    return 1;
+  }
+}
+
+void capture_reader_close(struct capture_reader *rd)
+{
+  reader_unmap(rd);
+  globfree(&rd->segments);
+  free(rd);
+}
+
+//// REPLAY
+struct replay_conn {
+  uint64_t id;
+  int used;
+  int failed;  // frame or process failed, drop the rest
+  struct zbytes zb;
+};
+
+// open addressing on the connection id, at most half full
+struct replay_table {
+  struct replay_conn *slots;
+  unsigned mask;
+  unsigned n;
+};
+
+static unsigned replay_hash(uint64_t id)
+{
+  id ^= id >> 33;
+  id *= 0xff51afd7ed558ccdULL;
+  id ^= id >> 33;
+  return (unsigned)id;
+}
+
+static struct replay_conn *replay_find(struct replay_table *t, uint64_t id)
+{
+  for (unsigned i = replay_hash(id) & t->mask; ; i = (i + 1) & t->mask) {
+    if (!t->slots[i].used)
+      return &t->slots[i];
+    if (t->slots[i].id == id)
+      return &t->slots[i];
+  }
+}
+
+static int replay_grow(struct replay_table *t)
+{
+  struct replay_table old = *t;
+  unsigned cap = old.slots ? (old.mask + 1) * 2 : 64;
+  t->slots = calloc(cap, sizeof(*t->slots));
+  if (!t->slots) {
+    *t = old;
+    return -1;
+  }
+  t->mask = cap - 1;
+  if (old.slots) {
+    for (unsigned i = 0; i <= old.mask; i++) {
+      if (old.slots[i].used)
+        *replay_find(t, old.slots[i].id) = old.slots[i];
+    }
+  }
+  free(old.slots);
+  return 0;
+}
+
+static struct replay_conn *replay_get(struct replay_table *t, uint64_t id,
+                                      struct capture_replay_stats *stats)
+{
+  struct replay_conn *cn = replay_find(t, id);
+  if (cn->used)
+    return cn;
+  if ((t->n + 1) * 2 > t->mask + 1) {
+    if (replay_grow(t) != 0)
+      return NULL;
+    cn = replay_find(t, id);
+  }
+  if (!zb_init(&cn->zb, 0))
+    return NULL;
+  cn->id = id;
+  cn->used = 1;
+  cn->failed = 0;
+  t->n++;
+  stats->conns++;
+  return cn;
+}
+
+// backward-shift delete, no tombstones
+static void replay_erase(struct replay_table *t, struct replay_conn *cn)
+{
+  unsigned i = (unsigned)(cn - t->slots);
+  zb_destroy(&cn->zb);
+  t->n--;
+  for (unsigned j = (i + 1) & t->mask; t->slots[j].used; j = (j + 1) & t->mask) {
+    unsigned home = replay_hash(t->slots[j].id) & t->mask;
+    // move j back into the hole unless its home lies cyclically in (i, j]
+    if (((j - home) & t->mask) >= ((j - i) & t->mask)) {
+      t->slots[i] = t->slots[j];
+      i = j;
+    }
+  }
+  memset(&t->slots[i], 0, sizeof(t->slots[i]));
+}
+
+int capture_replay(const char *prefix, double speed, zb_packet_frame_func frame,
+                   zb_packet_processor_func process, struct capture_replay_stats *stats)
+{
+  struct capture_reader *rd = capture_reader_open(prefix);
+  struct replay_table t = { NULL, 0, 0 };
+  struct capture_record rec;
+  uint64_t first_ns = 0, start = capture_now_ns(CLOCK_MONOTONIC);
+  int rc;
+  memset(stats, 0, sizeof(*stats));
+  if (!rd || replay_grow(&t) != 0) {
+    if (rd)
+      capture_reader_close(rd);
+    return -1;
+  }
+  while ((rc = capture_reader_next(rd, &rec)) == 1) {
+    if (stats->records++ == 0)
+      first_ns = rec.ns;
+    if (speed > 0 && rec.ns > first_ns) {
+      uint64_t due = start + (uint64_t)((double)(rec.ns - first_ns) / speed);
+      uint64_t now = capture_now_ns(CLOCK_MONOTONIC);
+      if (now < due) {
+        struct timespec ts = { (time_t)(due / 1000000000ULL), (long)(due % 1000000000ULL) };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+          ;
+      } else if (now - due > stats->max_lag_ns) {
+        stats->max_lag_ns = now - due;
+      }
+    }
+    struct replay_conn *cn;
+    if (rec.type == CAPTURE_CLOSE) {
+      cn = replay_find(&t, rec.conn);
+      if (cn->used)
+        replay_erase(&t, cn);
+      continue;
+    }
+    cn = replay_get(&t, rec.conn, stats);
+    if (!cn) {
+      rc = -1;
+      break;
+    }
+    if (rec.type != CAPTURE_DATA || cn->failed)
+      continue;
+    if (zb_reserve(&cn->zb, (size_t)rec.len) != 0) {
+      rc = -1;
+      break;
+    }
+    zb_append(&cn->zb, rec.data, (size_t)rec.len);
+    stats->bytes += (uint64_t)rec.len;
+    uint64_t t0 = capture_now_ns(CLOCK_MONOTONIC);
+    int n = zb_dispatch_packets(&cn->zb, frame, process);
+    stats->dispatch_ns += capture_now_ns(CLOCK_MONOTONIC) - t0;
+    if (n < 0) {
+      cn->failed = 1;
+      zb_zero(&cn->zb);
+      stats->errors++;
+    } else {
+      stats->packets += (uint64_t)n;
+    }
+  }
+  stats->elapsed_ns = capture_now_ns(CLOCK_MONOTONIC) - start;
+  for (unsigned i = 0; i <= t.mask; i++) {
+    if (t.slots[i].used)
+      zb_destroy(&t.slots[i].zb);
+  }
+  free(t.slots);
+  capture_reader_close(rd);
+  return rc == 0 ? 0 : -1;
+}
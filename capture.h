@@ -0,0 +1,101 @@
+#ifndef XNET_CAPTURE_H_
+#define XNET_CAPTURE_H_
+
+#include <stdint.h>
+#include "packet.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Traffic capture and replay.
+//
+// A recorder appends what connections receive, chunk by chunk as read by
+// zb_appendSocket(), to capture files. Records go into a mmap'd segment
+// with a memcpy; the only system calls are at the rotation to the next
+// segment, "prefix.000000", "prefix.000001"... Every record is
+//
+//   uint64 ns (CLOCK_MONOTONIC), uint64 connection, uint32 type,
+//   uint32 length, data padded to 8 bytes
+//
+// in host byte order, and a zero type ends a segment, so the segments of
+// a process that crashed are still readable. capture_replay() feeds the
+// chunks back through zb_dispatch_packets() with per-connection buffers,
+// at the original pace or as fast as possible: a benchmark of the framing
+// and the handlers against the shape of real traffic.
+//
+// The monotonic stamps pace the replay, a wall clock step does not move
+// them. Each segment header keeps the CLOCK_REALTIME of its start once,
+// the reader derives the wall time of every record from it.
+//
+// A recorder is not thread-safe, use one (prefix) per reactor thread.
+
+enum {
+  CAPTURE_END,   // no more records in the segment
+  CAPTURE_OPEN,  // a connection was accepted, no data
+  CAPTURE_DATA,
+  CAPTURE_CLOSE,
+};
+
+struct capture_options {
+  int64_t segment_bytes;  // 0: 64MB
+  int max_segments;       // older segments are deleted, 0: keep all
+};
+
+struct capture;
+
+// opts may be NULL. NULL if the first segment cannot be created
+struct capture *capture_open(const char *prefix, const struct capture_options *opts);
+// finish the current segment, truncated to what was written
+void capture_close(struct capture *c);
+
+// 0 : success, -1 fail (the capture stops recording)
+int capture_record(struct capture *c, uint64_t conn, int type, const void *data, int len);
+// zb_appendSocket() recording what was read
+int capture_appendSocket(struct capture *c, uint64_t conn, int fd, struct zbytes *zb);
+
+struct capture_stats {
+  uint64_t records;
+  uint64_t bytes;     // data bytes
+  uint64_t segments;  // segments started
+};
+void capture_get_stats(const struct capture *c, struct capture_stats *stats);
+
+//// READ
+struct capture_record {
+  uint64_t ns;           // CLOCK_MONOTONIC of the recording process
+  uint64_t realtime_ns;  // CLOCK_REALTIME, from the segment start
+  uint64_t conn;
+  int type;
+  int len;
+  const char *data;  // valid until the next capture_reader_next()
+};
+
+struct capture_reader;
+// every segment of prefix, oldest first. NULL if there is none (ENOENT)
+struct capture_reader *capture_reader_open(const char *prefix);
+// 1 : a record, 0 : end of the capture, -1 malformed segment (EPROTO)
+int capture_reader_next(struct capture_reader *rd, struct capture_record *rec);
+void capture_reader_close(struct capture_reader *rd);
+
+//// REPLAY
+struct capture_replay_stats {
+  uint64_t records;
+  uint64_t bytes;
+  uint64_t packets;      // processed by process
+  uint64_t conns;
+  uint64_t errors;       // connections dropped because frame or process failed
+  uint64_t elapsed_ns;   // the whole replay
+  uint64_t dispatch_ns;  // spent in zb_dispatch_packets()
+  uint64_t max_lag_ns;   // paced: how late a chunk was dispatched at worst
+};
+
+// speed 1 keeps the recorded pace, 2 twice as fast..., <= 0 as fast as
+// possible. 0 : success, -1 fail
+int capture_replay(const char *prefix, double speed, zb_packet_frame_func frame,
+                   zb_packet_processor_func process, struct capture_replay_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
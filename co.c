@@ -0,0 +1,256 @@
+#define _GNU_SOURCE
+#include "co.h"
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "base_net.h"
+#include "packet.h"
+
+// as DialTimeout(): an address gets at least this much of the time left
+#define CO_DIAL_MIN_ATTEMPT_MS 2000
+
+static int co_resume(struct co *co)
+{
+  int rc = co->fn(co);
+  if (rc == CO_AGAIN)
+    return rc;
+  reactor_timer_stop(co->r, &co->timer);
+  co->wait_fd = -1;
+  if (co->on_exit)
+    co->on_exit(co, rc);
+  return rc;
+}
+
+static void co_on_io(struct reactor *r, int fd, uint32_t events, void *arg)
+{
+  struct co *co = arg;
+  (void)r;
+  (void)events;
+  // edge triggered on both directions, a stale edge only costs one retry
+  if (co->wait_fd == fd)
+    co_resume(co);
+}
+
+static void co_on_timer(void *arg)
+{
+  struct co *co = arg;
+  co->timed_out = 1;
+  if (co->wait_fd != -1)
+    co_resume(co);
+}
+
+static int co_wait(struct co *co, int fd)
+{
+  co->wait_fd = fd;
+  return CO_AGAIN;
+}
+
+static int co_timeout(void)
+{
+  errno = ETIMEDOUT;
+  return -1;
+}
+
+static bool co_would_block(void)
+{
+  return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+int co_spawn(struct co *co, struct reactor *r, co_func fn, void *arg,
+             void (*on_exit)(struct co *co, int rc))
+{
+  co->line = 0;
+  co->wait_fd = -1;
+  co->progress = 0;
+  co->timed_out = 0;
+  co->r = r;
+  reactor_timer_init(&co->timer);
+  co->fn = fn;
+  co->arg = arg;
+  co->on_exit = on_exit;
+  return co_resume(co);
+}
+
+int co_attach(struct co *co, int fd)
+{
+  return reactor_add(co->r, fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, co_on_io, co);
+}
+
+int co_detach(struct co *co, int fd)
+{
+  if (co->wait_fd == fd)
+    co->wait_fd = -1;
+  return reactor_remove(co->r, fd);
+}
+
+int co_set_deadline(struct co *co, int ms)
+{
+  co->timed_out = 0;
+  if (ms < 0) {
+    reactor_timer_stop(co->r, &co->timer);
+    return 0;
+  }
+  return reactor_timer_start(co->r, &co->timer, ms, co_on_timer, co);
+}
+
+// make room for at least n more bytes, compacting before growing
+static int co_make_room(struct zbytes *zb, int n)
+{
+  if (zb_free_size(zb) >= n)
+    return 0;
+  zb_move(zb);
+  return zb_reserve(zb, (size_t)n);
+}
+
+int co_read_exact(struct co *co, int fd, struct zbytes *zb, int n)
+{
+  if (co->timed_out)
+    return co_timeout();
+  while (zb_available(zb) < n) {
+    if (co_make_room(zb, n - zb_available(zb)) != 0)
+      return -1;
+    int rc = zb_appendSocket(fd, zb);
+    if (rc == 0)
+      return 0;
+    if (rc < 0)
+      return co_would_block() ? co_wait(co, fd) : -1;
+  }
+  return n;
+}
+
+int co_read_until(struct co *co, int fd, struct zbytes *zb,
+                  const char *delim, int dlen, int max)
+{
+  if (co->timed_out)
+    return co_timeout();
+  for (;;) {
+    // co->progress: bytes already scanned without a match
+    int avail = zb_available(zb);
+    int from = co->progress > dlen - 1 ? co->progress - (dlen - 1) : 0;
+    char *p = memmem(zb_data(zb) + from, (size_t)(avail - from), delim, (size_t)dlen);
+    if (p)
+      return (int)(p - zb_data(zb)) + dlen;
+    co->progress = avail;
+    if (avail >= max) {
+      errno = EMSGSIZE;
+      return -1;
+    }
+    if (co_make_room(zb, 1) != 0)
+      return -1;
+    int rc = zb_appendSocket(fd, zb);
+    if (rc == 0)
+      return 0;
+    if (rc < 0)
+      return co_would_block() ? co_wait(co, fd) : -1;
+  }
+}
+
+int co_write_all(struct co *co, int fd, const void *data, int len)
+{
+  if (co->timed_out)
+    return co_timeout();
+  // co->progress: bytes already written
+  while (co->progress < len) {
+    ssize_t n = send(fd, (const char *)data + co->progress,
+                     (size_t)(len - co->progress), MSG_NOSIGNAL);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      return co_would_block() ? co_wait(co, fd) : -1;
+    }
+    co->progress += (int)n;
+  }
+  return len;
+}
+
+static int64_t co_now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// connect to the next address and arm the deadline of this attempt.
+// fd (attached), -1 when no address is left (errno: err or the last error)
+static int co_dial_next(struct co *co, int err)
+{
+  static const struct BuildNetParams params = {
+    .flags = XNET_F_NONBLOCK,
+  };
+  while (co->dial_next < co->dial_ep.count) {
+    int i = co->dial_next++, wait = -1;
+    if (co->dial_deadline >= 0) {
+      int64_t left = co->dial_deadline - co_now_ms();
+      if (left <= 0) {
+        err = ETIMEDOUT;
+        break;
+      }
+      int64_t share = left / (co->dial_ep.count - i);
+      if (share < CO_DIAL_MIN_ATTEMPT_MS)
+        share = left < CO_DIAL_MIN_ATTEMPT_MS ? left : CO_DIAL_MIN_ATTEMPT_MS;
+      wait = (int)share;
+    }
+    struct Endpoint one = { 1, &co->dial_ep.addrs[i] };
+    int fd = DialEndpoint(&one, NULL, &params);
+    if (fd == -1) {
+      err = errno;
+      continue;
+    }
+    if (co_attach(co, fd) != 0 || co_set_deadline(co, wait) != 0) {
+      err = errno;
+      co_detach(co, fd);
+      close(fd);
+      continue;
+    }
+    return fd;
+  }
+  co_set_deadline(co, -1);
+  EndpointFree(&co->dial_ep);
+  errno = err;
+  return -1;
+}
+
+int co_dial_timeout(struct co *co, const char *network, const char *address, int ms)
+{
+  // co->progress: fd + 1 while a connect() is in flight, -1 between two
+  if (co->progress == 0) {
+    if (ResolveEndpoint(&co->dial_ep, network, address, 0) != 0)
+      return -1;
+    co->dial_next = 0;
+    co->dial_deadline = ms >= 0 ? co_now_ms() + ms : -1;
+    co->progress = -1;
+  }
+  int err = EADDRNOTAVAIL;
+  for (;;) {
+    if (co->progress < 0) {
+      int fd = co_dial_next(co, err);
+      if (fd == -1)
+        return -1;
+      co->progress = fd + 1;
+    }
+    int fd = co->progress - 1;
+    if (co->timed_out) {
+      err = ETIMEDOUT;
+    } else {
+      struct pollfd pfd = {
+        .fd = fd,
+        .events = POLLOUT,
+      };
+      if (poll(&pfd, 1, 0) == 0)
+        return co_wait(co, fd);
+      if (WaitConnected(fd, 0) == 0) {
+        co_set_deadline(co, -1);
+        EndpointFree(&co->dial_ep);
+        return fd;
+      }
+      err = errno;
+    }
+    // this address failed or ran out of its share, on to the next
+    co_detach(co, fd);
+    close(fd);
+    co->progress = -1;
+  }
+}
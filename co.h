@@ -0,0 +1,110 @@
+#ifndef XNET_CO_H_
+#define XNET_CO_H_
+
+#include <stdint.h>
+#include "base_net.h"
+#include "reactor.h"
+#include "zbytes.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Stackless coroutines over non-blocking sockets and a reactor.
+//
+// A coroutine is a function re-entered from the top on every resume; the
+// CO_* macros jump back to the last suspension point. Locals do NOT survive
+// a suspension, keep the session state in the object behind co->arg.
+// A suspended coroutine costs sizeof(struct co) plus whatever the caller
+// keeps per session, so 100k sessions fit in a few megabytes.
+//
+//   static int echo(struct co *co) {
+//     struct session *s = co->arg;
+//     int rc;
+//     CO_BEGIN(co);
+//     for (;;) {
+//       CO_AWAIT(co, rc, co_read_until(co, s->fd, &s->buf, "\n", 1, 4096));
+//       if (rc <= 0) break;
+//       CO_AWAIT(co, rc, co_write_all(co, s->fd, zb_data(&s->buf), rc));
+//       if (rc < 0) break;
+//       zb_skip(&s->buf, rc);
+//       zb_move(&s->buf);
+//     }
+//     CO_END(co);
+//     return 0;
+//   }
+
+// returned by a co_* helper when it has to wait, propagate it with CO_AWAIT
+#define CO_AGAIN (-2)
+
+struct co;
+// return CO_AGAIN to suspend, any other value finishes the coroutine
+typedef int (*co_func)(struct co *co);
+
+struct co {
+  int line;             // resume point, 0 at start
+  int wait_fd;          // fd the coroutine is suspended on, -1 if none
+  int progress;         // scratch of the helper being awaited
+  int timed_out;
+  struct reactor *r;
+  struct reactor_timer timer;
+  co_func fn;
+  void *arg;
+  // called once when fn returns something other than CO_AGAIN, may free co
+  void (*on_exit)(struct co *co, int rc);
+  // co_dial_timeout(): the addresses left to try
+  struct Endpoint dial_ep;
+  int dial_next;
+  int64_t dial_deadline;  // monotonic ms, -1 none
+};
+
+#define CO_BEGIN(co)  switch ((co)->line) { case 0:
+#define CO_END(co)    } (co)->line = 0
+// evaluate expr, suspend while it returns CO_AGAIN, result in rc
+#define CO_AWAIT(co, rc, expr) \
+    do { \
+      (co)->progress = 0; \
+      (co)->line = __LINE__; case __LINE__: \
+      (rc) = (expr); \
+      if ((rc) == CO_AGAIN) \
+        return CO_AGAIN; \
+      (co)->wait_fd = -1; \
+    } while (0)
+
+// set up co and run it until its first suspension.
+// return the result of fn, or CO_AGAIN if it is suspended
+int co_spawn(struct co *co, struct reactor *r, co_func fn, void *arg,
+             void (*on_exit)(struct co *co, int rc));
+
+// register fd (non-blocking) with the reactor, edge triggered, resuming co.
+// co_dial_timeout attaches the fd it creates. 0 : success, -1 fail
+int co_attach(struct co *co, int fd);
+// must be called before the fd is closed
+int co_detach(struct co *co, int fd);
+
+// the awaited helper fails with ETIMEDOUT if co is still suspended after ms,
+// ms < 0 clears the deadline
+int co_set_deadline(struct co *co, int ms);
+
+//// helpers: CO_AGAIN while waiting, otherwise as documented
+// read until zb holds at least n bytes.
+// n on success, 0 on EOF before n bytes, -1 error
+int co_read_exact(struct co *co, int fd, struct zbytes *zb, int n);
+// read until delim appears in zb, at most max bytes.
+// length of the data up to and including delim at zb_data(zb),
+// 0 on EOF, -1 error or max bytes without delim (EMSGSIZE)
+int co_read_until(struct co *co, int fd, struct zbytes *zb,
+                  const char *delim, int dlen, int max);
+// len on success, -1 error
+int co_write_all(struct co *co, int fd, const void *data, int len);
+// non-blocking tcp/unix dial. The addresses of a name are tried in order,
+// each within a share of the time left, as DialTimeout() does.
+// connected fd (attached), -1 error/timeout (ETIMEDOUT once ms expired).
+// it uses the coroutine deadline, any deadline set before is cleared.
+// ms < 0 waits forever
+int co_dial_timeout(struct co *co, const char *network, const char *address, int ms);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
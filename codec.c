@@ -0,0 +1,241 @@
+#include "codec.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+
+#define CODEC_MAX_BACKOFF 64
+
+// per thread, shared by every codec the thread runs
+struct codec_ctx {
+  z_stream def;
+  z_stream inf;
+  int def_level;  // 0: def not initialized
+  int inf_ok;
+};
+
+static __thread struct codec_ctx tls_ctx;
+
+static z_stream *codec_deflater(int level)
+{
+  struct codec_ctx *ctx = &tls_ctx;
+  if (ctx->def_level == 0) {
+    // raw deflate, the block header carries the lengths
+    if (deflateInit2(&ctx->def, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+      return NULL;
+    ctx->def_level = level;
+  } else if (ctx->def_level != level) {
+    if (deflateParams(&ctx->def, level, Z_DEFAULT_STRATEGY) != Z_OK)
+      return NULL;
+    ctx->def_level = level;
+  }
+  return &ctx->def;
+}
+
+static z_stream *codec_inflater(void)
+{
+  struct codec_ctx *ctx = &tls_ctx;
+  if (!ctx->inf_ok) {
+    if (inflateInit2(&ctx->inf, -15) != Z_OK)
+      return NULL;
+    ctx->inf_ok = 1;
+  }
+  return &ctx->inf;
+}
+
+void codec_thread_release(void)
+{
+  struct codec_ctx *ctx = &tls_ctx;
+  if (ctx->def_level)
+    deflateEnd(&ctx->def);
+  if (ctx->inf_ok)
+    inflateEnd(&ctx->inf);
+  memset(ctx, 0, sizeof(*ctx));
+}
+
+static uint64_t codec_now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+int codec_init(struct codec *c, const struct codec_options *opts)
+{
+  memset(c, 0, sizeof(*c));
+  if (opts)
+    c->opts = *opts;
+  if (c->opts.level <= 0 || c->opts.level > 9)
+    c->opts.level = 1;
+  if (c->opts.batch_bytes <= 0)
+    c->opts.batch_bytes = 64 << 10;
+  if (c->opts.min_size <= 0)
+    c->opts.min_size = 128;
+  if (c->opts.mode == CODEC_PER_BATCH && zb_init(&c->batch, c->opts.batch_bytes) == NULL)
+    return -1;
+  return 0;
+}
+
+void codec_destroy(struct codec *c)
+{
+  zb_destroy(&c->batch);
+}
+
+static void codec_put_header(struct zbytes *out, int at, uint32_t wire, uint32_t plain)
+{
+  wire = htonl(wire);
+  plain = htonl(plain);
+  memcpy(out->data + at, &wire, 4);
+  memcpy(out->data + at + 4, &plain, 4);
+}
+
+// stored blocks make the next attempt wait longer
+static void codec_back_off(struct codec *c)
+{
+  c->backoff = c->backoff ? c->backoff * 2 : 1;
+  if (c->backoff > CODEC_MAX_BACKOFF)
+    c->backoff = CODEC_MAX_BACKOFF;
+  c->skip = c->backoff;
+}
+
+// deflate into out after the header. wire length, -1 : store instead
+static int codec_deflate(struct codec *c, struct zbytes *out, const void *data, int len)
+{
+  z_stream *z = codec_deflater(c->opts.level);
+  if (!z)
+    return -1;
+  uint64_t start = codec_now_ns();
+  // no point in output that is not smaller than the input
+  uInt room = (uInt)(len - len / 16);
+  z->next_in = (Bytef *)data;
+  z->avail_in = (uInt)len;
+  z->next_out = (Bytef *)out->data + out->limit + CODEC_HEADER_SIZE;
+  z->avail_out = room;
+  int rc = deflate(z, Z_FINISH);
+  int wire = (int)(room - z->avail_out);
+  deflateReset(z);
+  uint64_t ns = codec_now_ns() - start;
+  c->stats.deflate_ns += ns;
+  if (rc != Z_STREAM_END) {
+    codec_back_off(c);
+    return -1;
+  }
+  // CPU bound: compressing took longer than sending the saved bytes
+  if (c->opts.link_bytes_per_sec > 0 &&
+      (double)ns > (double)(len - wire) * 1e9 / (double)c->opts.link_bytes_per_sec)
+    codec_back_off(c);
+  else
+    c->backoff = 0;
+  return wire;
+}
+
+static int codec_block(struct codec *c, struct zbytes *out, const void *data, int len)
+{
+  int at, wire = -1;
+  if (zb_reserve(out, (size_t)(CODEC_HEADER_SIZE + len)) != 0)
+    return -1;
+  at = out->limit;
+  if (len >= c->opts.min_size) {
+    if (c->skip > 0) {
+      c->skip--;
+      c->stats.skipped++;
+    } else {
+      wire = codec_deflate(c, out, data, len);
+    }
+  }
+  if (wire >= 0) {
+    codec_put_header(out, at, (uint32_t)wire | CODEC_BLOCK_DEFLATE, (uint32_t)len);
+    c->stats.deflated++;
+  } else {
+    memcpy(out->data + at + CODEC_HEADER_SIZE, data, (size_t)len);
+    wire = len;
+    codec_put_header(out, at, (uint32_t)len, (uint32_t)len);
+    c->stats.stored++;
+  }
+  out->limit += CODEC_HEADER_SIZE + wire;
+  c->stats.plain_bytes += (uint64_t)len;
+  c->stats.wire_bytes += (uint64_t)(CODEC_HEADER_SIZE + wire);
+  return 0;
+}
+
+int codec_flush(struct codec *c, struct zbytes *out)
+{
+  if (c->opts.mode != CODEC_PER_BATCH || zb_empty(&c->batch))
+    return 0;
+  int rc = codec_block(c, out, zb_data(&c->batch), zb_available(&c->batch));
+  zb_zero(&c->batch);
+  zb_shrink(&c->batch, c->opts.batch_bytes);
+  return rc;
+}
+
+int codec_encode(struct codec *c, struct zbytes *out, const void *data, int len)
+{
+  if (len < 0 || len > CODEC_MAX_BLOCK) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+  if (c->opts.mode != CODEC_PER_BATCH)
+    return codec_block(c, out, data, len);
+  if (zb_available(&c->batch) + len > c->opts.batch_bytes && codec_flush(c, out) != 0)
+    return -1;
+  // too big to batch, one block of its own
+  if (len >= c->opts.batch_bytes)
+    return codec_block(c, out, data, len);
+  if (zb_reserve(&c->batch, (size_t)len) != 0)
+    return -1;
+  zb_append(&c->batch, data, (size_t)len);
+  return 0;
+}
+
+int codec_decode(struct codec *c, struct zbytes *in, struct zbytes *out)
+{
+  int produced = 0;
+  (void)c;
+  while (zb_available(in) >= CODEC_HEADER_SIZE) {
+    uint32_t hdr, plain;
+    memcpy(&hdr, zb_data(in), 4);
+    memcpy(&plain, zb_data(in) + 4, 4);
+    hdr = ntohl(hdr);
+    plain = ntohl(plain);
+    uint32_t wire = hdr & ~CODEC_BLOCK_DEFLATE;
+    if (wire > CODEC_MAX_BLOCK || plain > CODEC_MAX_BLOCK ||
+        (!(hdr & CODEC_BLOCK_DEFLATE) && wire != plain)) {
+      errno = EPROTO;
+      return -1;
+    }
+    if ((uint32_t)zb_available(in) < CODEC_HEADER_SIZE + wire) {
+      // make room for the rest of the block
+      zb_move(in);
+      if (zb_reserve(in, CODEC_HEADER_SIZE + wire - (size_t)zb_available(in)) != 0)
+        return -1;
+      return produced;
+    }
+    if (zb_reserve(out, plain) != 0)
+      return -1;
+    const char *src = zb_data(in) + CODEC_HEADER_SIZE;
+    if (hdr & CODEC_BLOCK_DEFLATE) {
+      z_stream *z = codec_inflater();
+      if (!z)
+        return -1;
+      z->next_in = (Bytef *)src;
+      z->avail_in = wire;
+      z->next_out = (Bytef *)out->data + out->limit;
+      z->avail_out = plain;
+      int rc = inflate(z, Z_FINISH);
+      int short_block = z->avail_out != 0 || z->avail_in != 0;
+      inflateReset(z);
+      if (rc != Z_STREAM_END || short_block) {
+        errno = EPROTO;
+        return -1;
+      }
+    } else {
+      memcpy(out->data + out->limit, src, plain);
+    }
+    out->limit += (int)plain;
+    produced += (int)plain;
+    zb_skip(in, (int)(CODEC_HEADER_SIZE + wire));
+  }
+  zb_move(in);
+  return produced;
+}
@@ -0,0 +1,84 @@
+#ifndef XNET_CODEC_H_
+#define XNET_CODEC_H_
+
+#include <stdint.h>
+#include "zbytes.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Optional compression stage between the socket and the framing layer.
+//
+// The sender feeds plain bytes to codec_encode(), which appends blocks to
+// the zbytes that goes to the socket. The receiver hands the bytes read
+// with zb_appendSocket() to codec_decode(), which appends the plain
+// stream to another zbytes for zb_dispatch_packets(). Every block is
+//
+//   uint32 wire_length | CODEC_BLOCK_DEFLATE, uint32 plain_length, data
+//
+// (big endian), either raw deflate or stored. Blocks are independent, so
+// the deflate/inflate state is per thread and reused by all connections
+// of the thread instead of costing ~300KB per connection.
+//
+// Compression is skipped adaptively: blocks that do not shrink by 1/16,
+// or whose compression took longer than the saved bytes would take on a
+// link of link_bytes_per_sec, are sent stored, and compression is only
+// retried after an exponentially growing number of blocks.
+
+#define CODEC_HEADER_SIZE 8
+#define CODEC_BLOCK_DEFLATE (1u << 31)
+#define CODEC_MAX_BLOCK (16 << 20)
+
+enum {
+  CODEC_PER_FRAME,  // every codec_encode() call is one block
+  CODEC_PER_BATCH,  // collect until codec_flush() or batch_bytes
+};
+
+struct codec_options {
+  int mode;                    // CODEC_PER_*
+  int level;                   // zlib level, 0: 1 (fastest)
+  int batch_bytes;             // CODEC_PER_BATCH, 0: 64K
+  int min_size;                // smaller blocks are stored, 0: 128
+  int64_t link_bytes_per_sec;  // 0: judge by the ratio only
+};
+
+struct codec_stats {
+  uint64_t plain_bytes;
+  uint64_t wire_bytes;
+  uint64_t deflated;    // blocks sent compressed
+  uint64_t stored;      // blocks sent as they were
+  uint64_t skipped;     // stored without trying, see the backoff
+  uint64_t deflate_ns;  // time spent compressing
+};
+
+// one per connection and direction
+struct codec {
+  struct codec_options opts;
+  struct zbytes batch;  // CODEC_PER_BATCH: plain bytes not yet encoded
+  int skip;             // blocks to store before trying again
+  int backoff;
+  struct codec_stats stats;
+};
+
+// opts may be NULL (per frame, defaults). 0 : success, -1 fail
+int codec_init(struct codec *c, const struct codec_options *opts);
+void codec_destroy(struct codec *c);
+
+// 0 : success, -1 fail (out could not grow)
+int codec_encode(struct codec *c, struct zbytes *out, const void *data, int len);
+// CODEC_PER_BATCH: encode what is pending, call before writing out
+int codec_flush(struct codec *c, struct zbytes *out);
+
+// decode every complete block of in into out, in is compacted and grown
+// for the next block. bytes appended to out, -1 malformed (EPROTO) or
+// out of memory
+int codec_decode(struct codec *c, struct zbytes *in, struct zbytes *out);
+
+// free the deflate/inflate state of the calling thread, e.g. before it exits
+void codec_thread_release(void);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
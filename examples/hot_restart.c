@@ -0,0 +1,186 @@
+//
+// Line echo server that restarts without dropping connections.
+//
+// usage: hot_restart <tcp address> <handoff socket path>
+//
+//   $ ./hot_restart 127.0.0.1:9000 /tmp/xnet.handoff &
+//   $ nc 127.0.0.1 9000            # type "hel" without enter
+//   $ ./hot_restart 127.0.0.1:9000 /tmp/xnet.handoff &
+//                                  # the first process hands over and exits
+//   lo<enter>                      # the new process echoes "hello"
+//
+// Partial lines are buffered per connection and move to the new process
+// with the connection.
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "../handoff.h"
+#include "../reactor.h"
+
+#define MAX_CONNS 1024
+
+static struct reactor *g_reactor;
+static struct handler *g_conns[MAX_CONNS];
+static int g_listen_fd = -1;
+static int g_handoff_fd = -1;
+static char g_listen_name[HANDOFF_NAME_MAX];
+
+static void conn_close(struct handler *h)
+{
+  reactor_remove(g_reactor, h->sockfd);
+  g_conns[h->sockfd] = NULL;
+  close(h->sockfd);
+  zb_destroy(&h->buffer);
+  free(h);
+}
+
+static void conn_echo_lines(struct handler *h)
+{
+  char *nl;
+  while ((nl = memchr(zb_data(&h->buffer), '\n', (size_t)zb_available(&h->buffer)))) {
+    int n = (int)(nl - zb_data(&h->buffer)) + 1;
+    if (send(h->sockfd, zb_data(&h->buffer), (size_t)n, MSG_NOSIGNAL) != n)
+      break;
+    zb_skip(&h->buffer, n);
+  }
+  zb_move(&h->buffer);
+}
+
+static void on_conn(struct reactor *r, int fd, uint32_t events, void *arg)
+{
+  struct handler *h = arg;
+  (void)r;
+  (void)fd;
+  (void)events;
+  if (zb_free_size(&h->buffer) == 0 && zb_reserve(&h->buffer, 1) != 0) {
+    conn_close(h);
+    return;
+  }
+  int n = zb_appendSocket(h->sockfd, &h->buffer);
+  if (n == 0 || (n == -1 && errno != EAGAIN)) {
+    conn_close(h);
+    return;
+  }
+  conn_echo_lines(h);
+}
+
+static int conn_add(struct handler *src)
+{
+  struct handler *h = malloc(sizeof(*h));
+  if (!h || src->sockfd >= MAX_CONNS) {
+    close(src->sockfd);
+    zb_destroy(&src->buffer);
+    free(h);
+    return -1;
+  }
+  // h owns the socket and the buffer from here on
+  *h = *src;
+  if (!h->buffer.data && zb_init(&h->buffer, 4096) == NULL)
+    goto fail;
+  fcntl(h->sockfd, F_SETFL, fcntl(h->sockfd, F_GETFL) | O_NONBLOCK);
+  if (reactor_add(g_reactor, h->sockfd, EPOLLIN, on_conn, h) != 0)
+    goto fail;
+  g_conns[h->sockfd] = h;
+  conn_echo_lines(h);
+  return 0;
+fail:
+  close(h->sockfd);
+  zb_destroy(&h->buffer);
+  free(h);
+  return -1;
+}
+
+static void on_accept(struct reactor *r, int fd, uint32_t events, void *arg)
+{
+  (void)r;
+  (void)events;
+  (void)arg;
+  for (;;) {
+    struct handler h;
+    memset(&h, 0, sizeof(h));
+    h.sockfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (h.sockfd == -1)
+      break;
+    conn_add(&h);
+  }
+}
+
+static void on_successor(struct reactor *r, int fd, uint32_t events, void *arg)
+{
+  struct handoff_listener ls;
+  struct handler conns[MAX_CONNS];
+  int nconns = 0;
+  (void)events;
+  (void)arg;
+  memcpy(ls.name, g_listen_name, sizeof(ls.name));
+  ls.fd = g_listen_fd;
+  // every connection is idle between two reads, hand them all over
+  for (int i = 0; i < MAX_CONNS; i++) {
+    if (g_conns[i])
+      conns[nconns++] = *g_conns[i];
+  }
+  if (HandoffServe(fd, &ls, 1, conns, nconns, 2000) != 0) {
+    fprintf(stderr, "[%d] handoff failed, keep serving\n", getpid());
+    return;
+  }
+  fprintf(stderr, "[%d] handed over 1 listener, %d connections\n", getpid(), nconns);
+  // the successor owns them now: stop accepting, drop our copies
+  reactor_remove(r, g_listen_fd);
+  close(g_listen_fd);
+  reactor_remove(r, fd);
+  close(fd);
+  for (int i = 0; i < MAX_CONNS; i++) {
+    if (g_conns[i])
+      conn_close(g_conns[i]);
+  }
+  reactor_stop(r);
+}
+
+int main(int ac, char *av[])
+{
+  struct handoff_set set;
+  struct BuildNetParams params = {
+    .network = "tcp",
+    .local_address = ac > 1 ? av[1] : NULL,
+  };
+  if (ac != 3) {
+    fprintf(stderr, "usage: %s <tcp address> <handoff socket path>\n", av[0]);
+    return 1;
+  }
+  g_reactor = reactor_create(0);
+  handoff_name(g_listen_name, sizeof(g_listen_name), params.network, params.local_address);
+
+  int inherited = HandoffReceive(av[2], &set, 2000) == 0;
+  g_listen_fd = HandoffListen_ex(inherited ? &set : NULL, &params);
+  if (g_listen_fd == -1) {
+    fprintf(stderr, "listen %s failed\n", av[1]);
+    return 1;
+  }
+  fcntl(g_listen_fd, F_SETFL, fcntl(g_listen_fd, F_GETFL) | O_NONBLOCK);
+  reactor_add(g_reactor, g_listen_fd, EPOLLIN, on_accept, NULL);
+  if (inherited) {
+    fprintf(stderr, "[%d] adopted %d listener(s), %d connection(s)\n",
+            getpid(), set.nlisteners, set.nconns);
+    for (int i = 0; i < set.nconns; i++) {
+      conn_add(&set.conns[i]);
+      set.conns[i].sockfd = -1;
+    }
+    HandoffRelease(&set);
+  }
+
+  g_handoff_fd = HandoffListen(av[2]);
+  if (g_handoff_fd == -1 ||
+      reactor_add(g_reactor, g_handoff_fd, EPOLLIN, on_successor, NULL) != 0) {
+    fprintf(stderr, "handoff socket %s failed\n", av[2]);
+    return 1;
+  }
+  fprintf(stderr, "[%d] serving %s\n", getpid(), av[1]);
+  reactor_run(g_reactor);
+  reactor_destroy(g_reactor);
+  return 0;
+}
@@ -0,0 +1,103 @@
+#define _GNU_SOURCE
+#include "fdpass.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+int SendFds(int sockfd, const int *fds, int nfds, const void *data, int len)
+{
+  char dummy = 0;
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int) * XNET_MAX_PASS_FDS)];
+  } control;
+  struct iovec iov = {
+    .iov_base = len > 0 ? (void *)data : &dummy,
+    .iov_len = len > 0 ? (size_t)len : 1,
+  };
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+  };
+  ssize_t n;
+  if (nfds < 0 || nfds > XNET_MAX_PASS_FDS) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (nfds > 0) {
+    memset(&control, 0, sizeof(control));
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * (size_t)nfds);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * (size_t)nfds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * (size_t)nfds);
+  }
+  do {
+    n = sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+  } while (n == -1 && errno == EINTR);
+  if (n == -1)
+    return -1;
+  return (int)n;
+}
+
+static void close_fds(const int *fds, int nfds)
+{
+  for (int i = 0; i < nfds; i++)
+    close(fds[i]);
+}
+
+int RecvFds(int sockfd, int *fds, int *nfds, void *data, int len)
+{
+  char dummy;
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int) * XNET_MAX_PASS_FDS)];
+  } control;
+  struct iovec iov = {
+    .iov_base = len > 0 ? data : &dummy,
+    .iov_len = len > 0 ? (size_t)len : 1,
+  };
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control.buf,
+    .msg_controllen = sizeof(control.buf),
+  };
+  int cap = *nfds, got = 0;
+  bool overflow = false;
+  ssize_t n;
+  *nfds = 0;
+  do {
+    n = recvmsg(sockfd, &msg, MSG_CMSG_CLOEXEC);
+  } while (n == -1 && errno == EINTR);
+  if (n <= 0)
+    return (int)n;
+
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+      continue;
+    int count = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+    int *in = (int *)CMSG_DATA(cmsg);
+    for (int i = 0; i < count; i++) {
+      int fd;
+      memcpy(&fd, in + i, sizeof(fd));
+      if (got < cap) {
+        fds[got++] = fd;
+      } else {
+        close(fd);
+        overflow = true;
+      }
+    }
+  }
+  if (overflow || (msg.msg_flags & MSG_CTRUNC)) {
+    close_fds(fds, got);
+    errno = EMSGSIZE;
+    return -1;
+  }
+  *nfds = got;
+  return (int)n;
+}
@@ -0,0 +1,26 @@
+#ifndef XNET_FDPASS_H_
+#define XNET_FDPASS_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// the kernel limit of descriptors in one SCM_RIGHTS message
+#define XNET_MAX_PASS_FDS 253
+
+// Pass file descriptors over a connected unix socket (SCM_RIGHTS).
+// data/len is the payload sent along with them; with len == 0 one dummy
+// byte is sent so the message cannot be mistaken for EOF.
+// return bytes sent, -1 error
+int SendFds(int sockfd, const int *fds, int nfds, const void *data, int len);
+
+// *nfds is the capacity of fds on input, the number received on output.
+// received fds are close-on-exec; if the peer sent more than fit, all of
+// them are closed and -1 is returned with errno EMSGSIZE.
+// return bytes received, 0 on EOF, -1 error
+int RecvFds(int sockfd, int *fds, int *nfds, void *data, int len);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,265 @@
+#define _GNU_SOURCE
+#include "handoff.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "fdpass.h"
+
+#define HANDOFF_MAGIC 0x78484f46u  // "xHOF"
+#define HANDOFF_CHUNK (1<<16)
+
+enum {
+  HANDOFF_HELLO = 1,
+  HANDOFF_LISTENER,
+  HANDOFF_CONN,    // followed by length bytes of buffered data in chunks
+  HANDOFF_DONE,
+  HANDOFF_ACK,
+  HANDOFF_COMMIT,  // the predecessor let go, the successor owns everything
+};
+
+// one seqpacket message, carries at most one descriptor
+struct handoff_msg {
+  uint32_t magic;
+  uint32_t type;
+  uint32_t length;
+  char name[HANDOFF_NAME_MAX];
+};
+
+int handoff_name(char *buf, int size, const char *network, const char *address)
+{
+  int n = snprintf(buf, (size_t)size, "%s %s", network, address);
+  return n < 0 || n >= size ? -1 : n;
+}
+
+static int handoff_set_timeout(int sockfd, int ms)
+{
+  struct timeval tv = {
+    .tv_sec = ms / 1000,
+    .tv_usec = (ms % 1000) * 1000,
+  };
+  if (ms < 0)
+    return 0;
+  if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1 ||
+      setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) == -1)
+    return -1;
+  return 0;
+}
+
+static int handoff_send(int sockfd, uint32_t type, const char *name, uint32_t length, int fd)
+{
+  struct handoff_msg msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.magic = HANDOFF_MAGIC;
+  msg.type = type;
+  msg.length = length;
+  if (name)
+    snprintf(msg.name, sizeof(msg.name), "%s", name);
+  return SendFds(sockfd, &fd, fd >= 0 ? 1 : 0, &msg, sizeof(msg)) == (int)sizeof(msg) ? 0 : -1;
+}
+
+// *fd is -1 if the message carried none
+static int handoff_recv(int sockfd, struct handoff_msg *msg, int *fd)
+{
+  int nfds = 1;
+  int n = RecvFds(sockfd, fd, &nfds, msg, sizeof(*msg));
+  if (nfds == 0)
+    *fd = -1;
+  if (n != (int)sizeof(*msg) || msg->magic != HANDOFF_MAGIC) {
+    if (*fd != -1)
+      close(*fd);
+    errno = EPROTO;
+    return -1;
+  }
+  msg->name[HANDOFF_NAME_MAX - 1] = '\0';
+  return 0;
+}
+
+int HandoffListen(const char *path)
+{
+  unlink(path);
+  return ListenUNIX("unixpacket", path);
+}
+
+int HandoffServe(int listen_fd, const struct handoff_listener *ls, int nls,
+                 const struct handler *conns, int nconns, int timeout_ms)
+{
+  struct handoff_msg msg;
+  int fd, sockfd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+  if (sockfd == -1)
+    return -1;
+  if (handoff_set_timeout(sockfd, timeout_ms) != 0 ||
+      handoff_recv(sockfd, &msg, &fd) != 0)
+    goto fail;
+  if (fd != -1)
+    close(fd);
+  if (msg.type != HANDOFF_HELLO)
+    goto fail;
+
+  for (int i = 0; i < nls; i++) {
+    if (handoff_send(sockfd, HANDOFF_LISTENER, ls[i].name, 0, ls[i].fd) != 0)
+      goto fail;
+  }
+  for (int i = 0; i < nconns; i++) {
+    const struct zbytes *zb = &conns[i].buffer;
+    int len = zb->data ? zb_available(zb) : 0;
+    if (handoff_send(sockfd, HANDOFF_CONN, NULL, (uint32_t)len, conns[i].sockfd) != 0)
+      goto fail;
+    for (int off = 0; off < len; off += HANDOFF_CHUNK) {
+      size_t n = (size_t)(len - off) < HANDOFF_CHUNK ? (size_t)(len - off) : HANDOFF_CHUNK;
+      if (send(sockfd, zb_data(zb) + off, n, MSG_NOSIGNAL) != (ssize_t)n)
+        goto fail;
+    }
+  }
+  if (handoff_send(sockfd, HANDOFF_DONE, NULL, 0, -1) != 0 ||
+      handoff_recv(sockfd, &msg, &fd) != 0)
+    goto fail;
+  if (fd != -1)
+    close(fd);
+  if (msg.type != HANDOFF_ACK)
+    goto fail;
+  // a late ACK is lost with the socket: the successor sees EOF instead of
+  // the commit and gives everything back
+  if (handoff_send(sockfd, HANDOFF_COMMIT, NULL, 0, -1) != 0)
+    goto fail;
+  close(sockfd);
+  return 0;
+
+fail:
+  close(sockfd);
+  return -1;
+}
+
+static int handoff_recv_data(int sockfd, struct handler *h, uint32_t length)
+{
+  if (zb_init(&h->buffer, length > 0 ? (int)length : 0) == NULL)
+    return -1;
+  while ((uint32_t)zb_available(&h->buffer) < length) {
+    ssize_t n = recv(sockfd, h->buffer.data + h->buffer.limit,
+                     (size_t)zb_free_size(&h->buffer), 0);
+    if (n <= 0) {
+      if (n == -1 && errno == EINTR)
+        continue;
+      return -1;
+    }
+    h->buffer.limit += (int)n;
+  }
+  return 0;
+}
+
+int HandoffReceive(const char *path, struct handoff_set *set, int timeout_ms)
+{
+  struct handoff_msg msg;
+  int fd, sockfd;
+  memset(set, 0, sizeof(*set));
+  sockfd = DialUnix("unixpacket", path);
+  if (sockfd == -1)
+    return -1;
+  if (handoff_set_timeout(sockfd, timeout_ms) != 0 ||
+      handoff_send(sockfd, HANDOFF_HELLO, NULL, 0, -1) != 0)
+    goto fail;
+
+  for (;;) {
+    if (handoff_recv(sockfd, &msg, &fd) != 0)
+      goto fail;
+    if (msg.type == HANDOFF_DONE) {
+      if (fd != -1)
+        close(fd);
+      break;
+    }
+    if (fd == -1 || (msg.type != HANDOFF_LISTENER && msg.type != HANDOFF_CONN)) {
+      if (fd != -1)
+        close(fd);
+      errno = EPROTO;
+      goto fail;
+    }
+    if (msg.type == HANDOFF_LISTENER) {
+      struct handoff_listener *ls = realloc(set->listeners,
+                                            sizeof(*ls) * (size_t)(set->nlisteners + 1));
+      if (!ls) {
+        close(fd);
+        goto fail;
+      }
+      set->listeners = ls;
+      memcpy(ls[set->nlisteners].name, msg.name, sizeof(msg.name));
+      ls[set->nlisteners++].fd = fd;
+    } else {
+      struct handler *conns = realloc(set->conns, sizeof(*conns) * (size_t)(set->nconns + 1));
+      if (!conns) {
+        close(fd);
+        goto fail;
+      }
+      set->conns = conns;
+      struct handler *h = &conns[set->nconns++];
+      memset(h, 0, sizeof(*h));
+      h->sockfd = fd;
+      if (handoff_recv_data(sockfd, h, msg.length) != 0)
+        goto fail;
+    }
+  }
+  // the predecessor decides: it commits, or it closes the socket after
+  // its timeout. No timeout here, or both could give up or both could keep
+  if (handoff_send(sockfd, HANDOFF_ACK, NULL, 0, -1) != 0 ||
+      handoff_set_timeout(sockfd, 0) != 0 ||
+      handoff_recv(sockfd, &msg, &fd) != 0)
+    goto fail;
+  if (fd != -1)
+    close(fd);
+  if (msg.type != HANDOFF_COMMIT) {
+    errno = EPROTO;
+    goto fail;
+  }
+  close(sockfd);
+  return 0;
+
+fail:
+  close(sockfd);
+  HandoffRelease(set);
+  return -1;
+}
+
+int HandoffAdopt(struct handoff_set *set, const char *name)
+{
+  for (int i = 0; i < set->nlisteners; i++) {
+    struct handoff_listener *l = &set->listeners[i];
+    if (l->fd != -1 && strcmp(l->name, name) == 0) {
+      int fd = l->fd;
+      l->fd = -1;
+      return fd;
+    }
+  }
+  return -1;
+}
+
+int HandoffListen_ex(struct handoff_set *set, const struct BuildNetParams *params)
+{
+  char name[HANDOFF_NAME_MAX];
+  if (set && params->network && params->local_address &&
+      handoff_name(name, sizeof(name), params->network, params->local_address) > 0) {
+    int fd = HandoffAdopt(set, name);
+    if (fd != -1)
+      return fd;
+  }
+  return Listen_ex(params);
+}
+
+void HandoffRelease(struct handoff_set *set)
+{
+  for (int i = 0; i < set->nlisteners; i++) {
+    if (set->listeners[i].fd != -1)
+      close(set->listeners[i].fd);
+  }
+  for (int i = 0; i < set->nconns; i++) {
+    if (set->conns[i].sockfd != -1) {
+      close(set->conns[i].sockfd);
+      zb_destroy(&set->conns[i].buffer);
+    }
+  }
+  free(set->listeners);
+  free(set->conns);
+  memset(set, 0, sizeof(*set));
+}
@@ -0,0 +1,77 @@
+#ifndef XNET_HANDOFF_H_
+#define XNET_HANDOFF_H_
+
+#include "base_net.h"
+#include "packet.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Zero-downtime restart.
+//
+// The running process listens on a "unixpacket" socket. A new generation
+// connects to it, receives the listening sockets (and optionally idle
+// connections with the bytes already buffered for them) through SCM_RIGHTS
+// and adopts them instead of calling bind()/listen(). The new process
+// acknowledges what it received, and the old one answers with a commit
+// once it has the ACK; it then stops accepting and drains the connections
+// it kept. The new process adopts only after the commit: if the old one
+// timed out and closed the socket instead, it gives everything back. So
+// the descriptors never end up served by both.
+//
+//   old                                new
+//   HandoffListen(path)
+//                                      HandoffReceive(path, &set)
+//   HandoffServe(...) == 0               (waits for the commit)
+//   close listeners, drain             HandoffListen_ex(&set, params)...
+//                                      HandoffRelease(&set)
+
+#define HANDOFF_NAME_MAX 108
+
+struct handoff_listener {
+  char name[HANDOFF_NAME_MAX];  // see handoff_name()
+  int fd;
+};
+
+struct handoff_set {
+  struct handoff_listener *listeners;
+  int nlisteners;
+  // adopt a connection by copying it and setting sockfd to -1 in the set
+  struct handler *conns;
+  int nconns;
+};
+
+// key of a listener: "network address", as given to Listen()
+// return length, -1 if it does not fit
+int handoff_name(char *buf, int size, const char *network, const char *address);
+
+//// old process
+// socket a successor connects to, path is unlinked first. fd, -1 error
+int HandoffListen(const char *path);
+// accept one successor on listen_fd and hand it ls and conns. Blocking,
+// each step is bounded by timeout_ms.
+// 0 : the successor owns copies of everything, close ls and conns
+//     (without writing to the conns) and drain the rest.
+// -1: nothing changed, keep serving
+int HandoffServe(int listen_fd, const struct handoff_listener *ls, int nls,
+                 const struct handler *conns, int nconns, int timeout_ms);
+
+//// new process
+// take over from the process serving path.
+// timeout_ms bounds every step but the wait for the commit, which ends
+// when the predecessor commits or closes the socket.
+// 0 : success, set is filled. -1: no predecessor or it failed, start fresh
+int HandoffReceive(const char *path, struct handoff_set *set, int timeout_ms);
+// the inherited listener called name, removed from set. fd, -1 if none
+int HandoffAdopt(struct handoff_set *set, const char *name);
+// adopt the listener for params->network/local_address if set has one,
+// Listen_ex(params) otherwise. set may be NULL
+int HandoffListen_ex(struct handoff_set *set, const struct BuildNetParams *params);
+// close whatever was not adopted
+void HandoffRelease(struct handoff_set *set);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
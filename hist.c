@@ -0,0 +1,83 @@
+#include "hist.h"
+#include <math.h>
+#include <string.h>
+
+// bucket of v: values below 2 << HIST_SUB_BITS are exact, above, v is
+// shifted down to its top HIST_SUB_BITS + 1 bits
+static int hist_index(uint64_t v)
+{
+  int e = 63 - __builtin_clzll(v | 1);
+  int shift = e > HIST_SUB_BITS ? e - HIST_SUB_BITS : 0;
+  return (shift << HIST_SUB_BITS) + (int)(v >> shift);
+}
+
+// highest value that lands in bucket i
+static uint64_t hist_highest(int i)
+{
+  if (i < (1 << HIST_SUB_BITS))
+    return (uint64_t)i;
+  int shift = (i >> HIST_SUB_BITS) - 1;
+  uint64_t sub = (uint64_t)(i - (shift << HIST_SUB_BITS));
+  return (sub << shift) + ((1ULL << shift) - 1);
+}
+
+void hist_init(struct hist *h)
+{
+  memset(h, 0, sizeof(*h));
+  h->min = UINT64_MAX;
+}
+
+void hist_record_n(struct hist *h, uint64_t value, uint64_t n)
+{
+  h->counts[hist_index(value)] += n;
+  h->count += n;
+  h->sum += (double)value * (double)n;
+  if (value < h->min)
+    h->min = value;
+  if (value > h->max)
+    h->max = value;
+}
+
+void hist_merge(struct hist *dst, const struct hist *src)
+{
+  if (src->count == 0)
+    return;
+  for (int i = 0; i < HIST_BUCKETS; i++)
+    dst->counts[i] += src->counts[i];
+  dst->count += src->count;
+  dst->sum += src->sum;
+  if (src->min < dst->min)
+    dst->min = src->min;
+  if (src->max > dst->max)
+    dst->max = src->max;
+}
+
+uint64_t hist_percentile(const struct hist *h, double percentile)
+{
+  if (h->count == 0)
+    return 0;
+  if (percentile >= 100.0)
+    return h->max;
+  uint64_t rank = (uint64_t)ceil(percentile / 100.0 * (double)h->count);
+  if (rank == 0)
+    rank = 1;
+  uint64_t seen = 0;
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    seen += h->counts[i];
+    if (seen >= rank) {
+      uint64_t v = hist_highest(i);
+      return v < h->max ? v : h->max;
+    }
+  }
+  return h->max;
+}
+
+void hist_print(const struct hist *h, FILE *f, const char *name, double scale)
+{
+  fprintf(f, "%-10s n=%-9lu mean=%-9.1f p50=%-9.1f p90=%-9.1f p99=%-9.1f "
+             "p99.9=%-9.1f p99.99=%-9.1f max=%.1f\n",
+          name, (unsigned long)h->count, hist_mean(h) / scale,
+          hist_percentile(h, 50) / scale, hist_percentile(h, 90) / scale,
+          hist_percentile(h, 99) / scale, hist_percentile(h, 99.9) / scale,
+          hist_percentile(h, 99.99) / scale, h->count ? h->max / scale : 0.0);
+}
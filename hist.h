@@ -0,0 +1,54 @@
+#ifndef XNET_HIST_H_
+#define XNET_HIST_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Log-linear latency histogram, in the spirit of HdrHistogram.
+//
+// Values below 128 have a bucket each; above, every power of two is split
+// into 64 buckets, so a recorded value is off by less than 1/64 (1.6%)
+// whatever its magnitude. The whole uint64 range fits in a fixed array:
+// recording is an index computation and an increment, no allocation, and
+// histograms of different threads are merged by adding them up.
+// Not thread-safe, keep one per thread and hist_merge() them.
+
+#define HIST_SUB_BITS 6
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+struct hist {
+  uint64_t count;
+  uint64_t min;
+  uint64_t max;
+  double sum;
+  uint64_t counts[HIST_BUCKETS];
+};
+
+void hist_init(struct hist *h);
+void hist_record_n(struct hist *h, uint64_t value, uint64_t n);
+static inline void hist_record(struct hist *h, uint64_t value)
+{
+  hist_record_n(h, value, 1);
+}
+void hist_merge(struct hist *dst, const struct hist *src);
+
+// value at or below which percentile (0..100) of the samples are,
+// reported as the highest value of its bucket. 0 if empty
+uint64_t hist_percentile(const struct hist *h, double percentile);
+static inline double hist_mean(const struct hist *h)
+{
+  return h->count ? h->sum / (double)h->count : 0.0;
+}
+
+// one line: name, count, mean, p50 p90 p99 p99.9 p99.99 max, values
+// divided by scale (e.g. 1e3 for ns printed as us)
+void hist_print(const struct hist *h, FILE *f, const char *name, double scale);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,453 @@
+#define _GNU_SOURCE
+#include "ktls.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <linux/tls.h>
+#include <openssl/core_names.h>
+#include <openssl/err.h>
+#include <openssl/kdf.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+
+#define KTLS_CIPHERS_TLS12 \
+  "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:" \
+  "ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384"
+#define KTLS_CIPHERS_TLS13 "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384"
+#define KTLS_SECRET_MAX 64
+
+struct ktls_ctx {
+  SSL_CTX *ssl_ctx;
+};
+
+// TLS 1.3 application traffic secrets, captured by the keylog callback
+struct ktls_secrets {
+  unsigned char client[KTLS_SECRET_MAX];
+  unsigned char server[KTLS_SECRET_MAX];
+  int client_len;
+  int server_len;
+};
+
+// one direction of the record layer, as the kernel wants it
+struct ktls_keys {
+  int version;
+  int cipher;
+  int key_len;
+  unsigned char key[32];
+  unsigned char salt[4];
+  unsigned char iv[8];
+  unsigned char rec_seq[8];
+};
+
+static int hex_value(char c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+static int hex_decode(const char *hex, unsigned char *out, int max)
+{
+  int n = 0;
+  while (hex[0] && hex[1] && n < max) {
+    int hi = hex_value(hex[0]), lo = hex_value(hex[1]);
+    if (hi < 0 || lo < 0)
+      break;
+    out[n++] = (unsigned char)(hi << 4 | lo);
+    hex += 2;
+  }
+  return n;
+}
+
+// "<LABEL> <client random> <secret>"
+static void ktls_keylog(const SSL *ssl, const char *line)
+{
+  struct ktls_secrets *s = SSL_get_app_data(ssl);
+  const char *secret;
+  if (!s || !(secret = strrchr(line, ' ')))
+    return;
+  if (strncmp(line, "CLIENT_TRAFFIC_SECRET_0 ", 24) == 0)
+    s->client_len = hex_decode(secret + 1, s->client, KTLS_SECRET_MAX);
+  else if (strncmp(line, "SERVER_TRAFFIC_SECRET_0 ", 24) == 0)
+    s->server_len = hex_decode(secret + 1, s->server, KTLS_SECRET_MAX);
+}
+
+static int kdf_derive(const char *name, OSSL_PARAM *params, unsigned char *out, size_t len)
+{
+  EVP_KDF *kdf = EVP_KDF_fetch(NULL, name, NULL);
+  EVP_KDF_CTX *kctx = kdf ? EVP_KDF_CTX_new(kdf) : NULL;
+  int rc = kctx && EVP_KDF_derive(kctx, out, len, params) > 0 ? 0 : -1;
+  EVP_KDF_CTX_free(kctx);
+  EVP_KDF_free(kdf);
+  return rc;
+}
+
+// RFC 8446 7.1, with an empty context
+static int hkdf_expand_label(const char *digest, const unsigned char *secret, int secret_len,
+                             const char *label, unsigned char *out, int len)
+{
+  unsigned char info[2 + 1 + 255 + 1];
+  size_t label_len = strlen(label);
+  info[0] = (unsigned char)(len >> 8);
+  info[1] = (unsigned char)len;
+  info[2] = (unsigned char)(6 + label_len);
+  memcpy(info + 3, "tls13 ", 6);
+  memcpy(info + 9, label, label_len);
+  info[9 + label_len] = 0;
+  int mode = EVP_KDF_HKDF_MODE_EXPAND_ONLY;
+  OSSL_PARAM params[] = {
+    OSSL_PARAM_construct_int(OSSL_KDF_PARAM_MODE, &mode),
+    OSSL_PARAM_construct_utf8_string(OSSL_KDF_PARAM_DIGEST, (char *)digest, 0),
+    OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_KEY, (void *)secret, (size_t)secret_len),
+    OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_INFO, info, 10 + label_len),
+    OSSL_PARAM_construct_end(),
+  };
+  return kdf_derive("HKDF", params, out, (size_t)len);
+}
+
+static int ktls_derive13(const char *digest, const struct ktls_secrets *s, int tx_is_client,
+                         struct ktls_keys *tx, struct ktls_keys *rx)
+{
+  struct ktls_keys *keys[2] = { tx_is_client ? tx : rx, tx_is_client ? rx : tx };
+  const unsigned char *secret[2] = { s->client, s->server };
+  int secret_len[2] = { s->client_len, s->server_len };
+  for (int i = 0; i < 2; i++) {
+    unsigned char iv[12];
+    if (secret_len[i] == 0 ||
+        hkdf_expand_label(digest, secret[i], secret_len[i], "key", keys[i]->key, keys[i]->key_len) != 0 ||
+        hkdf_expand_label(digest, secret[i], secret_len[i], "iv", iv, sizeof(iv)) != 0)
+      return -1;
+    memcpy(keys[i]->salt, iv, 4);
+    memcpy(keys[i]->iv, iv + 4, 8);
+    // no post-handshake messages, both directions start at record 0
+    memset(keys[i]->rec_seq, 0, 8);
+  }
+  return 0;
+}
+
+// RFC 5246 6.3 key block, AEAD ciphers have no MAC keys
+static int ktls_derive12(SSL *ssl, const char *digest, int tx_is_client,
+                         struct ktls_keys *tx, struct ktls_keys *rx)
+{
+  unsigned char master[SSL_MAX_MASTER_KEY_LENGTH];
+  unsigned char seed[13 + 2 * SSL3_RANDOM_SIZE];
+  unsigned char block[2 * 32 + 2 * 4];
+  int klen = tx->key_len;
+  size_t master_len = SSL_SESSION_get_master_key(SSL_get_session(ssl), master, sizeof(master));
+  memcpy(seed, "key expansion", 13);
+  SSL_get_server_random(ssl, seed + 13, SSL3_RANDOM_SIZE);
+  SSL_get_client_random(ssl, seed + 13 + SSL3_RANDOM_SIZE, SSL3_RANDOM_SIZE);
+  OSSL_PARAM params[] = {
+    OSSL_PARAM_construct_utf8_string(OSSL_KDF_PARAM_DIGEST, (char *)digest, 0),
+    OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_SECRET, master, master_len),
+    OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_SEED, seed, sizeof(seed)),
+    OSSL_PARAM_construct_end(),
+  };
+  int rc = master_len == 0 ? -1 : kdf_derive("TLS1-PRF", params, block, (size_t)(2 * klen + 8));
+  if (rc == 0) {
+    struct ktls_keys *client = tx_is_client ? tx : rx, *server = tx_is_client ? rx : tx;
+    memcpy(client->key, block, (size_t)klen);
+    memcpy(server->key, block + klen, (size_t)klen);
+    memcpy(client->salt, block + 2 * klen, 4);
+    memcpy(server->salt, block + 2 * klen + 4, 4);
+    // Finished was record 0 under the new keys in both directions; the
+    // explicit nonce only has to be unique, follow the sequence number
+    for (int i = 0; i < 8; i++)
+      tx->rec_seq[i] = rx->rec_seq[i] = (unsigned char)(i == 7);
+    memcpy(tx->iv, tx->rec_seq, 8);
+    memcpy(rx->iv, rx->rec_seq, 8);
+  }
+  OPENSSL_cleanse(master, sizeof(master));
+  OPENSSL_cleanse(block, sizeof(block));
+  return rc;
+}
+
+static int ktls_derive(SSL *ssl, const struct ktls_secrets *s, int is_server,
+                       struct ktls_keys *tx, struct ktls_keys *rx)
+{
+  const SSL_CIPHER *cipher = SSL_get_current_cipher(ssl);
+  const EVP_MD *md = cipher ? SSL_CIPHER_get_handshake_digest(cipher) : NULL;
+  if (!md)
+    return -1;
+  memset(tx, 0, sizeof(*tx));
+  switch (SSL_CIPHER_get_cipher_nid(cipher)) {
+    case NID_aes_128_gcm:
+      tx->cipher = TLS_CIPHER_AES_GCM_128;
+      tx->key_len = TLS_CIPHER_AES_GCM_128_KEY_SIZE;
+      break;
+    case NID_aes_256_gcm:
+      tx->cipher = TLS_CIPHER_AES_GCM_256;
+      tx->key_len = TLS_CIPHER_AES_GCM_256_KEY_SIZE;
+      break;
+    default:
+      return -1;
+  }
+  switch (SSL_version(ssl)) {
+    case TLS1_2_VERSION: tx->version = TLS_1_2_VERSION;
+                         break;
+    case TLS1_3_VERSION: tx->version = TLS_1_3_VERSION;
+                         break;
+    default:
+                         return -1;
+  }
+  *rx = *tx;
+  const char *digest = EVP_MD_get0_name(md);
+  if (tx->version == TLS_1_3_VERSION)
+    return ktls_derive13(digest, s, !is_server, tx, rx);
+  return ktls_derive12(ssl, digest, !is_server, tx, rx);
+}
+
+static int ktls_install(int fd, int direction, const struct ktls_keys *k)
+{
+  union {
+    struct tls12_crypto_info_aes_gcm_128 gcm128;
+    struct tls12_crypto_info_aes_gcm_256 gcm256;
+  } ci;
+  socklen_t len;
+  int rc;
+  memset(&ci, 0, sizeof(ci));
+  if (k->cipher == TLS_CIPHER_AES_GCM_128) {
+    ci.gcm128.info.version = (unsigned short)k->version;
+    ci.gcm128.info.cipher_type = (unsigned short)k->cipher;
+    memcpy(ci.gcm128.key, k->key, sizeof(ci.gcm128.key));
+    memcpy(ci.gcm128.salt, k->salt, sizeof(ci.gcm128.salt));
+    memcpy(ci.gcm128.iv, k->iv, sizeof(ci.gcm128.iv));
+    memcpy(ci.gcm128.rec_seq, k->rec_seq, sizeof(ci.gcm128.rec_seq));
+    len = sizeof(ci.gcm128);
+  } else {
+    ci.gcm256.info.version = (unsigned short)k->version;
+    ci.gcm256.info.cipher_type = (unsigned short)k->cipher;
+    memcpy(ci.gcm256.key, k->key, sizeof(ci.gcm256.key));
+    memcpy(ci.gcm256.salt, k->salt, sizeof(ci.gcm256.salt));
+    memcpy(ci.gcm256.iv, k->iv, sizeof(ci.gcm256.iv));
+    memcpy(ci.gcm256.rec_seq, k->rec_seq, sizeof(ci.gcm256.rec_seq));
+    len = sizeof(ci.gcm256);
+  }
+  rc = setsockopt(fd, SOL_TLS, direction, &ci, len);
+  OPENSSL_cleanse(&ci, sizeof(ci));
+  return rc;
+}
+
+static int is_ip_literal(const char *host)
+{
+  unsigned char addr[sizeof(struct in6_addr)];
+  return inet_pton(AF_INET, host, addr) == 1 || inet_pton(AF_INET6, host, addr) == 1;
+}
+
+// what the server certificate must match: SNI and host name, or an address
+static int ktls_set_peer(SSL *ssl, const char *server_name)
+{
+  int verify = SSL_get_verify_mode(ssl) & SSL_VERIFY_PEER;
+  if (!server_name)
+    return verify ? -1 : 0;
+  if (is_ip_literal(server_name))
+    return !verify || X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), server_name) == 1 ? 0 : -1;
+  if (SSL_set_tlsext_host_name(ssl, server_name) != 1)
+    return -1;
+  return !verify || SSL_set1_host(ssl, server_name) == 1 ? 0 : -1;
+}
+
+int ktls_handshake(struct ktls_ctx *ctx, int fd, int is_server, const char *server_name)
+{
+  struct ktls_secrets secrets;
+  struct ktls_keys tx, rx;
+  int rc = -1, err = EPROTO;
+  SSL *ssl = SSL_new(ctx->ssl_ctx);
+  if (!ssl)
+    return -1;
+  memset(&secrets, 0, sizeof(secrets));
+  SSL_set_app_data(ssl, &secrets);
+  // BIO_NOCLOSE: the fd outlives the SSL object
+  if (SSL_set_fd(ssl, fd) != 1)
+    goto out;
+  if (!is_server && ktls_set_peer(ssl, server_name) != 0) {
+    err = EINVAL;
+    goto out;
+  }
+  if ((is_server ? SSL_accept(ssl) : SSL_connect(ssl)) != 1)
+    goto out;
+  // anything OpenSSL has read ahead would be lost to the kernel
+  if (SSL_has_pending(ssl) || ktls_derive(ssl, &secrets, is_server, &tx, &rx) != 0)
+    goto out;
+  if (setsockopt(fd, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls")) == -1) {
+    err = errno == ENOENT ? ENOPROTOOPT : errno;
+    goto out;
+  }
+  if (ktls_install(fd, TLS_TX, &tx) == -1 || ktls_install(fd, TLS_RX, &rx) == -1) {
+    err = errno;
+    goto out;
+  }
+  rc = 0;
+out:
+  ERR_clear_error();
+  SSL_free(ssl);
+  OPENSSL_cleanse(&secrets, sizeof(secrets));
+  OPENSSL_cleanse(&tx, sizeof(tx));
+  OPENSSL_cleanse(&rx, sizeof(rx));
+  if (rc != 0)
+    errno = err;
+  return rc;
+}
+
+static struct ktls_ctx *ktls_ctx_new(const SSL_METHOD *method)
+{
+  struct ktls_ctx *ctx = calloc(1, sizeof(*ctx));
+  if (!ctx)
+    return NULL;
+  ctx->ssl_ctx = SSL_CTX_new(method);
+  if (!ctx->ssl_ctx ||
+      SSL_CTX_set_min_proto_version(ctx->ssl_ctx, TLS1_2_VERSION) != 1 ||
+      SSL_CTX_set_cipher_list(ctx->ssl_ctx, KTLS_CIPHERS_TLS12) != 1 ||
+      SSL_CTX_set_ciphersuites(ctx->ssl_ctx, KTLS_CIPHERS_TLS13) != 1) {
+    ktls_ctx_free(ctx);
+    return NULL;
+  }
+  // the kernel cannot follow tickets, renegotiation or a read-ahead buffer
+  SSL_CTX_set_options(ctx->ssl_ctx, SSL_OP_NO_TICKET | SSL_OP_NO_RENEGOTIATION);
+  SSL_CTX_set_num_tickets(ctx->ssl_ctx, 0);
+  SSL_CTX_set_read_ahead(ctx->ssl_ctx, 0);
+  SSL_CTX_set_session_cache_mode(ctx->ssl_ctx, SSL_SESS_CACHE_OFF);
+  SSL_CTX_set_keylog_callback(ctx->ssl_ctx, ktls_keylog);
+  return ctx;
+}
+
+struct ktls_ctx *ktls_ctx_client(const char *ca_file)
+{
+  struct ktls_ctx *ctx = ktls_ctx_new(TLS_client_method());
+  if (!ctx)
+    return NULL;
+  if (ca_file) {
+    if (SSL_CTX_load_verify_locations(ctx->ssl_ctx, ca_file, NULL) != 1) {
+      ktls_ctx_free(ctx);
+      return NULL;
+    }
+    SSL_CTX_set_verify(ctx->ssl_ctx, SSL_VERIFY_PEER, NULL);
+  } else {
+    SSL_CTX_set_verify(ctx->ssl_ctx, SSL_VERIFY_NONE, NULL);
+  }
+  return ctx;
+}
+
+struct ktls_ctx *ktls_ctx_server(const char *cert_file, const char *key_file)
+{
+  struct ktls_ctx *ctx = ktls_ctx_new(TLS_server_method());
+  if (!ctx)
+    return NULL;
+  if (cert_file && key_file &&
+      (SSL_CTX_use_certificate_chain_file(ctx->ssl_ctx, cert_file) != 1 ||
+       SSL_CTX_use_PrivateKey_file(ctx->ssl_ctx, key_file, SSL_FILETYPE_PEM) != 1 ||
+       SSL_CTX_check_private_key(ctx->ssl_ctx) != 1)) {
+    ktls_ctx_free(ctx);
+    return NULL;
+  }
+  return ctx;
+}
+
+void ktls_ctx_free(struct ktls_ctx *ctx)
+{
+  if (!ctx)
+    return;
+  SSL_CTX_free(ctx->ssl_ctx);
+  free(ctx);
+}
+
+void *ktls_ctx_ssl_ctx(struct ktls_ctx *ctx)
+{
+  return ctx->ssl_ctx;
+}
+
+// "tls" -> "tcp", "tls4" -> "tcp4", "tls6" -> "tcp6"
+static const char *ktls_network(const char *network)
+{
+  if (strcmp(network, "tls") == 0)
+    return "tcp";
+  if (strcmp(network, "tls4") == 0)
+    return "tcp4";
+  if (strcmp(network, "tls6") == 0)
+    return "tcp6";
+  errno = EINVAL;
+  return NULL;
+}
+
+// host part of host:port, without the brackets and the zone of a v6
+// address. NULL if there is none
+static const char *ktls_server_name(const char *address, char *buf, size_t size)
+{
+  const char *host = address, *end;
+  if (address[0] == '[') {
+    host++;
+    end = strchr(host, ']');
+    if (!end)
+      return NULL;
+    const char *zone = memchr(host, '%', (size_t)(end - host));
+    if (zone)
+      end = zone;
+  } else {
+    end = strrchr(address, ':');
+    if (!end)
+      end = address + strlen(address);
+  }
+  size_t n = (size_t)(end - host);
+  if (n == 0 || n >= size)
+    return NULL;
+  memcpy(buf, host, n);
+  buf[n] = '\0';
+  return buf;
+}
+
+int DialTLS(const char *network, const char *address, struct ktls_ctx *ctx)
+{
+  char name[256];
+  const char *tcp = ktls_network(network);
+  if (!tcp)
+    return -1;
+  int fd = DialTCP(tcp, address);
+  if (fd == -1)
+    return -1;
+  if (ktls_handshake(ctx, fd, 0, ktls_server_name(address, name, sizeof(name))) != 0) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+  return fd;
+}
+
+int ListenTLS(const char *network, const char *address)
+{
+  const char *tcp = ktls_network(network);
+  return tcp ? ListenTCP(tcp, address) : -1;
+}
+
+int AcceptTLS(int listen_fd, struct ktls_ctx *ctx)
+{
+  int fd;
+  do {
+    fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+  } while (fd == -1 && errno == EINTR);
+  if (fd == -1)
+    return -1;
+  if (ktls_handshake(ctx, fd, 1, NULL) != 0) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+  return fd;
+}
@@ -0,0 +1,51 @@
+#ifndef XNET_KTLS_H_
+#define XNET_KTLS_H_
+
+#include "base_net.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// TLS with the record layer in the kernel (kTLS).
+//
+// The handshake runs in OpenSSL on a blocking fd. Afterwards the traffic
+// keys are installed with setsockopt(SOL_TLS, TLS_TX/TLS_RX) and the SSL
+// object is dropped: the fd is a plain TCP socket again from the caller's
+// point of view, recv()/zb_appendSocket(), send() and sendfile() move
+// plaintext while the kernel encrypts and decrypts in place.
+//
+// Supported: TLS 1.2 and 1.3 with AES-128-GCM / AES-256-GCM. Session
+// tickets and renegotiation are disabled because the kernel continues the
+// record sequence numbers. A control record (alert, key update) makes
+// recv() fail with EIO; treat it as the end of the connection.
+
+struct ktls_ctx;
+
+// ca_file NULL: do not verify the server (tests, benchmarks)
+struct ktls_ctx *ktls_ctx_client(const char *ca_file);
+struct ktls_ctx *ktls_ctx_server(const char *cert_file, const char *key_file);
+void ktls_ctx_free(struct ktls_ctx *ctx);
+// the underlying SSL_CTX, e.g. to load an in-memory certificate
+void *ktls_ctx_ssl_ctx(struct ktls_ctx *ctx);
+
+// handshake on a connected fd, then offload both directions.
+// server_name: the host name (sent as SNI) or the IP address the server
+// certificate must match. A client that verifies fails with EINVAL
+// without one, NULL is for ktls_ctx_client(NULL) only.
+// 0 : success, -1 fail (errno ENOPROTOOPT if the kernel has no kTLS)
+int ktls_handshake(struct ktls_ctx *ctx, int fd, int is_server, const char *server_name);
+
+// network variants "tls", "tls4", "tls6" map to tcp, tcp4, tcp6, anything
+// else fails with EINVAL. Dial()/Listen() do not take them, see base_net.h
+// the certificate is checked against the host of address
+int DialTLS(const char *network, const char *address, struct ktls_ctx *ctx);
+int ListenTLS(const char *network, const char *address);
+// accept one connection on a TLS listener and run the server handshake.
+// fd, -1 error
+int AcceptTLS(int listen_fd, struct ktls_ctx *ctx);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
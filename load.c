@@ -0,0 +1,541 @@
+//
+// Open-loop load generator.
+//
+// usage: xnet_load [-t threads] [-c conns] [-r rate] [-d seconds] [-w seconds]
+//                  [-p depth] [-s size] [-a const|poisson] network address
+//
+// Every thread owns its share of the -c connections, dialed up front, and
+// sends its share of -r requests per second on a fixed schedule, constant
+// intervals or Poisson arrivals. The schedule never waits for responses.
+// A request that finds all connections of its thread at the pipelining
+// depth -p waits in line. Its latency is still measured from the time it
+// was due, so a server stall costs the queued requests what they really
+// lost (the coordinated omission correction of wrk2). The time from the
+// actual send is printed alongside as "service".
+//
+// Requests are rpc frames (rpc.h) with -s bytes of payload: a number, a
+// uniform range "min-max" or "exp:mean" for exponentially distributed
+// sizes. Any server answering every frame with one frame of the same id,
+// in order, will do, e.g. "xnet_main tcp4 127.0.0.1:9000 0 echo".
+// The first -w seconds are not recorded.
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include "base_net.h"
+#include "hist.h"
+#include "packet.h"
+#include "reactor.h"
+#include "rpc.h"
+
+#define LOAD_DRAIN_NS 2000000000ULL  // wait for the last responses
+#define LOAD_MAX_PAYLOAD (1 << 20)
+
+enum { SIZE_FIXED, SIZE_UNIFORM, SIZE_EXP };
+enum { ARRIVAL_CONST, ARRIVAL_POISSON };
+
+struct load {
+  struct Endpoint ep;
+  int threads;
+  int conns;
+  double rate;
+  double duration;
+  double warmup;
+  int depth;
+  int arrival;
+  int size_kind;
+  int size_a;  // fixed size, uniform min or exp mean
+  int size_b;  // uniform max
+  uint64_t start;
+  char payload[LOAD_MAX_PAYLOAD];
+};
+
+// a request in flight
+struct load_req {
+  uint64_t due;
+  uint64_t sent;
+};
+
+struct load_thread;
+
+struct load_conn {
+  struct load_thread *t;
+  int fd;
+  struct zbytes in;
+  struct zbytes out;
+  struct load_req *reqs;  // ring of depth, ids head-depth..head-1
+  uint32_t head;          // id of the next request
+  uint32_t tail;          // id of the oldest request in flight
+  int ready;              // in the ready ring
+  int dirty;              // in the dirty list
+  int out_armed;
+};
+
+struct load_thread {
+  struct load *l;
+  pthread_t tid;
+  struct reactor *r;
+  int timerfd;
+  struct load_conn *conns;
+  int nconns;
+  int alive;
+  // connections below the depth, round robin
+  struct load_conn **ready;
+  int ready_head;
+  int nready;
+  // connections with output to send after this iteration
+  struct load_conn **dirty;
+  int ndirty;
+  double interval_ns;  // mean time between two requests
+  uint64_t due;        // when the next request is due
+  uint64_t record_from;
+  uint64_t end;
+  uint64_t rng;
+  struct hist latency;  // from the due time
+  struct hist service;  // from the send
+  uint64_t sent;
+  uint64_t completed;
+  uint64_t failed;      // in flight on a connection that broke
+  uint64_t max_lag_ns;  // how far the schedule fell behind
+  int done;
+};
+
+static uint64_t load_now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t load_rand(struct load_thread *t)
+{
+  uint64_t x = t->rng;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  t->rng = x;
+  return x * 0x2545F4914F6CDD1DULL;
+}
+
+// (0, 1]
+static double load_uniform(struct load_thread *t)
+{
+  return (double)((load_rand(t) >> 11) + 1) / 9007199254740992.0;
+}
+
+static uint64_t load_interval(struct load_thread *t)
+{
+  if (t->l->arrival == ARRIVAL_POISSON)
+    return (uint64_t)(-log(load_uniform(t)) * t->interval_ns);
+  return (uint64_t)t->interval_ns;
+}
+
+static int load_size(struct load_thread *t)
+{
+  const struct load *l = t->l;
+  if (l->size_kind == SIZE_UNIFORM)
+    return l->size_a + (int)(load_rand(t) % (uint64_t)(l->size_b - l->size_a + 1));
+  if (l->size_kind == SIZE_EXP) {
+    double v = -log(load_uniform(t)) * l->size_a;
+    return v < LOAD_MAX_PAYLOAD ? (int)v : LOAD_MAX_PAYLOAD;
+  }
+  return l->size_a;
+}
+
+static void ready_push(struct load_thread *t, struct load_conn *cn)
+{
+  t->ready[(t->ready_head + t->nready++) % t->nconns] = cn;
+  cn->ready = 1;
+}
+
+static struct load_conn *ready_pop(struct load_thread *t)
+{
+  if (t->nready == 0)
+    return NULL;
+  struct load_conn *cn = t->ready[t->ready_head];
+  t->ready_head = (t->ready_head + 1) % t->nconns;
+  t->nready--;
+  cn->ready = 0;
+  return cn;
+}
+
+static void conn_close(struct load_conn *cn)
+{
+  struct load_thread *t = cn->t;
+  reactor_remove(t->r, cn->fd);
+  close(cn->fd);
+  cn->fd = -1;
+  t->failed += cn->head - cn->tail;
+  cn->tail = cn->head;
+  t->alive--;
+}
+
+static int conn_flush(struct load_conn *cn)
+{
+  while (!zb_empty(&cn->out)) {
+    ssize_t n = send(cn->fd, zb_data(&cn->out), (size_t)zb_available(&cn->out), MSG_NOSIGNAL);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN)
+        return -1;
+      if (!cn->out_armed && reactor_modify(cn->t->r, cn->fd, EPOLLIN | EPOLLOUT) == 0)
+        cn->out_armed = 1;
+      return 0;
+    }
+    zb_skip(&cn->out, (int)n);
+  }
+  zb_zero(&cn->out);
+  if (cn->out_armed && reactor_modify(cn->t->r, cn->fd, EPOLLIN) == 0)
+    cn->out_armed = 0;
+  return 0;
+}
+
+static void thread_arm(struct load_thread *t)
+{
+  struct itimerspec its;
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = (time_t)(t->due / 1000000000ULL);
+  its.it_value.tv_nsec = (long)(t->due % 1000000000ULL);
+  timerfd_settime(t->timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+// send everything that is due, as far as the depth allows
+static void thread_pump(struct load_thread *t, uint64_t now)
+{
+  while (t->due <= now && t->due < t->end) {
+    struct load_conn *cn = ready_pop(t);
+    if (!cn)
+      break;  // behind schedule, the rest keeps its due time
+    if (cn->fd == -1)
+      continue;
+    if (now - t->due > t->max_lag_ns)
+      t->max_lag_ns = now - t->due;
+    // in flight only once queued, conn_close() counts head - tail as failed
+    uint32_t id = cn->head;
+    if (rpc_append_frame(&cn->out, id, t->l->payload, load_size(t)) != 0) {
+      conn_close(cn);
+      continue;
+    }
+    cn->reqs[id % (uint32_t)t->l->depth] = (struct load_req){ t->due, now };
+    cn->head++;
+    t->sent++;
+    if (!cn->dirty) {
+      cn->dirty = 1;
+      t->dirty[t->ndirty++] = cn;
+    }
+    if ((int)(cn->head - cn->tail) < t->l->depth)
+      ready_push(t, cn);
+    t->due += load_interval(t);
+  }
+  for (int i = 0; i < t->ndirty; i++) {
+    struct load_conn *cn = t->dirty[i];
+    cn->dirty = 0;
+    if (cn->fd != -1 && conn_flush(cn) != 0)
+      conn_close(cn);
+  }
+  t->ndirty = 0;
+  if (t->due < t->end && t->due > now)
+    thread_arm(t);
+}
+
+static void conn_on_io(struct reactor *r, int fd, uint32_t events, void *arg)
+{
+  struct load_conn *cn = arg;
+  struct load_thread *t = cn->t;
+  (void)r;
+  (void)fd;
+  if ((events & EPOLLOUT) && conn_flush(cn) != 0) {
+    conn_close(cn);
+    return;
+  }
+  if (!(events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+    return;
+  if (zb_free_size(&cn->in) < (1 << 12) && zb_reserve(&cn->in, 1 << 16) != 0) {
+    conn_close(cn);
+    return;
+  }
+  int n = zb_appendSocket(cn->fd, &cn->in);
+  if (n == 0 || (n == -1 && errno != EAGAIN)) {
+    conn_close(cn);
+    return;
+  }
+  uint64_t now = load_now_ns();
+  while ((n = rpc_frame(&cn->in)) > 0) {
+    uint32_t id;
+    memcpy(&id, zb_data(&cn->in) + 4, sizeof(id));
+    if (cn->tail == cn->head || ntohl(id) != cn->tail) {
+      conn_close(cn);
+      return;
+    }
+    const struct load_req *req = &cn->reqs[cn->tail++ % (uint32_t)t->l->depth];
+    if (req->due >= t->record_from) {
+      hist_record(&t->latency, now - req->due);
+      hist_record(&t->service, now - req->sent);
+    }
+    t->completed++;
+    zb_skip(&cn->in, n);
+  }
+  if (n < 0) {
+    conn_close(cn);
+    return;
+  }
+  zb_move(&cn->in);
+  // a partial response frees no slot, a full connection stays out
+  if (!cn->ready && (int)(cn->head - cn->tail) < t->l->depth)
+    ready_push(t, cn);
+  thread_pump(t, now);
+}
+
+static void timer_on_io(struct reactor *r, int fd, uint32_t events, void *arg)
+{
+  struct load_thread *t = arg;
+  uint64_t expirations;
+  (void)r;
+  (void)events;
+  if (read(fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN)
+    return;
+  thread_pump(t, load_now_ns());
+}
+
+static int conn_pre_call(int sockfd, const struct BuildNetParams *params)
+{
+  int on = 1;
+  (void)params;
+  setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  return 0;
+}
+
+static int thread_init(struct load_thread *t, struct load *l, int index, int nconns)
+{
+  struct BuildNetParams params = {
+    .flags = XNET_F_NONBLOCK,
+    .pre_call = conn_pre_call,
+  };
+  memset(t, 0, sizeof(*t));
+  t->l = l;
+  t->rng = 0x9E3779B97F4A7C15ULL * (uint64_t)(index + 1);
+  t->interval_ns = 1e9 * l->threads / l->rate;
+  hist_init(&t->latency);
+  hist_init(&t->service);
+  t->r = reactor_create(0);
+  t->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  t->conns = calloc((size_t)nconns, sizeof(*t->conns));
+  t->ready = calloc((size_t)nconns, sizeof(*t->ready));
+  t->dirty = calloc((size_t)nconns, sizeof(*t->dirty));
+  if (!t->r || t->timerfd == -1 || !t->conns || !t->ready || !t->dirty)
+    return -1;
+  if (reactor_add(t->r, t->timerfd, EPOLLIN, timer_on_io, t) != 0)
+    return -1;
+  for (int i = 0; i < nconns; i++) {
+    struct load_conn *cn = &t->conns[i];
+    cn->t = t;
+    cn->fd = DialEndpoint(&l->ep, NULL, &params);
+    if (cn->fd == -1 || WaitConnected(cn->fd, 5000) != 0) {
+      if (cn->fd != -1)
+        close(cn->fd);
+      return -1;
+    }
+    t->nconns = i + 1;
+    cn->reqs = malloc(sizeof(*cn->reqs) * (size_t)l->depth);
+    if (!cn->reqs || !zb_init(&cn->in, 1 << 16) || !zb_init(&cn->out, 1 << 16) ||
+        reactor_add(t->r, cn->fd, EPOLLIN, conn_on_io, cn) != 0)
+      return -1;
+    t->alive++;
+    ready_push(t, cn);
+  }
+  return 0;
+}
+
+static void thread_destroy(struct load_thread *t)
+{
+  for (int i = 0; i < t->nconns; i++) {
+    struct load_conn *cn = &t->conns[i];
+    if (cn->fd != -1) {
+      reactor_remove(t->r, cn->fd);
+      close(cn->fd);
+    }
+    zb_destroy(&cn->in);
+    zb_destroy(&cn->out);
+    free(cn->reqs);
+  }
+  if (t->timerfd != -1)
+    close(t->timerfd);
+  if (t->r)
+    reactor_destroy(t->r);
+  free(t->conns);
+  free(t->ready);
+  free(t->dirty);
+}
+
+static uint64_t thread_in_flight(const struct load_thread *t)
+{
+  return t->sent - t->completed - t->failed;
+}
+
+static void *thread_main(void *arg)
+{
+  struct load_thread *t = arg;
+  const struct load *l = t->l;
+  // a random phase, the threads do not send in lockstep
+  t->due = l->start + (uint64_t)(load_uniform(t) * t->interval_ns);
+  t->record_from = l->start + (uint64_t)(l->warmup * 1e9);
+  t->end = t->record_from + (uint64_t)(l->duration * 1e9);
+  thread_pump(t, load_now_ns());
+  for (;;) {
+    uint64_t now = load_now_ns();
+    if (t->alive == 0)
+      break;
+    if (now >= t->end && (thread_in_flight(t) == 0 || now >= t->end + LOAD_DRAIN_NS))
+      break;
+    if (reactor_run_once(t->r, 100) == -1)
+      break;
+  }
+  return NULL;
+}
+
+static int parse_size(struct load *l, const char *s)
+{
+  if (strncmp(s, "exp:", 4) == 0) {
+    l->size_kind = SIZE_EXP;
+    l->size_a = atoi(s + 4);
+  } else if (strchr(s, '-')) {
+    l->size_kind = SIZE_UNIFORM;
+    l->size_a = atoi(s);
+    l->size_b = atoi(strchr(s, '-') + 1);
+  } else {
+    l->size_kind = SIZE_FIXED;
+    l->size_a = atoi(s);
+  }
+  if (l->size_a < 0 || l->size_a > LOAD_MAX_PAYLOAD ||
+      (l->size_kind == SIZE_UNIFORM && (l->size_b < l->size_a || l->size_b > LOAD_MAX_PAYLOAD)))
+    return -1;
+  return 0;
+}
+
+// thousands of connections need more than the default 1024 fds
+static void raise_nofile(void)
+{
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "usage: %s [-t threads] [-c conns] [-r rate] [-d seconds] [-w seconds]\n"
+                  "          [-p depth] [-s size|min-max|exp:mean] [-a const|poisson] network address\n",
+          name);
+}
+
+int main(int ac, char *av[])
+{
+  static struct load l = {
+    .threads = 1,
+    .conns = 100,
+    .rate = 10000,
+    .duration = 10,
+    .warmup = 1,
+    .depth = 1,
+    .size_a = 64,
+  };
+  int opt;
+  while ((opt = getopt(ac, av, "t:c:r:d:w:p:s:a:")) != -1) {
+    switch (opt) {
+      case 't': l.threads = atoi(optarg); break;
+      case 'c': l.conns = atoi(optarg); break;
+      case 'r': l.rate = atof(optarg); break;
+      case 'd': l.duration = atof(optarg); break;
+      case 'w': l.warmup = atof(optarg); break;
+      case 'p': l.depth = atoi(optarg); break;
+      case 's':
+        if (parse_size(&l, optarg) != 0) {
+          usage(av[0]);
+          return 1;
+        }
+        break;
+      case 'a': l.arrival = strcmp(optarg, "poisson") == 0 ? ARRIVAL_POISSON : ARRIVAL_CONST; break;
+      default:
+        usage(av[0]);
+        return 1;
+    }
+  }
+  if (ac - optind != 2 || l.threads <= 0 || l.conns < l.threads || l.rate <= 0 ||
+      l.duration <= 0 || l.warmup < 0 || l.depth <= 0) {
+    usage(av[0]);
+    return 1;
+  }
+  if (ResolveEndpoint(&l.ep, av[optind], av[optind + 1], 0) != 0) {
+    perror("resolve");
+    return 1;
+  }
+  raise_nofile();
+
+  struct load_thread *threads = calloc((size_t)l.threads, sizeof(*threads));
+  if (!threads) {
+    perror("calloc");
+    EndpointFree(&l.ep);
+    return 1;
+  }
+  int rc = 0;
+  // the threads thread_init() ran on, the rest are zeroed: fd 0 is stdin
+  int ninit = 0;
+  for (int i = 0; i < l.threads && rc == 0; i++) {
+    int n = l.conns / l.threads + (i < l.conns % l.threads);
+    ninit = i + 1;
+    if (thread_init(&threads[i], &l, i, n) != 0) {
+      perror("dial");
+      rc = -1;
+    }
+  }
+  if (rc == 0) {
+    printf("%d threads, %d connections, depth %d, %.0f req/s %s, %.0fs + %.0fs warmup\n",
+           l.threads, l.conns, l.depth, l.rate,
+           l.arrival == ARRIVAL_POISSON ? "poisson" : "constant", l.duration, l.warmup);
+    l.start = load_now_ns();
+    for (int i = 0; i < l.threads; i++)
+      pthread_create(&threads[i].tid, NULL, thread_main, &threads[i]);
+
+    struct hist *latency = malloc(sizeof(*latency)), *service = malloc(sizeof(*service));
+    uint64_t sent = 0, completed = 0, failed = 0, lag = 0;
+    hist_init(latency);
+    hist_init(service);
+    for (int i = 0; i < l.threads; i++) {
+      struct load_thread *t = &threads[i];
+      pthread_join(t->tid, NULL);
+      hist_merge(latency, &t->latency);
+      hist_merge(service, &t->service);
+      sent += t->sent;
+      completed += t->completed;
+      failed += t->failed;
+      if (t->max_lag_ns > lag)
+        lag = t->max_lag_ns;
+    }
+    printf("sent %lu, completed %lu, failed %lu, unanswered %lu, max send lag %.1f ms\n",
+           (unsigned long)sent, (unsigned long)completed, (unsigned long)failed,
+           (unsigned long)(sent - completed - failed), lag / 1e6);
+    printf("recorded %.0f req/s\n", latency->count / l.duration);
+    printf("latency in us, from the scheduled send time and from the actual one\n");
+    hist_print(latency, stdout, "latency", 1e3);
+    hist_print(service, stdout, "service", 1e3);
+    free(latency);
+    free(service);
+  }
+  for (int i = 0; i < ninit; i++)
+    thread_destroy(&threads[i]);
+  free(threads);
+  EndpointFree(&l.ep);
+  return rc == 0 ? 0 : 1;
+}
@@ -1,18 +1,143 @@
 //
 // Created by Hao Wu on 8/2/19.
 //
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/socket.h>
+#include <string.h>
+#include <unistd.h>
+#include "acceptor.h"
 #include "base_net.h"
+#include "capture.h"
+#include "packet.h"
+
+// usage: xnet_main network address [max_conns] [echo|discard] [capture_prefix]
+// accept connections and discard whatever they send, or with "echo" send
+// it back (e.g. for xnet_load). With a capture prefix everything received
+// is recorded for xnet_replay.
+static struct acceptor_limits g_limits;
+static int g_echo;
+static struct capture *g_capture;
+static uint64_t g_conn_id;
+
+struct conn {
+    struct zbytes zb;  // echo: bytes not sent back yet
+    uint64_t id;
+};
+
+static void conn_close(struct reactor *r, int fd, struct conn *c)
+{
+    if (g_capture)
+        capture_record(g_capture, c->id, CAPTURE_CLOSE, NULL, 0);
+    reactor_remove(r, fd);
+    close(fd);
+    zb_destroy(&c->zb);
+    free(c);
+    acceptor_limits_release(&g_limits);
+}
+
+static void on_data(struct reactor *r, int fd, uint32_t events, void *arg)
+{
+    struct conn *c = arg;
+    char buf[4096];
+    ssize_t n;
+    (void)events;
+    while ((n = recv(fd, buf, sizeof(buf), 0)) > 0) {
+        if (g_capture)
+            capture_record(g_capture, c->id, CAPTURE_DATA, buf, (int)n);
+    }
+    if (n == 0 || (errno != EAGAIN && errno != EINTR))
+        conn_close(r, fd, c);
+}
+
+// send what is buffered. 1 : all sent, 0 : the rest waits for EPOLLOUT, -1 fail
+static int echo_flush(int fd, struct zbytes *zb)
+{
+    while (!zb_empty(zb)) {
+        ssize_t n = send(fd, zb_data(zb), (size_t)zb_available(zb), MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN ? 0 : -1;
+        }
+        zb_skip(zb, (int)n);
+    }
+    zb_zero(zb);
+    return 1;
+}
+
+// read only while the peer takes the echo, a client that does not read
+// its responses stalls itself
+static void on_echo(struct reactor *r, int fd, uint32_t events, void *arg)
+{
+    struct conn *c = arg;
+    struct zbytes *zb = &c->zb;
+    int rc;
+    if (!zb_empty(zb)) {
+        if ((rc = echo_flush(fd, zb)) != 1) {
+            if (rc == -1)
+                conn_close(r, fd, c);
+            return;
+        }
+        reactor_modify(r, fd, EPOLLIN);
+    }
+    if (!(events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+        return;
+    rc = g_capture ? capture_appendSocket(g_capture, c->id, fd, zb) : zb_appendSocket(fd, zb);
+    if (rc == 0 || (rc == -1 && errno != EAGAIN)) {
+        conn_close(r, fd, c);
+        return;
+    }
+    if ((rc = echo_flush(fd, zb)) == -1)
+        conn_close(r, fd, c);
+    else if (rc == 0)
+        reactor_modify(r, fd, EPOLLOUT);
+}
+
+static void on_accept(struct acceptor *a, int cfd, void *arg)
+{
+    (void)arg;
+    struct conn *c = calloc(1, sizeof(*c));
+    if (!c || (g_echo && !zb_init(&c->zb, 0))) {
+        free(c);
+        close(cfd);
+        acceptor_limits_release(&g_limits);
+        return;
+    }
+    c->id = ++g_conn_id;
+    if (g_capture)
+        capture_record(g_capture, c->id, CAPTURE_OPEN, NULL, 0);
+    if (reactor_add(a->r, cfd, EPOLLIN, g_echo ? on_echo : on_data, c) != 0)
+        conn_close(a->r, cfd, c);
+}
 
 int main(int ac, char *av[])
 {
+    if (ac < 3) {
+        fprintf(stderr, "usage: %s network address [max_conns] [echo|discard] [capture_prefix]\n", av[0]);
+        return 1;
+    }
+    g_echo = ac > 4 && strcmp(av[4], "echo") == 0;
+    if (ac > 5 && !(g_capture = capture_open(av[5], NULL))) {
+        perror("capture");
+        return 1;
+    }
     int fd = Listen(av[1], av[2]);
-    int cfd;
     printf("fd = %d\n", fd);
-    struct sockaddr_storage cli_addr;
-    socklen_t len;
-    cfd = accept(fd, (struct sockaddr*)&cli_addr, &len);
-    printf("cfd = %d\n", cfd);
+    if (fd == -1)
+        return 1;
+
+    struct reactor *r = reactor_create(0);
+    struct acceptor acceptor;
+    acceptor_limits_init(&g_limits, ac > 3 ? atoi(av[3]) : 0, 0);
+    if (!r || acceptor_init(&acceptor, r, fd, &g_limits, 0, 0, on_accept, NULL) != 0)
+        return 1;
+    reactor_run(r);
+    acceptor_close(&acceptor);
+    reactor_destroy(r);
+    close(fd);
+    if (g_capture)
+        capture_close(g_capture);
     return 0;
 }
@@ -4,6 +4,7 @@
 #include "packet.h"
 #include <errno.h>
 #include <sys/socket.h>
+#include <linux/errqueue.h>
 
 // TODO: how to handle this function
 int zb_appendSocket(int fd, struct zbytes *zb)
@@ -20,3 +21,52 @@ int zb_appendSocket(int fd, struct zbytes *zb)
     zb->limit += n;
     return (int)n;
 }
+
+int zb_appendSocketTs(int fd, struct zbytes *zb, uint64_t *rx_ns)
+{
+    char control[CMSG_SPACE(sizeof(struct scm_timestamping))];
+    struct iovec iov = { &zb->data[zb->limit], (size_t)zb_free_size(zb) };
+    struct msghdr msg;
+    ssize_t n;
+    retry:
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    n = recvmsg(fd, &msg, 0);
+    if (n==-1) {
+        if (errno==EINTR)
+            goto retry;
+        return -1;
+    }
+    *rx_ns = 0;
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPING) {
+            struct scm_timestamping stamps;
+            memcpy(&stamps, CMSG_DATA(c), sizeof(stamps));
+            *rx_ns = (uint64_t)stamps.ts[0].tv_sec * 1000000000ULL + (uint64_t)stamps.ts[0].tv_nsec;
+        }
+    }
+    zb->limit += n;
+    return (int)n;
+}
+
+int zb_dispatch_packets(struct zbytes *zb, zb_packet_frame_func frame,
+                        zb_packet_processor_func process)
+{
+    int count = 0;
+    while (!zb_empty(zb)) {
+        int n = frame(zb);
+        if (n == 0)
+            break;
+        if (n < 0 || n > zb_available(zb))
+            return -1;
+        if (process(zb_data(zb), n) < 0)
+            return -1;
+        zb_skip(zb, n);
+        count++;
+    }
+    zb_move(zb);
+    return count;
+}
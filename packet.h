@@ -13,6 +13,10 @@ struct handler {
 };
 // number of bytes read from socket, or -1 if read failed
 int zb_appendSocket(int fd, struct zbytes *zb);
+// zb_appendSocket() that also returns the kernel receive stamp of the data
+// read (CLOCK_REALTIME ns), 0 if there is none. The socket needs
+// ts_enable(fd, TS_RX), see tstamp.h
+int zb_appendSocketTs(int fd, struct zbytes *zb, uint64_t *rx_ns);
 
 typedef int (*zb_packet_processor_func)(char *data, int length);
 #define ZBF_NOP         0
@@ -21,5 +25,13 @@ typedef int (*zb_packet_processor_func)(char *data, int length);
 #define ZBF_XMEM        (1<<2)
 typedef int (*zb_packet_checker_func)(struct zbytes *zb);
 
+// length of the first complete packet at zb_data(zb),
+// 0 if more bytes are needed, -1 if the stream is malformed
+typedef int (*zb_packet_frame_func)(const struct zbytes *zb);
+// hand every complete packet in zb to process, then compact zb.
+// number of packets processed, or -1 if framing or processing failed
+int zb_dispatch_packets(struct zbytes *zb, zb_packet_frame_func frame,
+                        zb_packet_processor_func process);
+
 
 #endif //XNET_PACKET_H
@@ -0,0 +1,508 @@
+#define _GNU_SOURCE
+#include "reactor.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#define REACTOR_DEFAULT_EVENTS 256
+
+#ifndef EPIOCSPARAMS
+// <linux/eventpoll.h> of Linux 6.9
+struct epoll_params {
+  uint32_t busy_poll_usecs;
+  uint16_t busy_poll_budget;
+  uint8_t prefer_busy_poll;
+  uint8_t __pad;
+};
+#define EPIOCSPARAMS _IOW(0x8A, 0x01, struct epoll_params)
+#endif
+
+struct reactor_slot {
+  reactor_io_func fn;
+  void *arg;
+};
+
+struct reactor_post_item {
+  reactor_task_func fn;
+  void *arg;
+};
+
+struct reactor_post_queue {
+  struct reactor_post_item *items;
+  int size;
+  int cap;
+};
+
+struct reactor {
+  int epfd;
+  int wakefd;
+  int max_events;
+  struct epoll_event *events;
+
+  // indexed by fd
+  struct reactor_slot *slots;
+  int nslots;
+
+  pthread_mutex_t post_lock;
+  struct reactor_post_queue posted;
+  struct reactor_post_queue running;
+  int wake_pending;
+
+  // binary min-heap on deadline
+  struct reactor_timer **timers;
+  int ntimers;
+  int timers_cap;
+
+  int stopped;
+
+  int stamp_wakeups;
+  uint64_t wake_ns;
+
+  // spin-then-block, see reactor_set_spin()
+  uint64_t spin_min_ns;
+  uint64_t spin_max_ns;  // 0: off
+  uint64_t spin_budget_ns;
+  bool spin_yield;
+  struct reactor_spin_stats spin;
+};
+
+static int reactor_wake(struct reactor *r)
+{
+  uint64_t one = 1;
+  // coalesce wakeups: only the first poster after a drain writes the eventfd
+  if (__atomic_exchange_n(&r->wake_pending, 1, __ATOMIC_ACQ_REL))
+    return 0;
+  while (write(r->wakefd, &one, sizeof(one)) == -1) {
+    if (errno != EINTR)
+      return errno == EAGAIN ? 0 : -1;
+  }
+  return 0;
+}
+
+struct reactor *reactor_create(int max_events)
+{
+  struct reactor *r = calloc(1, sizeof(*r));
+  if (!r)
+    return NULL;
+  if (max_events <= 0)
+    max_events = REACTOR_DEFAULT_EVENTS;
+  r->max_events = max_events;
+  r->epfd = -1;
+  r->wakefd = -1;
+  r->events = malloc(sizeof(struct epoll_event) * (size_t)max_events);
+  if (!r->events)
+    goto fail;
+  r->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (r->epfd == -1)
+    goto fail;
+  r->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (r->wakefd == -1)
+    goto fail;
+  struct epoll_event ev = {
+    .events = EPOLLIN,
+    .data.fd = r->wakefd,
+  };
+  if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->wakefd, &ev) == -1)
+    goto fail;
+  pthread_mutex_init(&r->post_lock, NULL);
+  return r;
+
+fail:
+  if (r->wakefd != -1)
+    close(r->wakefd);
+  if (r->epfd != -1)
+    close(r->epfd);
+  free(r->events);
+  free(r);
+  return NULL;
+}
+
+void reactor_destroy(struct reactor *r)
+{
+  if (!r)
+    return;
+  close(r->wakefd);
+  close(r->epfd);
+  pthread_mutex_destroy(&r->post_lock);
+  free(r->posted.items);
+  free(r->running.items);
+  free(r->slots);
+  free(r->timers);
+  free(r->events);
+  free(r);
+}
+
+static int reactor_ensure_slot(struct reactor *r, int fd)
+{
+  if (fd < r->nslots)
+    return 0;
+  int n = r->nslots ? r->nslots : 64;
+  while (n <= fd)
+    n *= 2;
+  struct reactor_slot *slots = realloc(r->slots, sizeof(*slots) * (size_t)n);
+  if (!slots)
+    return -1;
+  memset(slots + r->nslots, 0, sizeof(*slots) * (size_t)(n - r->nslots));
+  r->slots = slots;
+  r->nslots = n;
+  return 0;
+}
+
+int reactor_add(struct reactor *r, int fd, uint32_t events, reactor_io_func fn, void *arg)
+{
+  if (fd < 0 || !fn || reactor_ensure_slot(r, fd) != 0)
+    return -1;
+  struct epoll_event ev = {
+    .events = events,
+    .data.fd = fd,
+  };
+  if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+    return -1;
+  r->slots[fd].fn = fn;
+  r->slots[fd].arg = arg;
+  return 0;
+}
+
+int reactor_modify(struct reactor *r, int fd, uint32_t events)
+{
+  if (fd < 0 || fd >= r->nslots || !r->slots[fd].fn)
+    return -1;
+  struct epoll_event ev = {
+    .events = events,
+    .data.fd = fd,
+  };
+  return epoll_ctl(r->epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+int reactor_remove(struct reactor *r, int fd)
+{
+  if (fd < 0 || fd >= r->nslots || !r->slots[fd].fn)
+    return -1;
+  r->slots[fd].fn = NULL;
+  r->slots[fd].arg = NULL;
+  return epoll_ctl(r->epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+int reactor_post(struct reactor *r, reactor_task_func fn, void *arg)
+{
+  struct reactor_post_queue *q = &r->posted;
+  pthread_mutex_lock(&r->post_lock);
+  if (q->size == q->cap) {
+    int cap = q->cap ? q->cap * 2 : 64;
+    struct reactor_post_item *items = realloc(q->items, sizeof(*items) * (size_t)cap);
+    if (!items) {
+      pthread_mutex_unlock(&r->post_lock);
+      return -1;
+    }
+    q->items = items;
+    q->cap = cap;
+  }
+  q->items[q->size].fn = fn;
+  q->items[q->size].arg = arg;
+  q->size++;
+  pthread_mutex_unlock(&r->post_lock);
+  return reactor_wake(r);
+}
+
+static void reactor_run_posted(struct reactor *r)
+{
+  uint64_t n;
+  while (read(r->wakefd, &n, sizeof(n)) == -1 && errno == EINTR)
+    ;
+  __atomic_store_n(&r->wake_pending, 0, __ATOMIC_RELEASE);
+
+  // swap the queues so posters never wait for the tasks to run
+  pthread_mutex_lock(&r->post_lock);
+  struct reactor_post_queue tmp = r->running;
+  r->running = r->posted;
+  r->posted = tmp;
+  r->posted.size = 0;
+  pthread_mutex_unlock(&r->post_lock);
+
+  for (int i = 0; i < r->running.size; i++)
+    r->running.items[i].fn(r->running.items[i].arg);
+  r->running.size = 0;
+}
+
+uint64_t reactor_now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static void timer_swap(struct reactor *r, int i, int j)
+{
+  struct reactor_timer *t = r->timers[i];
+  r->timers[i] = r->timers[j];
+  r->timers[j] = t;
+  r->timers[i]->index = i;
+  r->timers[j]->index = j;
+}
+
+static void timer_sift_up(struct reactor *r, int i)
+{
+  while (i > 0) {
+    int parent = (i - 1) / 2;
+    if (r->timers[parent]->deadline <= r->timers[i]->deadline)
+      break;
+    timer_swap(r, i, parent);
+    i = parent;
+  }
+}
+
+static void timer_sift_down(struct reactor *r, int i)
+{
+  for (;;) {
+    int l = 2 * i + 1, m = i;
+    if (l < r->ntimers && r->timers[l]->deadline < r->timers[m]->deadline)
+      m = l;
+    if (l + 1 < r->ntimers && r->timers[l + 1]->deadline < r->timers[m]->deadline)
+      m = l + 1;
+    if (m == i)
+      break;
+    timer_swap(r, i, m);
+    i = m;
+  }
+}
+
+void reactor_timer_stop(struct reactor *r, struct reactor_timer *t)
+{
+  int i = t->index;
+  if (i < 0)
+    return;
+  t->index = -1;
+  if (i != --r->ntimers) {
+    r->timers[i] = r->timers[r->ntimers];
+    r->timers[i]->index = i;
+    timer_sift_down(r, i);
+    timer_sift_up(r, i);
+  }
+}
+
+int reactor_timer_start(struct reactor *r, struct reactor_timer *t, int timeout_ms,
+                        reactor_task_func fn, void *arg)
+{
+  reactor_timer_stop(r, t);
+  if (r->ntimers == r->timers_cap) {
+    int cap = r->timers_cap ? r->timers_cap * 2 : 64;
+    struct reactor_timer **timers = realloc(r->timers, sizeof(*timers) * (size_t)cap);
+    if (!timers)
+      return -1;
+    r->timers = timers;
+    r->timers_cap = cap;
+  }
+  t->deadline = reactor_now_ms() + (uint64_t)(timeout_ms > 0 ? timeout_ms : 0);
+  t->fn = fn;
+  t->arg = arg;
+  t->index = r->ntimers;
+  r->timers[r->ntimers++] = t;
+  timer_sift_up(r, t->index);
+  return 0;
+}
+
+// clamp the poll timeout to the nearest timer
+static int timer_timeout(struct reactor *r, int timeout_ms)
+{
+  if (r->ntimers == 0)
+    return timeout_ms;
+  uint64_t now = reactor_now_ms(), deadline = r->timers[0]->deadline;
+  int wait = deadline <= now ? 0 : (int)(deadline - now);
+  return (timeout_ms < 0 || wait < timeout_ms) ? wait : timeout_ms;
+}
+
+static void timer_expire(struct reactor *r)
+{
+  if (r->ntimers == 0)
+    return;
+  uint64_t now = reactor_now_ms();
+  while (r->ntimers > 0 && r->timers[0]->deadline <= now) {
+    struct reactor_timer *t = r->timers[0];
+    reactor_timer_stop(r, t);
+    t->fn(t->arg);
+  }
+}
+
+static uint64_t reactor_clock_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static inline void reactor_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  __asm__ __volatile__("yield");
+#endif
+}
+
+int reactor_set_spin(struct reactor *r, int min_us, int max_us)
+{
+  if (min_us < 0 || max_us < 0 || (max_us > 0 && min_us > max_us)) {
+    errno = EINVAL;
+    return -1;
+  }
+  r->spin_min_ns = (uint64_t)min_us * 1000;
+  r->spin_max_ns = (uint64_t)max_us * 1000;
+  r->spin_budget_ns = r->spin_max_ns;
+  // with a single cpu the thread that would wake us runs only if we yield
+  cpu_set_t cpus;
+  r->spin_yield = sched_getaffinity(0, sizeof(cpus), &cpus) == 0 && CPU_COUNT(&cpus) == 1;
+  return 0;
+}
+
+void reactor_get_spin_stats(const struct reactor *r, struct reactor_spin_stats *stats)
+{
+  *stats = r->spin;
+  stats->budget_us = (int)(r->spin_budget_ns / 1000);
+}
+
+int reactor_busy_poll(struct reactor *r, int usecs, int budget, int prefer)
+{
+  struct epoll_params params = {
+    .busy_poll_usecs = (uint32_t)usecs,
+    .busy_poll_budget = (uint16_t)budget,
+    .prefer_busy_poll = (uint8_t)(prefer != 0),
+  };
+  return ioctl(r->epfd, EPIOCSPARAMS, &params);
+}
+
+// gap: how long the loop was idle before the event, hit: found spinning
+static void spin_tune(struct reactor *r, uint64_t gap, bool hit)
+{
+  uint64_t b = r->spin_budget_ns;
+  if (hit) {
+    // decay toward twice the usual gap
+    b -= b >> 3;
+    if (b < 2 * gap)
+      b = 2 * gap;
+  } else if (gap < r->spin_max_ns) {
+    b = 2 * gap;  // spinning a little longer would have caught it
+  } else {
+    b >>= 1;
+  }
+  if (b < r->spin_min_ns)
+    b = r->spin_min_ns;
+  if (b > r->spin_max_ns)
+    b = r->spin_max_ns;
+  r->spin_budget_ns = b;
+}
+
+// poll without sleeping for budget ns. number of events, -1 error
+static int reactor_spin(struct reactor *r, uint64_t start, uint64_t budget)
+{
+  uint64_t now;
+  do {
+    int n = epoll_wait(r->epfd, r->events, r->max_events, 0);
+    if (n > 0 || (n == -1 && errno != EINTR))
+      return n;
+    if (r->spin_yield)
+      sched_yield();
+    else
+      reactor_cpu_relax();
+    now = reactor_clock_ns();
+  } while (now - start < budget);
+  return 0;
+}
+
+int reactor_run_once(struct reactor *r, int timeout_ms)
+{
+  int n, dispatched = 0;
+  bool posted = false;
+  uint64_t idle_from = 0;
+  timeout_ms = timer_timeout(r, timeout_ms);
+  if (r->spin_max_ns > 0 && timeout_ms != 0) {
+    // never spin past the nearest timer
+    uint64_t budget = r->spin_budget_ns;
+    if (timeout_ms > 0 && budget > (uint64_t)timeout_ms * 1000000)
+      budget = (uint64_t)timeout_ms * 1000000;
+    idle_from = reactor_clock_ns();
+    n = reactor_spin(r, idle_from, budget);
+    if (n == -1)
+      return -1;
+    uint64_t spun = reactor_clock_ns() - idle_from;
+    r->spin.spin_ns += spun;
+    if (n > 0) {
+      r->spin.hits++;
+      spin_tune(r, spun, true);
+      goto dispatch;
+    }
+    r->spin.parks++;
+    // the spin counts against the wait
+    if (timeout_ms > 0)
+      timeout_ms = spun / 1000000 >= (uint64_t)timeout_ms ? 0 : timeout_ms - (int)(spun / 1000000);
+  }
+retry:
+  n = epoll_wait(r->epfd, r->events, r->max_events, timeout_ms);
+  if (n == -1) {
+    if (errno == EINTR)
+      goto retry;
+    return -1;
+  }
+  if (idle_from && n > 0)
+    spin_tune(r, reactor_clock_ns() - idle_from, false);
+dispatch:
+  if (r->stamp_wakeups && n > 0) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    r->wake_ns = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+  }
+  for (int i = 0; i < n; i++) {
+    int fd = r->events[i].data.fd;
+    if (fd == r->wakefd) {
+      posted = true;
+      continue;
+    }
+    // the slot may have been removed by an earlier callback in this batch
+    if (fd < r->nslots && r->slots[fd].fn) {
+      r->slots[fd].fn(r, fd, r->events[i].events, r->slots[fd].arg);
+      dispatched++;
+    }
+  }
+  if (posted)
+    reactor_run_posted(r);
+  timer_expire(r);
+  return dispatched;
+}
+
+void reactor_stamp_wakeups(struct reactor *r, int on)
+{
+  r->stamp_wakeups = on;
+  r->wake_ns = 0;
+}
+
+uint64_t reactor_wake_ns(const struct reactor *r)
+{
+  return r->wake_ns;
+}
+
+int reactor_run(struct reactor *r)
+{
+  while (!__atomic_load_n(&r->stopped, __ATOMIC_ACQUIRE)) {
+    if (reactor_run_once(r, -1) == -1)
+      return -1;
+  }
+  __atomic_store_n(&r->stopped, 0, __ATOMIC_RELEASE);
+  return 0;
+}
+
+static void reactor_stop_task(void *arg)
+{
+  struct reactor *r = arg;
+  __atomic_store_n(&r->stopped, 1, __ATOMIC_RELEASE);
+}
+
+void reactor_stop(struct reactor *r)
+{
+  reactor_post(r, reactor_stop_task, r);
+}
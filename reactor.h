@@ -0,0 +1,92 @@
+#ifndef XNET_REACTOR_H_
+#define XNET_REACTOR_H_
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A single-threaded epoll event loop. Every fd registered on a reactor is
+// owned by the thread that runs it; other threads talk to it only through
+// reactor_post().
+struct reactor;
+
+// events is a mask of EPOLLIN/EPOLLOUT/EPOLLERR/EPOLLHUP...
+typedef void (*reactor_io_func)(struct reactor *r, int fd, uint32_t events, void *arg);
+typedef void (*reactor_task_func)(void *arg);
+
+// max_events <= 0 uses the default batch size
+struct reactor *reactor_create(int max_events);
+void reactor_destroy(struct reactor *r);
+
+// 0 : success, -1 fail
+int reactor_add(struct reactor *r, int fd, uint32_t events, reactor_io_func fn, void *arg);
+int reactor_modify(struct reactor *r, int fd, uint32_t events);
+int reactor_remove(struct reactor *r, int fd);
+
+// thread-safe: run fn(arg) on the reactor thread during the next iteration
+int reactor_post(struct reactor *r, reactor_task_func fn, void *arg);
+
+// one-shot timer, intrusive: the owner keeps it alive while it is armed.
+// fn runs on the reactor thread.
+struct reactor_timer {
+  uint64_t deadline;  // monotonic ms
+  reactor_task_func fn;
+  void *arg;
+  int index;          // heap slot, -1 when not armed
+};
+
+static inline void reactor_timer_init(struct reactor_timer *t)
+{
+  t->index = -1;
+}
+static inline int reactor_timer_armed(const struct reactor_timer *t)
+{
+  return t->index >= 0;
+}
+// re-arms t if it is already armed. 0 : success, -1 fail
+int reactor_timer_start(struct reactor *r, struct reactor_timer *t, int timeout_ms,
+                        reactor_task_func fn, void *arg);
+void reactor_timer_stop(struct reactor *r, struct reactor_timer *t);
+uint64_t reactor_now_ms(void);
+
+// wait at most timeout_ms (-1 forever), dispatch ready fds and posted tasks.
+// return number of io events dispatched, -1 error
+int reactor_run_once(struct reactor *r, int timeout_ms);
+// note the CLOCK_REALTIME time every epoll_wait returns, for the latency
+// breakdown of tstamp.h. off by default
+void reactor_stamp_wakeups(struct reactor *r, int on);
+// when the batch being dispatched was polled, ns. 0 if not stamping
+uint64_t reactor_wake_ns(const struct reactor *r);
+// Spin-then-block. Before it parks in epoll_wait, the reactor polls with
+// epoll_wait(0) for a budget that tunes itself between min_us and max_us.
+// An event caught while spinning keeps the budget near twice the gap it
+// waited. An event that came shortly after parking grows the budget to
+// cover that gap, and idle periods longer than max_us halve it. A park
+// and wakeup costs a few us of latency, spinning costs a core. Confined
+// to a single cpu, it yields between polls instead. It never spins past
+// the nearest timer. max_us 0 turns it off (the default). 0 : success, -1 invalid
+int reactor_set_spin(struct reactor *r, int min_us, int max_us);
+struct reactor_spin_stats {
+  uint64_t hits;     // events found while spinning
+  uint64_t parks;    // the budget ran out, blocked in epoll_wait
+  uint64_t spin_ns;  // time spent spinning
+  int budget_us;     // current budget
+};
+void reactor_get_spin_stats(const struct reactor *r, struct reactor_spin_stats *stats);
+// kernel busy polling of the NAPI context of the reactor's sockets while
+// it waits (EPIOCSPARAMS, Linux 6.9). Only useful if all of them come from
+// one rx queue, group them by SO_INCOMING_NAPI_ID (NapiGroup()).
+// 0 : success, -1 fail
+int reactor_busy_poll(struct reactor *r, int usecs, int budget, int prefer);
+// loop until reactor_stop()
+int reactor_run(struct reactor *r);
+// thread-safe
+void reactor_stop(struct reactor *r);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,481 @@
+#include "rpc.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "packet.h"
+
+#define RPC_TABLE_MIN 64
+#define RPC_READ_SIZE 4096
+#define RPC_BUFFER_BASELINE (64 << 10)
+#define RPC_TRIM_MS 1000
+
+// open addressing, linear probing. Ids are handed out sequentially, so
+// "id & mask" spreads the requests in flight without collisions until the
+// window of outstanding ids outgrows the table.
+struct rpc_slot {
+  uint32_t id;  // 0: empty
+  struct rpc_call *call;
+};
+
+struct rpc_conn {
+  struct rpc_client *c;
+  int fd;              // -1: not connected
+  int connecting;
+  int out_armed;       // EPOLLOUT is registered
+  int failing;         // failing the calls in flight, do not reuse
+  uint32_t next_id;
+  int npending;
+  unsigned mask;
+  struct rpc_slot *slots;
+  struct zbytes rbuf;
+  struct zbytes wbuf;
+  struct reactor_timer flush_timer;
+  struct reactor_timer trim_timer;
+};
+
+struct rpc_client {
+  struct reactor *r;
+  struct Endpoint ep;
+  int nconns;
+  int max_frame;
+  struct rpc_conn *conns;
+  struct rpc_client_stats stats;
+};
+
+int rpc_frame(const struct zbytes *zb)
+{
+  uint32_t len;
+  if (zb_available(zb) < RPC_HEADER_SIZE)
+    return 0;
+  memcpy(&len, zb_data(zb), sizeof(len));
+  len = ntohl(len);
+  if (len > (uint32_t)(INT32_MAX - RPC_HEADER_SIZE))
+    return -1;
+  if ((uint32_t)zb_available(zb) < RPC_HEADER_SIZE + len)
+    return 0;
+  return (int)(RPC_HEADER_SIZE + len);
+}
+
+int rpc_append_frame(struct zbytes *zb, uint32_t id, const void *data, int len)
+{
+  if (zb_reserve(zb, (size_t)(RPC_HEADER_SIZE + len)) != 0)
+    return -1;
+  zb_append_uint32(zb, htonl((uint32_t)len));
+  zb_append_uint32(zb, htonl(id));
+  zb_append(zb, data, (size_t)len);
+  return 0;
+}
+
+//// pending table
+static struct rpc_slot *table_find(const struct rpc_conn *cn, uint32_t id)
+{
+  for (unsigned i = id & cn->mask; ; i = (i + 1) & cn->mask) {
+    if (cn->slots[i].id == id)
+      return &cn->slots[i];
+    if (cn->slots[i].id == 0)
+      return NULL;
+  }
+}
+
+static void table_insert(struct rpc_conn *cn, struct rpc_call *call)
+{
+  unsigned i = call->id & cn->mask;
+  while (cn->slots[i].id != 0)
+    i = (i + 1) & cn->mask;
+  cn->slots[i].id = call->id;
+  cn->slots[i].call = call;
+  cn->npending++;
+}
+
+// backward shift deletion, no tombstones
+static void table_erase(struct rpc_conn *cn, struct rpc_slot *slot)
+{
+  unsigned mask = cn->mask;
+  unsigned i = (unsigned)(slot - cn->slots);
+  for (unsigned j = (i + 1) & mask; cn->slots[j].id != 0; j = (j + 1) & mask) {
+    unsigned home = cn->slots[j].id & mask;
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      cn->slots[i] = cn->slots[j];
+      i = j;
+    }
+  }
+  cn->slots[i].id = 0;
+  cn->slots[i].call = NULL;
+  cn->npending--;
+}
+
+static int table_grow(struct rpc_conn *cn)
+{
+  unsigned cap = cn->slots ? (cn->mask + 1) * 2 : RPC_TABLE_MIN;
+  struct rpc_slot *old = cn->slots;
+  unsigned old_cap = old ? cn->mask + 1 : 0;
+  struct rpc_slot *slots = calloc(cap, sizeof(*slots));
+  if (!slots)
+    return -1;
+  cn->slots = slots;
+  cn->mask = cap - 1;
+  cn->npending = 0;
+  for (unsigned i = 0; i < old_cap; i++) {
+    if (old[i].id != 0)
+      table_insert(cn, old[i].call);
+  }
+  free(old);
+  return 0;
+}
+
+static uint32_t conn_next_id(struct rpc_conn *cn)
+{
+  uint32_t id;
+  do {
+    id = ++cn->next_id;
+  } while (id == 0 || table_find(cn, id) != NULL);
+  return id;
+}
+
+//// connection
+static void conn_fail(struct rpc_conn *cn, int err);
+
+// Buffers a burst grew are given back from a timer, not after every burst:
+// a stream of large frames keeps its room instead of paying a realloc per
+// read or send. A buffer holding a partial frame is left alone.
+static void conn_on_trim(void *arg)
+{
+  struct rpc_conn *cn = arg;
+  if (zb_empty(&cn->rbuf))
+    zb_shrink(&cn->rbuf, RPC_BUFFER_BASELINE);
+  if (zb_empty(&cn->wbuf))
+    zb_shrink(&cn->wbuf, RPC_BUFFER_BASELINE);
+  if (cn->rbuf.cap > RPC_BUFFER_BASELINE || cn->wbuf.cap > RPC_BUFFER_BASELINE)
+    reactor_timer_start(cn->c->r, &cn->trim_timer, RPC_TRIM_MS, conn_on_trim, cn);
+}
+
+static void conn_trim_later(struct rpc_conn *cn)
+{
+  if ((cn->rbuf.cap > RPC_BUFFER_BASELINE || cn->wbuf.cap > RPC_BUFFER_BASELINE) &&
+      !reactor_timer_armed(&cn->trim_timer))
+    reactor_timer_start(cn->c->r, &cn->trim_timer, RPC_TRIM_MS, conn_on_trim, cn);
+}
+
+static int conn_set_events(struct rpc_conn *cn, int out)
+{
+  if (cn->out_armed == out)
+    return 0;
+  if (reactor_modify(cn->c->r, cn->fd, EPOLLIN | (out ? EPOLLOUT : 0)) != 0)
+    return -1;
+  cn->out_armed = out;
+  return 0;
+}
+
+// 0 : written or waiting for EPOLLOUT, -1 fail
+static int conn_flush(struct rpc_conn *cn)
+{
+  struct zbytes *zb = &cn->wbuf;
+  while (!zb_empty(zb)) {
+    ssize_t n = send(cn->fd, zb_data(zb), (size_t)zb_available(zb), MSG_NOSIGNAL);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        zb_move(zb);
+        return conn_set_events(cn, 1);
+      }
+      return -1;
+    }
+    cn->c->stats.writes++;
+    zb_skip(zb, (int)n);
+  }
+  zb_zero(zb);
+  conn_trim_later(cn);
+  return conn_set_events(cn, 0);
+}
+
+static void conn_flush_task(void *arg)
+{
+  struct rpc_conn *cn = arg;
+  if (cn->fd != -1 && !cn->connecting && conn_flush(cn) != 0)
+    conn_fail(cn, errno);
+}
+
+static void conn_complete(struct rpc_conn *cn, uint32_t id, const char *data, int len)
+{
+  struct rpc_slot *slot = table_find(cn, id);
+  if (!slot) {
+    cn->c->stats.late++;
+    return;
+  }
+  struct rpc_call *call = slot->call;
+  table_erase(cn, slot);
+  reactor_timer_stop(cn->c->r, &call->timer);
+  call->conn = NULL;
+  cn->c->stats.completed++;
+  call->done(call, 0, data, len);
+}
+
+// 0 : success, -1 malformed stream
+static int conn_parse(struct rpc_conn *cn)
+{
+  struct zbytes *zb = &cn->rbuf;
+  while (zb_available(zb) >= RPC_HEADER_SIZE) {
+    uint32_t len = ntohl(zb_read_uint32(zb));
+    if (len > (uint32_t)cn->c->max_frame)
+      return -1;
+    if ((uint32_t)zb_available(zb) < RPC_HEADER_SIZE - 4 + len) {
+      zb_skip(zb, -4);
+      // make room for the rest of a large frame
+      if (zb->cap - zb->pos < (int)(RPC_HEADER_SIZE + len)) {
+        zb_move(zb);
+        if (zb_reserve(zb, RPC_HEADER_SIZE + len - (size_t)zb_available(zb)) != 0)
+          return -1;
+      }
+      break;
+    }
+    uint32_t id = ntohl(zb_read_uint32(zb));
+    const char *data = zb_data(zb);
+    zb_skip(zb, (int)len);
+    conn_complete(cn, id, data, (int)len);
+  }
+  zb_move(zb);
+  conn_trim_later(cn);
+  return 0;
+}
+
+static void conn_read(struct rpc_conn *cn)
+{
+  int n;
+  if (zb_free_size(&cn->rbuf) < RPC_READ_SIZE && zb_reserve(&cn->rbuf, RPC_READ_SIZE) != 0) {
+    conn_fail(cn, ENOMEM);
+    return;
+  }
+  n = zb_appendSocket(cn->fd, &cn->rbuf);
+  if (n == 0) {
+    conn_fail(cn, ECONNRESET);
+  } else if (n == -1) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+      conn_fail(cn, errno);
+  } else if (conn_parse(cn) != 0) {
+    conn_fail(cn, EPROTO);
+  }
+}
+
+static void conn_on_io(struct reactor *r, int fd, uint32_t events, void *arg)
+{
+  struct rpc_conn *cn = arg;
+  (void)r;
+  if (cn->connecting) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+      return;
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+      err = errno;
+    if (err != 0) {
+      conn_fail(cn, err);
+      return;
+    }
+    cn->connecting = 0;
+    if (conn_flush(cn) != 0) {
+      conn_fail(cn, errno);
+      return;
+    }
+  } else if ((events & EPOLLOUT) && conn_flush(cn) != 0) {
+    conn_fail(cn, errno);
+    return;
+  }
+  if (events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+    conn_read(cn);
+}
+
+// requests are batched by rpc, Nagle would only add latency
+static int conn_pre_call(int sockfd, const struct BuildNetParams *params)
+{
+  int on = 1;
+  (void)params;
+  setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  return 0;
+}
+
+static int conn_open(struct rpc_conn *cn)
+{
+  struct BuildNetParams params = {
+    .flags = XNET_F_NONBLOCK,
+    .pre_call = conn_pre_call,
+  };
+  int fd = DialEndpoint(&cn->c->ep, NULL, &params);
+  if (fd == -1)
+    return -1;
+  if (reactor_add(cn->c->r, fd, EPOLLIN | EPOLLOUT, conn_on_io, cn) != 0) {
+    close(fd);
+    return -1;
+  }
+  cn->fd = fd;
+  cn->connecting = 1;
+  cn->out_armed = 1;
+  return 0;
+}
+
+static void conn_fail(struct rpc_conn *cn, int err)
+{
+  struct rpc_client *c = cn->c;
+  reactor_remove(c->r, cn->fd);
+  close(cn->fd);
+  cn->fd = -1;
+  cn->connecting = 0;
+  cn->out_armed = 0;
+  reactor_timer_stop(c->r, &cn->flush_timer);
+  zb_zero(&cn->rbuf);
+  zb_zero(&cn->wbuf);
+
+  // a callback may cancel other calls and shift the table under the scan,
+  // rescan until it is empty
+  cn->failing = 1;
+  while (cn->npending > 0) {
+    for (unsigned i = 0; i <= cn->mask; i++) {
+      while (cn->slots[i].id != 0) {
+        struct rpc_call *call = cn->slots[i].call;
+        table_erase(cn, &cn->slots[i]);
+        reactor_timer_stop(c->r, &call->timer);
+        call->conn = NULL;
+        c->stats.failed++;
+        call->done(call, err, NULL, 0);
+      }
+    }
+  }
+  cn->failing = 0;
+}
+
+// the least loaded connection, dial another one while all are busy
+static struct rpc_conn *rpc_pick(struct rpc_client *c)
+{
+  struct rpc_conn *best = NULL, *idle = NULL;
+  for (int i = 0; i < c->nconns; i++) {
+    struct rpc_conn *cn = &c->conns[i];
+    if (cn->failing)
+      continue;
+    if (cn->fd == -1) {
+      if (!idle)
+        idle = cn;
+    } else if (!best || cn->npending < best->npending) {
+      best = cn;
+    }
+  }
+  if (idle && (!best || best->npending > 0) && conn_open(idle) == 0)
+    return idle;
+  if (!best && !idle)
+    errno = ENOTCONN;
+  return best;
+}
+
+static void on_call_timeout(void *arg)
+{
+  struct rpc_call *call = arg;
+  struct rpc_conn *cn = call->conn;
+  struct rpc_slot *slot = table_find(cn, call->id);
+  if (slot)
+    table_erase(cn, slot);
+  call->conn = NULL;
+  cn->c->stats.timeouts++;
+  call->done(call, ETIMEDOUT, NULL, 0);
+}
+
+int rpc_call(struct rpc_client *c, struct rpc_call *call, const void *req, int len,
+             int timeout_ms, rpc_done_func done, void *arg)
+{
+  struct rpc_conn *cn;
+  if (len < 0 || len > c->max_frame) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+  cn = rpc_pick(c);
+  if (!cn)
+    return -1;
+  if ((unsigned)cn->npending * 2 >= cn->mask + 1 && table_grow(cn) != 0)
+    return -1;
+  call->id = conn_next_id(cn);
+  if (rpc_append_frame(&cn->wbuf, call->id, req, len) != 0)
+    return -1;
+  call->conn = cn;
+  call->done = done;
+  call->arg = arg;
+  reactor_timer_init(&call->timer);
+  if (timeout_ms > 0)
+    reactor_timer_start(c->r, &call->timer, timeout_ms, on_call_timeout, call);
+  table_insert(cn, call);
+  c->stats.calls++;
+  // the flush runs after this iteration's callbacks, every request they
+  // issue on this connection goes out in the same send()
+  if (!cn->connecting && !reactor_timer_armed(&cn->flush_timer))
+    reactor_timer_start(c->r, &cn->flush_timer, 0, conn_flush_task, cn);
+  return 0;
+}
+
+void rpc_cancel(struct rpc_call *call)
+{
+  struct rpc_conn *cn = call->conn;
+  if (!cn)
+    return;
+  struct rpc_slot *slot = table_find(cn, call->id);
+  if (slot && slot->call == call)
+    table_erase(cn, slot);
+  reactor_timer_stop(cn->c->r, &call->timer);
+  call->conn = NULL;
+  // the request may be on the wire already, its response is dropped as late
+}
+
+struct rpc_client *rpc_client_create(struct reactor *r, const struct Endpoint *ep,
+                                     int nconns, int max_frame)
+{
+  struct rpc_client *c = calloc(1, sizeof(*c));
+  if (!c)
+    return NULL;
+  c->r = r;
+  c->nconns = nconns > 0 ? nconns : 1;
+  c->max_frame = max_frame > 0 ? max_frame : RPC_DEFAULT_MAX_FRAME;
+  c->ep.addrs = malloc(sizeof(*ep->addrs) * (size_t)(ep->count > 0 ? ep->count : 1));
+  c->conns = calloc((size_t)c->nconns, sizeof(*c->conns));
+  if (!c->ep.addrs || !c->conns)
+    goto fail;
+  memcpy(c->ep.addrs, ep->addrs, sizeof(*ep->addrs) * (size_t)ep->count);
+  c->ep.count = ep->count;
+  for (int i = 0; i < c->nconns; i++) {
+    struct rpc_conn *cn = &c->conns[i];
+    cn->c = c;
+    cn->fd = -1;
+    reactor_timer_init(&cn->flush_timer);
+    reactor_timer_init(&cn->trim_timer);
+    if (table_grow(cn) != 0 ||
+        zb_init(&cn->rbuf, RPC_BUFFER_BASELINE) == NULL ||
+        zb_init(&cn->wbuf, RPC_BUFFER_BASELINE) == NULL)
+      goto fail;
+  }
+  return c;
+
+fail:
+  rpc_client_destroy(c);
+  return NULL;
+}
+
+void rpc_client_destroy(struct rpc_client *c)
+{
+  for (int i = 0; c->conns && i < c->nconns; i++) {
+    struct rpc_conn *cn = &c->conns[i];
+    if (cn->fd != -1)
+      conn_fail(cn, ECANCELED);
+    reactor_timer_stop(c->r, &cn->trim_timer);
+    zb_destroy(&cn->rbuf);
+    zb_destroy(&cn->wbuf);
+    free(cn->slots);
+  }
+  free(c->conns);
+  EndpointFree(&c->ep);
+  free(c);
+}
+
+void rpc_client_get_stats(const struct rpc_client *c, struct rpc_client_stats *stats)
+{
+  *stats = c->stats;
+}
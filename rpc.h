@@ -0,0 +1,80 @@
+#ifndef XNET_RPC_H_
+#define XNET_RPC_H_
+
+#include <stdint.h>
+#include "base_net.h"
+#include "reactor.h"
+#include "zbytes.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Multiplexed request/response client.
+//
+// Any number of requests share a few connections. Every frame carries the
+// id of its request, so responses may come back in any order:
+//
+//   uint32 length | uint32 id | length bytes of payload   (big endian)
+//
+// Requests issued during one reactor iteration are queued in the output
+// buffer of their connection and written with a single send(). Every
+// request has its own deadline. A connection that fails fails the requests
+// in flight on it and is dialed again by the next call that needs it.
+// All functions except rpc_frame/rpc_append_frame run on the reactor thread.
+
+#define RPC_HEADER_SIZE 8
+#define RPC_DEFAULT_MAX_FRAME (16 << 20)
+
+// frame function for zb_dispatch_packets(), e.g. on the server side
+int rpc_frame(const struct zbytes *zb);
+// append one frame to zb, growing it as needed. 0 : success, -1 fail
+int rpc_append_frame(struct zbytes *zb, uint32_t id, const void *data, int len);
+
+struct rpc_call;
+struct rpc_conn;
+struct rpc_client;
+
+// err is 0 or an errno value (ETIMEDOUT, ECONNRESET, ECANCELED...).
+// data is only valid during the callback.
+typedef void (*rpc_done_func)(struct rpc_call *call, int err, const char *data, int len);
+
+// intrusive, the caller keeps it alive until done runs or rpc_cancel()
+struct rpc_call {
+  uint32_t id;
+  struct rpc_conn *conn;
+  rpc_done_func done;
+  void *arg;
+  struct reactor_timer timer;
+};
+
+struct rpc_client_stats {
+  uint64_t calls;
+  uint64_t completed;
+  uint64_t timeouts;
+  uint64_t failed;  // connection errors
+  uint64_t late;    // responses after their deadline or cancellation
+  uint64_t writes;  // send() calls, compare with calls for the batching
+};
+
+// the endpoint is copied. nconns <= 0 uses 1, max_frame <= 0 uses the default.
+// connections are dialed lazily. NULL on failure
+struct rpc_client *rpc_client_create(struct reactor *r, const struct Endpoint *ep,
+                                     int nconns, int max_frame);
+// fails everything in flight with ECANCELED. Not from inside a done callback.
+void rpc_client_destroy(struct rpc_client *c);
+
+// send len bytes of req, done runs exactly once unless the call is cancelled.
+// timeout_ms <= 0: no deadline.
+// 0 : queued, -1 fail (no connection could be dialed, frame too large)
+int rpc_call(struct rpc_client *c, struct rpc_call *call, const void *req, int len,
+             int timeout_ms, rpc_done_func done, void *arg);
+// forget a call in flight, done will not run
+void rpc_cancel(struct rpc_call *call);
+
+void rpc_client_get_stats(const struct rpc_client *c, struct rpc_client_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
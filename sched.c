@@ -0,0 +1,424 @@
+#include "sched.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SCHED_CACHELINE 64
+#define SCHED_DEQUE_INIT 256
+#define SCHED_PARK_MS 10
+
+// Chase-Lev deque storage, see "Correct and Efficient Work-Stealing for
+// Weak Memory Models" (Le et al., PPoPP'13). Arrays only grow; the old
+// ones are kept on the prev chain until the scheduler is destroyed because
+// a thief may still be reading them.
+struct cl_array {
+  struct cl_array *prev;
+  int64_t mask;
+  struct sched_task *buf[];
+};
+
+struct sched_worker {
+  int64_t top __attribute__((aligned(SCHED_CACHELINE)));
+  int64_t bottom __attribute__((aligned(SCHED_CACHELINE)));
+  struct cl_array *array;
+
+  pthread_mutex_t inbox_lock __attribute__((aligned(SCHED_CACHELINE)));
+  struct sched_task *inbox_head;
+  struct sched_task *inbox_tail;
+  int inbox_len;
+
+  struct sched *s;
+  pthread_t thread;
+  int id;
+  uint64_t rng;
+  uint64_t executed;
+  uint64_t stolen;
+};
+
+struct sched {
+  struct sched_worker *workers;
+  int nworkers;
+  int flags;
+
+  pthread_mutex_t park_lock;
+  pthread_cond_t park_cond;
+  int nparked;
+  int stopping;
+};
+
+static __thread struct sched_worker *tls_worker;
+
+static struct cl_array *cl_array_new(int64_t size)
+{
+  struct cl_array *a = malloc(sizeof(*a) + sizeof(struct sched_task *) * (size_t)size);
+  if (!a)
+    return NULL;
+  a->prev = NULL;
+  a->mask = size - 1;
+  return a;
+}
+
+static struct cl_array *cl_grow(struct sched_worker *w, struct cl_array *a, int64_t t, int64_t b)
+{
+  struct cl_array *na = cl_array_new((a->mask + 1) * 2);
+  if (!na)
+    return NULL;
+  for (int64_t i = t; i < b; i++)
+    na->buf[i & na->mask] = __atomic_load_n(&a->buf[i & a->mask], __ATOMIC_RELAXED);
+  na->prev = a;
+  __atomic_store_n(&w->array, na, __ATOMIC_RELEASE);
+  return na;
+}
+
+// owner only
+static int cl_push(struct sched_worker *w, struct sched_task *task)
+{
+  int64_t b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED);
+  int64_t t = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+  struct cl_array *a = __atomic_load_n(&w->array, __ATOMIC_RELAXED);
+  if (b - t > a->mask) {
+    a = cl_grow(w, a, t, b);
+    if (!a)
+      return -1;
+  }
+  __atomic_store_n(&a->buf[b & a->mask], task, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+// owner only, LIFO end
+static struct sched_task *cl_take(struct sched_worker *w)
+{
+  int64_t b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED) - 1;
+  struct cl_array *a = __atomic_load_n(&w->array, __ATOMIC_RELAXED);
+  __atomic_store_n(&w->bottom, b, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  int64_t t = __atomic_load_n(&w->top, __ATOMIC_RELAXED);
+  struct sched_task *task = NULL;
+  if (t <= b) {
+    task = __atomic_load_n(&a->buf[b & a->mask], __ATOMIC_RELAXED);
+    if (t == b) {
+      // last element, race against thieves
+      if (!__atomic_compare_exchange_n(&w->top, &t, t + 1, false,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        task = NULL;
+      __atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+  } else {
+    __atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+  }
+  return task;
+}
+
+// any thread, FIFO end
+static struct sched_task *cl_steal(struct sched_worker *w)
+{
+  int64_t t = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  int64_t b = __atomic_load_n(&w->bottom, __ATOMIC_ACQUIRE);
+  if (t >= b)
+    return NULL;
+  struct cl_array *a = __atomic_load_n(&w->array, __ATOMIC_ACQUIRE);
+  struct sched_task *task = __atomic_load_n(&a->buf[t & a->mask], __ATOMIC_RELAXED);
+  if (!__atomic_compare_exchange_n(&w->top, &t, t + 1, false,
+                                   __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+    return NULL;
+  return task;
+}
+
+static bool cl_empty(struct sched_worker *w)
+{
+  int64_t t = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+  int64_t b = __atomic_load_n(&w->bottom, __ATOMIC_ACQUIRE);
+  return t >= b;
+}
+
+static void inbox_push(struct sched_worker *w, struct sched_task *task)
+{
+  task->next = NULL;
+  pthread_mutex_lock(&w->inbox_lock);
+  if (w->inbox_tail)
+    w->inbox_tail->next = task;
+  else
+    w->inbox_head = task;
+  w->inbox_tail = task;
+  __atomic_store_n(&w->inbox_len, w->inbox_len + 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&w->inbox_lock);
+}
+
+static struct sched_task *inbox_pop(struct sched_worker *w)
+{
+  struct sched_task *head;
+  if (__atomic_load_n(&w->inbox_len, __ATOMIC_ACQUIRE) == 0)
+    return NULL;
+  pthread_mutex_lock(&w->inbox_lock);
+  head = w->inbox_head;
+  if (head) {
+    if (head->next == NULL) {
+      w->inbox_head = w->inbox_tail = NULL;
+      __atomic_store_n(&w->inbox_len, 0, __ATOMIC_RELEASE);
+    } else {
+      w->inbox_head = head->next;
+      head->next = NULL;
+      __atomic_store_n(&w->inbox_len, w->inbox_len - 1, __ATOMIC_RELEASE);
+    }
+  }
+  pthread_mutex_unlock(&w->inbox_lock);
+  return head;
+}
+
+static uint64_t sched_rand(struct sched_worker *w)
+{
+  uint64_t x = w->rng;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  w->rng = x;
+  return x * 0x2545F4914F6CDD1DULL;
+}
+
+static void sched_wake(struct sched *s)
+{
+  // pairs with the increment of nparked in sched_park()
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&s->nparked, __ATOMIC_RELAXED) == 0)
+    return;
+  pthread_mutex_lock(&s->park_lock);
+  // without stealing only the affinity worker can run the task
+  if (s->flags & SCHED_F_NOSTEAL)
+    pthread_cond_broadcast(&s->park_cond);
+  else
+    pthread_cond_signal(&s->park_cond);
+  pthread_mutex_unlock(&s->park_lock);
+}
+
+int sched_submit(struct sched *s, struct sched_task *task)
+{
+  struct sched_worker *w = tls_worker;
+  if (w && w->s == s) {
+    if (cl_push(w, task) != 0)
+      return -1;
+  } else {
+    inbox_push(&s->workers[task->affinity % (unsigned)s->nworkers], task);
+  }
+  sched_wake(s);
+  return 0;
+}
+
+static struct sched_task *sched_steal(struct sched_worker *w)
+{
+  struct sched *s = w->s;
+  int n = s->nworkers;
+  if (n < 2)
+    return NULL;
+  int start = (int)(sched_rand(w) % (uint64_t)n);
+  for (int i = 0; i < n; i++) {
+    struct sched_worker *v = &s->workers[(start + i) % n];
+    if (v == w)
+      continue;
+    struct sched_task *task = cl_steal(v);
+    if (!task)
+      task = inbox_pop(v);
+    if (task) {
+      __atomic_store_n(&w->stolen, w->stolen + 1, __ATOMIC_RELAXED);
+      return task;
+    }
+  }
+  return NULL;
+}
+
+static bool sched_has_work(struct sched_worker *w)
+{
+  struct sched *s = w->s;
+  if (!cl_empty(w) || __atomic_load_n(&w->inbox_len, __ATOMIC_ACQUIRE))
+    return true;
+  if (s->flags & SCHED_F_NOSTEAL)
+    return false;
+  for (int i = 0; i < s->nworkers; i++) {
+    struct sched_worker *v = &s->workers[i];
+    if (!cl_empty(v) || __atomic_load_n(&v->inbox_len, __ATOMIC_ACQUIRE))
+      return true;
+  }
+  return false;
+}
+
+// return false if the scheduler is stopping and there is nothing left
+static bool sched_park(struct sched_worker *w)
+{
+  struct sched *s = w->s;
+  bool alive = true;
+  pthread_mutex_lock(&s->park_lock);
+  __atomic_add_fetch(&s->nparked, 1, __ATOMIC_SEQ_CST);
+  if (!sched_has_work(w)) {
+    if (s->stopping) {
+      alive = false;
+    } else {
+      // the timeout is a safety net only, wakeups are not expected to be lost
+      struct timespec ts;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_nsec += SCHED_PARK_MS * 1000000L;
+      if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+      }
+      pthread_cond_timedwait(&s->park_cond, &s->park_lock, &ts);
+    }
+  }
+  __atomic_sub_fetch(&s->nparked, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&s->park_lock);
+  return alive;
+}
+
+static void *sched_worker_main(void *arg)
+{
+  struct sched_worker *w = arg;
+  bool steal = !(w->s->flags & SCHED_F_NOSTEAL);
+  tls_worker = w;
+  for (;;) {
+    struct sched_task *task = cl_take(w);
+    // external tasks stay FIFO in the inbox, the deque is LIFO for the owner
+    if (!task)
+      task = inbox_pop(w);
+    if (!task && steal)
+      task = sched_steal(w);
+    if (task) {
+      task->func(task);
+      __atomic_store_n(&w->executed, w->executed + 1, __ATOMIC_RELAXED);
+      continue;
+    }
+    if (!sched_park(w))
+      break;
+  }
+  tls_worker = NULL;
+  return NULL;
+}
+
+struct sched *sched_create(int nworkers, int flags)
+{
+  if (nworkers <= 0) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    nworkers = n > 0 ? (int)n : 1;
+  }
+  struct sched *s = calloc(1, sizeof(*s));
+  if (!s)
+    return NULL;
+  s->flags = flags;
+  if (posix_memalign((void **)&s->workers, SCHED_CACHELINE,
+                     sizeof(struct sched_worker) * (size_t)nworkers) != 0) {
+    free(s);
+    return NULL;
+  }
+  memset(s->workers, 0, sizeof(struct sched_worker) * (size_t)nworkers);
+  pthread_mutex_init(&s->park_lock, NULL);
+  pthread_cond_init(&s->park_cond, NULL);
+
+  uint64_t seed = (uint64_t)time(NULL) ^ (uint64_t)(uintptr_t)s;
+  for (int i = 0; i < nworkers; i++) {
+    struct sched_worker *w = &s->workers[i];
+    w->s = s;
+    w->id = i;
+    w->rng = (seed + 0x9E3779B97F4A7C15ULL * (uint64_t)(i + 1)) | 1;
+    pthread_mutex_init(&w->inbox_lock, NULL);
+    w->array = cl_array_new(SCHED_DEQUE_INIT);
+    if (!w->array)
+      goto fail;
+    s->nworkers = i + 1;
+  }
+  for (int i = 0; i < nworkers; i++) {
+    if (pthread_create(&s->workers[i].thread, NULL, sched_worker_main, &s->workers[i]) != 0) {
+      // join what has been started, sched_destroy() would join them all
+      pthread_mutex_lock(&s->park_lock);
+      s->stopping = 1;
+      pthread_cond_broadcast(&s->park_cond);
+      pthread_mutex_unlock(&s->park_lock);
+      for (int j = 0; j < i; j++)
+        pthread_join(s->workers[j].thread, NULL);
+      goto fail;
+    }
+  }
+  return s;
+
+fail:
+  for (int i = 0; i < s->nworkers; i++) {
+    free(s->workers[i].array);
+    pthread_mutex_destroy(&s->workers[i].inbox_lock);
+  }
+  pthread_cond_destroy(&s->park_cond);
+  pthread_mutex_destroy(&s->park_lock);
+  free(s->workers);
+  free(s);
+  return NULL;
+}
+
+void sched_destroy(struct sched *s)
+{
+  if (!s)
+    return;
+  pthread_mutex_lock(&s->park_lock);
+  s->stopping = 1;
+  pthread_cond_broadcast(&s->park_cond);
+  pthread_mutex_unlock(&s->park_lock);
+  for (int i = 0; i < s->nworkers; i++)
+    pthread_join(s->workers[i].thread, NULL);
+  for (int i = 0; i < s->nworkers; i++) {
+    struct cl_array *a = s->workers[i].array;
+    while (a) {
+      struct cl_array *prev = a->prev;
+      free(a);
+      a = prev;
+    }
+    pthread_mutex_destroy(&s->workers[i].inbox_lock);
+  }
+  pthread_cond_destroy(&s->park_cond);
+  pthread_mutex_destroy(&s->park_lock);
+  free(s->workers);
+  free(s);
+}
+
+int sched_nworkers(const struct sched *s)
+{
+  return s->nworkers;
+}
+
+int sched_current_worker(void)
+{
+  return tls_worker ? tls_worker->id : -1;
+}
+
+void sched_get_stats(const struct sched *s, struct sched_stats *stats)
+{
+  memset(stats, 0, sizeof(*stats));
+  for (int i = 0; i < s->nworkers; i++) {
+    stats->executed += __atomic_load_n(&s->workers[i].executed, __ATOMIC_RELAXED);
+    stats->stolen += __atomic_load_n(&s->workers[i].stolen, __ATOMIC_RELAXED);
+  }
+}
+
+//========================================================================
+static void sched_conn_task_run(struct sched_task *task)
+{
+  struct sched_conn_task *ct = (struct sched_conn_task *)task;
+  int rc = zb_dispatch_packets(&ct->handler->buffer, ct->frame, ct->process);
+  if (ct->done)
+    ct->done(ct, rc);
+}
+
+void sched_conn_task_init(struct sched_conn_task *ct, struct handler *h,
+                          zb_packet_frame_func frame, zb_packet_processor_func process,
+                          void (*done)(struct sched_conn_task *ct, int rc), void *arg)
+{
+  ct->task.func = sched_conn_task_run;
+  ct->task.next = NULL;
+  // keep a connection on its home worker unless someone steals it
+  ct->task.affinity = (unsigned)h->sockfd;
+  ct->handler = h;
+  ct->frame = frame;
+  ct->process = process;
+  ct->done = done;
+  ct->arg = arg;
+}
@@ -0,0 +1,73 @@
+#ifndef XNET_SCHED_H_
+#define XNET_SCHED_H_
+
+#include <stdint.h>
+#include "packet.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Work-stealing task scheduler. Each worker owns a Chase-Lev deque; tasks
+// spawned by a worker go to its own deque, tasks submitted from outside
+// (e.g. a reactor thread) land in the inbox of the worker picked by
+// affinity. Idle workers steal from randomly chosen victims, so a few heavy
+// connections hashed to one reactor no longer pin one core.
+struct sched;
+struct sched_task;
+
+typedef void (*sched_task_func)(struct sched_task *task);
+
+// intrusive: embed it in the object the task works on, it must stay valid
+// until func has been called.
+struct sched_task {
+  sched_task_func func;
+  struct sched_task *next;  // inbox link, owned by the scheduler
+  unsigned affinity;        // preferred worker for external submission
+};
+
+// disable stealing, every task runs on its affinity worker (static hashing)
+#define SCHED_F_NOSTEAL (1<<0)
+
+// nworkers <= 0 uses the number of online cpus
+struct sched *sched_create(int nworkers, int flags);
+// run all queued tasks, then join the workers
+void sched_destroy(struct sched *s);
+
+// thread-safe. 0 : success, -1 fail
+int sched_submit(struct sched *s, struct sched_task *task);
+
+int sched_nworkers(const struct sched *s);
+// index of the calling worker, -1 if it is not a worker of any scheduler
+int sched_current_worker(void);
+
+struct sched_stats {
+  uint64_t executed;
+  uint64_t stolen;
+};
+void sched_get_stats(const struct sched *s, struct sched_stats *stats);
+
+//========================================================================
+// Connection-level job: frame and process the bytes a reactor has already
+// read into handler->buffer by zb_appendSocket(). The reactor keeps owning
+// handler->sockfd, the task never touches it. Re-arm the read interest
+// from done() (usually via reactor_post), so at most one task per
+// connection is in flight and the buffer is never shared.
+struct sched_conn_task {
+  struct sched_task task;
+  struct handler *handler;
+  zb_packet_frame_func frame;
+  zb_packet_processor_func process;
+  // runs on the worker, rc is the result of zb_dispatch_packets()
+  void (*done)(struct sched_conn_task *ct, int rc);
+  void *arg;
+};
+
+void sched_conn_task_init(struct sched_conn_task *ct, struct handler *h,
+                          zb_packet_frame_func frame, zb_packet_processor_func process,
+                          void (*done)(struct sched_conn_task *ct, int rc), void *arg);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,309 @@
+#define _GNU_SOURCE
+#include "shmring.h"
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "fdpass.h"
+
+#define SHM_MAGIC 0x78534852u  // "xSHR"
+#define SHM_VERSION 1
+#define SHM_CACHELINE 64
+
+// producer and consumer indexes live on their own cache lines,
+// they only ever grow and are reduced modulo size when used
+struct shm_ring_ctl {
+  uint64_t head __attribute__((aligned(SHM_CACHELINE)));  // written by the producer
+  uint32_t writer_waiting;
+  uint64_t tail __attribute__((aligned(SHM_CACHELINE)));  // written by the consumer
+  uint32_t reader_waiting;
+};
+
+// first page(s) of the memfd, the rings follow it
+struct shm_header {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t ring_size;
+  struct shm_ring_ctl ring[2];
+};
+
+// sent along with the descriptors
+struct shm_offer {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t ring_size;
+};
+
+static size_t shm_header_size(void)
+{
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  return (sizeof(struct shm_header) + page - 1) / page * page;
+}
+
+static void shm_channel_reset(struct shm_channel *ch)
+{
+  memset(ch, 0, sizeof(*ch));
+  ch->base = MAP_FAILED;
+  ch->memfd = ch->wait_efd = ch->peer_efd = -1;
+}
+
+// side 0 (offerer) sends on ring 0, side 1 sends on ring 1
+static int shm_map(struct shm_channel *ch, uint64_t size, int side)
+{
+  size_t hdr = shm_header_size();
+  size_t len = hdr + 4 * (size_t)size;
+  char *base = mmap(NULL, len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED)
+    return -1;
+  ch->base = base;
+  ch->map_len = len;
+  if (mmap(base, hdr, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, ch->memfd, 0) == MAP_FAILED)
+    return -1;
+  struct shm_header *h = (struct shm_header *)base;
+  struct shm_ring *rings[2] = { side == 0 ? &ch->tx : &ch->rx, side == 0 ? &ch->rx : &ch->tx };
+  for (int i = 0; i < 2; i++) {
+    char *addr = base + hdr + 2 * (size_t)i * size;
+    off_t off = (off_t)(hdr + (size_t)i * size);
+    // the same pages twice, so a region crossing the end stays contiguous
+    if (mmap(addr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, ch->memfd, off) == MAP_FAILED ||
+        mmap(addr + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, ch->memfd, off) == MAP_FAILED)
+      return -1;
+    rings[i]->ctl = &h->ring[i];
+    rings[i]->data = addr;
+    rings[i]->size = size;
+  }
+  return 0;
+}
+
+int shm_channel_offer(struct shm_channel *ch, int sockfd, size_t ring_size)
+{
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  uint64_t size = page;
+  while (size < ring_size)
+    size <<= 1;
+  shm_channel_reset(ch);
+
+  ch->memfd = memfd_create("xnet-shm", MFD_CLOEXEC);
+  if (ch->memfd == -1 || ftruncate(ch->memfd, (off_t)(shm_header_size() + 2 * size)) == -1)
+    goto fail;
+  if (shm_map(ch, size, 0) != 0)
+    goto fail;
+  struct shm_header *h = ch->base;
+  h->magic = SHM_MAGIC;
+  h->version = SHM_VERSION;
+  h->ring_size = size;
+
+  ch->wait_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  ch->peer_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (ch->wait_efd == -1 || ch->peer_efd == -1)
+    goto fail;
+
+  struct shm_offer offer = {
+    .magic = SHM_MAGIC,
+    .version = SHM_VERSION,
+    .ring_size = size,
+  };
+  int fds[3] = { ch->memfd, ch->wait_efd, ch->peer_efd };
+  if (SendFds(sockfd, fds, 3, &offer, sizeof(offer)) != (int)sizeof(offer))
+    goto fail;
+  return 0;
+
+fail:
+  shm_channel_close(ch);
+  return -1;
+}
+
+int shm_channel_accept(struct shm_channel *ch, int sockfd)
+{
+  struct shm_offer offer;
+  struct stat st;
+  int fds[3], nfds = 3;
+  shm_channel_reset(ch);
+
+  int n = RecvFds(sockfd, fds, &nfds, &offer, sizeof(offer));
+  if (n == -1)
+    return -1;
+  if (nfds == 3) {
+    ch->memfd = fds[0];
+    // the offerer waits on the first eventfd
+    ch->peer_efd = fds[1];
+    ch->wait_efd = fds[2];
+  } else {
+    for (int i = 0; i < nfds; i++)
+      close(fds[i]);
+  }
+  if (n != (int)sizeof(offer) || nfds != 3 ||
+      offer.magic != SHM_MAGIC || offer.version != SHM_VERSION ||
+      offer.ring_size == 0 || (offer.ring_size & (offer.ring_size - 1)) != 0 ||
+      fstat(ch->memfd, &st) == -1 ||
+      (uint64_t)st.st_size < shm_header_size() + 2 * offer.ring_size) {
+    errno = EPROTO;
+    goto fail;
+  }
+  if (shm_map(ch, offer.ring_size, 1) != 0)
+    goto fail;
+  return 0;
+
+fail:
+  shm_channel_close(ch);
+  return -1;
+}
+
+void shm_channel_close(struct shm_channel *ch)
+{
+  if (ch->base != MAP_FAILED && ch->base != NULL)
+    munmap(ch->base, ch->map_len);
+  if (ch->memfd != -1)
+    close(ch->memfd);
+  if (ch->wait_efd != -1)
+    close(ch->wait_efd);
+  if (ch->peer_efd != -1)
+    close(ch->peer_efd);
+  shm_channel_reset(ch);
+}
+
+static void shm_notify(struct shm_channel *ch, uint32_t *waiting)
+{
+  // pairs with the fence in shm_channel_prepare_wait()
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(waiting, __ATOMIC_RELAXED) &&
+      __atomic_exchange_n(waiting, 0, __ATOMIC_ACQ_REL)) {
+    uint64_t one = 1;
+    while (write(ch->peer_efd, &one, sizeof(one)) == -1 && errno == EINTR)
+      ;
+  }
+}
+
+static int shm_clamp(uint64_t n)
+{
+  return n > INT_MAX ? INT_MAX : (int)n;
+}
+
+// both indexes are in memory the peer can write, never trust them to be
+// at most size apart
+static int shm_corrupt(const struct shm_ring *r, uint64_t head, uint64_t tail, int *len)
+{
+  if (head - tail <= r->size)
+    return 0;
+  *len = 0;
+  errno = EPROTO;
+  return 1;
+}
+
+char *shm_channel_write_begin(struct shm_channel *ch, int *len)
+{
+  struct shm_ring *r = &ch->tx;
+  uint64_t head = __atomic_load_n(&r->ctl->head, __ATOMIC_RELAXED);
+  uint64_t tail = __atomic_load_n(&r->ctl->tail, __ATOMIC_ACQUIRE);
+  if (shm_corrupt(r, head, tail, len))
+    return NULL;
+  *len = shm_clamp(r->size - (head - tail));
+  return r->data + (head & (r->size - 1));
+}
+
+void shm_channel_write_commit(struct shm_channel *ch, int n)
+{
+  struct shm_ring *r = &ch->tx;
+  uint64_t head = __atomic_load_n(&r->ctl->head, __ATOMIC_RELAXED);
+  __atomic_store_n(&r->ctl->head, head + (uint64_t)n, __ATOMIC_RELEASE);
+  shm_notify(ch, &r->ctl->reader_waiting);
+}
+
+const char *shm_channel_read_begin(struct shm_channel *ch, int *len)
+{
+  struct shm_ring *r = &ch->rx;
+  uint64_t tail = __atomic_load_n(&r->ctl->tail, __ATOMIC_RELAXED);
+  uint64_t head = __atomic_load_n(&r->ctl->head, __ATOMIC_ACQUIRE);
+  if (shm_corrupt(r, head, tail, len))
+    return NULL;
+  *len = shm_clamp(head - tail);
+  return r->data + (tail & (r->size - 1));
+}
+
+void shm_channel_read_commit(struct shm_channel *ch, int n)
+{
+  struct shm_ring *r = &ch->rx;
+  uint64_t tail = __atomic_load_n(&r->ctl->tail, __ATOMIC_RELAXED);
+  __atomic_store_n(&r->ctl->tail, tail + (uint64_t)n, __ATOMIC_RELEASE);
+  shm_notify(ch, &r->ctl->writer_waiting);
+}
+
+int shm_channel_write(struct shm_channel *ch, const void *data, int len)
+{
+  int room;
+  char *p = shm_channel_write_begin(ch, &room);
+  if (!p)
+    return -1;
+  if (len > room)
+    len = room;
+  if (len <= 0)
+    return 0;
+  memcpy(p, data, (size_t)len);
+  shm_channel_write_commit(ch, len);
+  return len;
+}
+
+int shm_channel_read(struct shm_channel *ch, struct zbytes *zb)
+{
+  int avail;
+  const char *p = shm_channel_read_begin(ch, &avail);
+  if (!p)
+    return -1;
+  int n = zb_free_size(zb);
+  if (n > avail)
+    n = avail;
+  if (n <= 0)
+    return 0;
+  memcpy(zb->data + zb->limit, p, (size_t)n);
+  zb->limit += n;
+  shm_channel_read_commit(ch, n);
+  return n;
+}
+
+int shm_channel_prepare_wait(struct shm_channel *ch, int what)
+{
+  int len;
+  if (what & SHM_WAIT_READ)
+    __atomic_store_n(&ch->rx.ctl->reader_waiting, 1, __ATOMIC_RELAXED);
+  if (what & SHM_WAIT_WRITE)
+    __atomic_store_n(&ch->tx.ctl->writer_waiting, 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  // a corrupt ring does not sleep either, the next read or write fails
+  if (what & SHM_WAIT_READ) {
+    if (!shm_channel_read_begin(ch, &len) || len > 0)
+      return 1;
+  }
+  if (what & SHM_WAIT_WRITE) {
+    if (!shm_channel_write_begin(ch, &len) || len > 0)
+      return 1;
+  }
+  return 0;
+}
+
+void shm_channel_ack(struct shm_channel *ch)
+{
+  uint64_t n;
+  while (read(ch->wait_efd, &n, sizeof(n)) == -1 && errno == EINTR)
+    ;
+}
+
+int shm_channel_wait(struct shm_channel *ch, int what, int ms)
+{
+  struct pollfd pfd = {
+    .fd = ch->wait_efd,
+    .events = POLLIN,
+  };
+  int rc;
+  if (shm_channel_prepare_wait(ch, what))
+    return 1;
+  do {
+    rc = poll(&pfd, 1, ms);
+  } while (rc == -1 && errno == EINTR);
+  if (rc > 0)
+    shm_channel_ack(ch);
+  return rc;
+}
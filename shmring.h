@@ -0,0 +1,84 @@
+#ifndef XNET_SHMRING_H_
+#define XNET_SHMRING_H_
+
+#include <stdint.h>
+#include "zbytes.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Shared-memory byte stream between two co-located processes.
+//
+// The unix socket is used once, to pass a memfd and two eventfds with
+// SCM_RIGHTS; after that each direction is a single-producer single-consumer
+// ring in the shared mapping and no data goes through the kernel. Each ring
+// is mapped twice back to back, so every readable or writable region is
+// contiguous and can be used in place.
+//
+// Eventfds are only written when the peer has announced it is going to
+// sleep, a busy stream costs no syscalls at all.
+
+struct shm_ring_ctl;
+
+struct shm_ring {
+  struct shm_ring_ctl *ctl;
+  char *data;      // mapped twice, [data, data + 2 * size)
+  uint64_t size;   // power of two, multiple of the page size
+};
+
+struct shm_channel {
+  void *base;
+  size_t map_len;
+  struct shm_ring tx;
+  struct shm_ring rx;
+  int memfd;
+  int wait_efd;    // signalled for us
+  int peer_efd;    // signalled for the peer
+};
+
+// ring_size is rounded up to a power of two.
+// create the shared memory and pass it over the connected unix socket.
+// 0 : success, -1 fail
+int shm_channel_offer(struct shm_channel *ch, int sockfd, size_t ring_size);
+// receive the shared memory offered by the peer. 0 : success, -1 fail
+int shm_channel_accept(struct shm_channel *ch, int sockfd);
+void shm_channel_close(struct shm_channel *ch);
+
+// The ring indexes are shared with the peer. If they are more than a ring
+// apart, the peer is broken or hostile: the functions below fail with
+// EPROTO and the channel should be closed.
+
+// zero-copy write: contiguous free space, commit publishes n bytes of it.
+// NULL if the ring is corrupt
+char *shm_channel_write_begin(struct shm_channel *ch, int *len);
+void shm_channel_write_commit(struct shm_channel *ch, int n);
+// zero-copy read: contiguous readable data, commit releases n bytes of it.
+// NULL if the ring is corrupt
+const char *shm_channel_read_begin(struct shm_channel *ch, int *len);
+void shm_channel_read_commit(struct shm_channel *ch, int n);
+
+// copying helpers. bytes moved, 0 if the ring is full/empty, -1 corrupt
+int shm_channel_write(struct shm_channel *ch, const void *data, int len);
+// append into zb's free space
+int shm_channel_read(struct shm_channel *ch, struct zbytes *zb);
+
+#define SHM_WAIT_READ  (1<<0)
+#define SHM_WAIT_WRITE (1<<1)
+// arm the peer's wakeup for the conditions in what, then re-check them.
+// return 1 if one is already satisfied (do not sleep), 0 if it is safe to
+// wait for shm_channel_fd() to become readable
+int shm_channel_prepare_wait(struct shm_channel *ch, int what);
+// fd to register with a reactor (EPOLLIN), call shm_channel_ack() on wakeup
+static inline int shm_channel_fd(const struct shm_channel *ch)
+{
+  return ch->wait_efd;
+}
+void shm_channel_ack(struct shm_channel *ch);
+// blocking wait, ms < 0 forever. 1 ready, 0 timeout, -1 error
+int shm_channel_wait(struct shm_channel *ch, int what, int ms);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
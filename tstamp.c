@@ -0,0 +1,165 @@
+#include "tstamp.h"
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+
+#define TS_RX_FLAGS (SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE)
+// no payload copied back with the stamps, ids instead
+#define TS_TX_FLAGS (SOF_TIMESTAMPING_TX_SCHED | SOF_TIMESTAMPING_TX_SOFTWARE | \
+                     SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_OPT_ID | \
+                     SOF_TIMESTAMPING_OPT_TSONLY)
+
+int ts_enable(int fd, int flags)
+{
+  int val = 0;
+  if (flags & TS_RX)
+    val |= TS_RX_FLAGS;
+  if (flags & TS_TX)
+    val |= TS_TX_FLAGS;
+#ifdef SOF_TIMESTAMPING_OPT_ID_TCP
+  // TCP ids count from the write sequence, not from the unacked data
+  if ((flags & TS_TX) &&
+      setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &(int){ val | SOF_TIMESTAMPING_OPT_ID_TCP },
+                 sizeof(int)) == 0)
+    return 0;
+#endif
+  return setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &val, sizeof(val));
+}
+
+uint64_t ts_now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+void ts_latency_init(struct ts_latency *l)
+{
+  hist_init(&l->kernel);
+  hist_init(&l->loop);
+  hist_init(&l->handler);
+  hist_init(&l->tx_sched);
+  hist_init(&l->tx_dev);
+}
+
+void ts_latency_merge(struct ts_latency *dst, const struct ts_latency *src)
+{
+  hist_merge(&dst->kernel, &src->kernel);
+  hist_merge(&dst->loop, &src->loop);
+  hist_merge(&dst->handler, &src->handler);
+  hist_merge(&dst->tx_sched, &src->tx_sched);
+  hist_merge(&dst->tx_dev, &src->tx_dev);
+}
+
+static uint64_t ts_diff(uint64_t later, uint64_t earlier)
+{
+  return later > earlier ? later - earlier : 0;
+}
+
+void ts_latency_rx(struct ts_latency *l, uint64_t rx_ns, uint64_t wake_ns,
+                   uint64_t read_ns, uint64_t done_ns)
+{
+  if (rx_ns == 0)
+    return;
+  // data that arrived while the loop was busy never waited for a wakeup
+  uint64_t woke = wake_ns == 0 ? read_ns : (wake_ns > rx_ns ? wake_ns : rx_ns);
+  hist_record(&l->kernel, ts_diff(woke, rx_ns));
+  hist_record(&l->loop, ts_diff(read_ns, woke));
+  hist_record(&l->handler, ts_diff(done_ns, read_ns));
+}
+
+void ts_latency_print(const struct ts_latency *l, FILE *f)
+{
+  const struct {
+    const char *name;
+    const struct hist *h;
+  } parts[] = {
+    { "kernel", &l->kernel }, { "loop", &l->loop }, { "handler", &l->handler },
+    { "tx_sched", &l->tx_sched }, { "tx_dev", &l->tx_dev },
+  };
+  for (size_t i = 0; i < sizeof(parts) / sizeof(parts[0]); i++) {
+    if (parts[i].h->count)
+      hist_print(parts[i].h, f, parts[i].name, 1e3);
+  }
+}
+
+void ts_tx_init(struct ts_tx *tx, int stream)
+{
+  memset(tx, 0, sizeof(*tx));
+  tx->stream = stream;
+}
+
+void ts_tx_sent(struct ts_tx *tx, int bytes, uint64_t start_ns)
+{
+  if (tx->stream && bytes <= 0)
+    return;
+  // TCP stamps the last byte of a send, other sockets count the sends
+  uint32_t id = tx->stream ? tx->next + (uint32_t)bytes - 1 : tx->next;
+  tx->next += tx->stream ? (uint32_t)bytes : 1;
+  if (tx->head - tx->tail == TS_TX_PENDING) {
+    tx->tail++;
+    tx->merged++;
+  }
+  uint32_t i = tx->head++ % TS_TX_PENDING;
+  tx->pending[i].id = id;
+  tx->pending[i].sent_ns = start_ns;
+  tx->pending[i].sched_ns = 0;
+}
+
+static void ts_tx_stamp(struct ts_tx *tx, struct ts_latency *l, uint32_t type,
+                        uint32_t id, uint64_t ns)
+{
+  // sends that shared an skb with a later one only get the later stamp
+  while (tx->tail != tx->head && (int32_t)(tx->pending[tx->tail % TS_TX_PENDING].id - id) < 0) {
+    tx->tail++;
+    tx->merged++;
+  }
+  if (tx->tail == tx->head)
+    return;
+  uint32_t i = tx->tail % TS_TX_PENDING;
+  if (tx->pending[i].id != id)
+    return;
+  if (type == SCM_TSTAMP_SCHED) {
+    hist_record(&l->tx_sched, ts_diff(ns, tx->pending[i].sent_ns));
+    tx->pending[i].sched_ns = ns;
+  } else if (type == SCM_TSTAMP_SND) {
+    uint64_t from = tx->pending[i].sched_ns ? tx->pending[i].sched_ns : tx->pending[i].sent_ns;
+    hist_record(&l->tx_dev, ts_diff(ns, from));
+    tx->tail++;
+  }
+}
+
+int ts_tx_drain(int fd, struct ts_tx *tx, struct ts_latency *l)
+{
+  int count = 0;
+  for (;;) {
+    char control[256];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+      if (errno == EINTR)
+        continue;
+      return errno == EAGAIN || errno == EWOULDBLOCK ? count : -1;
+    }
+    const struct scm_timestamping *stamps = NULL;
+    const struct sock_extended_err *ee = NULL;
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+      if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPING)
+        stamps = (const struct scm_timestamping *)CMSG_DATA(c);
+      else if ((c->cmsg_level == SOL_IP && c->cmsg_type == IP_RECVERR) ||
+               (c->cmsg_level == SOL_IPV6 && c->cmsg_type == IPV6_RECVERR))
+        ee = (const struct sock_extended_err *)CMSG_DATA(c);
+    }
+    if (!stamps || !ee || ee->ee_errno != ENOMSG || ee->ee_origin != SO_EE_ORIGIN_TIMESTAMPING)
+      continue;
+    uint64_t ns = (uint64_t)stamps->ts[0].tv_sec * 1000000000ULL + (uint64_t)stamps->ts[0].tv_nsec;
+    ts_tx_stamp(tx, l, ee->ee_info, ee->ee_data, ns);
+    count++;
+  }
+}
@@ -0,0 +1,80 @@
+#ifndef XNET_TSTAMP_H_
+#define XNET_TSTAMP_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include "hist.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Kernel timestamping (SO_TIMESTAMPING), software stamps only, so it works
+// on loopback and on any NIC.
+//
+// Receive: the kernel stamps a packet when it enters the stack, and
+// zb_appendSocketTs() (packet.h) returns the stamp of the data it read.
+// With reactor_stamp_wakeups() the reactor also notes when epoll_wait
+// returned, which splits the latency of a read into
+//
+//   kernel   rx stamp -> the loop woke up for it
+//   loop     woke up -> read started, i.e. behind the earlier fds of the batch
+//   handler  read started -> the caller is done with it
+//
+// Send: a send() is stamped when it enters the qdisc (sched) and when it
+// is handed to the driver (dev). The stamps come back on the error queue
+// (EPOLLERR); ts_tx_drain() matches them to the sends noted with
+// ts_tx_sent(). All stamps are CLOCK_REALTIME ns, see ts_now_ns().
+
+#define TS_RX (1 << 0)
+#define TS_TX (1 << 1)
+
+// enable TS_RX and/or TS_TX on fd. 0 : success, -1 fail
+int ts_enable(int fd, int flags);
+uint64_t ts_now_ns(void);
+
+struct ts_latency {
+  struct hist kernel;
+  struct hist loop;
+  struct hist handler;
+  struct hist tx_sched;  // send() -> qdisc
+  struct hist tx_dev;    // qdisc -> driver
+};
+
+void ts_latency_init(struct ts_latency *l);
+void ts_latency_merge(struct ts_latency *dst, const struct ts_latency *src);
+// one read. rx_ns 0 (no stamp) records nothing, wake_ns 0 (blocking reads,
+// no reactor) counts the whole wait as kernel time
+void ts_latency_rx(struct ts_latency *l, uint64_t rx_ns, uint64_t wake_ns,
+                   uint64_t read_ns, uint64_t done_ns);
+// every non-empty histogram, in us
+void ts_latency_print(const struct ts_latency *l, FILE *f);
+
+#define TS_TX_PENDING 64
+
+// sends waiting for their stamps, one per socket
+struct ts_tx {
+  int stream;     // TCP: stamp ids count bytes, otherwise sends
+  uint32_t next;  // id of the next send
+  uint32_t head;
+  uint32_t tail;
+  struct {
+    uint32_t id;
+    uint64_t sent_ns;
+    uint64_t sched_ns;
+  } pending[TS_TX_PENDING];
+  uint64_t merged;  // sends stamped together with a later one, or dropped
+};
+
+// stream: fd is a TCP socket. call right after ts_enable(fd, TS_TX)
+void ts_tx_init(struct ts_tx *tx, int stream);
+// one send() that started at start_ns (ts_now_ns()) accepted bytes
+void ts_tx_sent(struct ts_tx *tx, int bytes, uint64_t start_ns);
+// read the error queue of fd until it is empty, recording into l.
+// number of stamps read, -1 fail
+int ts_tx_drain(int fd, struct ts_tx *tx, struct ts_latency *l);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,138 @@
+// batched accept, the connection cap and shedding of the acceptor
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+#include <gtest/gtest.h>
+#include "../acceptor.h"
+
+static void on_accept(struct acceptor *a, int fd, void *arg)
+{
+  (void)a;
+  ((std::vector<int> *)arg)->push_back(fd);
+}
+
+class acceptor_test : public ::testing::Test {
+protected:
+  struct reactor *r;
+  struct acceptor a;
+  struct acceptor_limits limits;
+  struct sockaddr_in addr;
+  int l;
+  std::vector<int> accepted;  // server side
+  std::vector<int> clients;
+
+  void SetUp() override
+  {
+    r = reactor_create(0);
+    ASSERT_TRUE(r != NULL);
+    l = socket(AF_INET, SOCK_STREAM, 0);
+    socklen_t len = sizeof(addr);
+    addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ASSERT_EQ(bind(l, (struct sockaddr *)&addr, sizeof(addr)), 0);
+    ASSERT_EQ(listen(l, 64), 0);
+    ASSERT_EQ(getsockname(l, (struct sockaddr *)&addr, &len), 0);
+  }
+  void TearDown() override
+  {
+    acceptor_close(&a);
+    for (int fd : accepted)
+      close(fd);
+    for (int fd : clients)
+      close(fd);
+    close(l);
+    reactor_destroy(r);
+  }
+  void start(int max_conns, int resume_conns, int per_tick, int flags)
+  {
+    acceptor_limits_init(&limits, max_conns, resume_conns);
+    ASSERT_EQ(acceptor_init(&a, r, l, &limits, per_tick, flags, on_accept, &accepted), 0);
+  }
+  // n connections, all complete in the kernel queue before any accept
+  void connect_clients(int n)
+  {
+    for (int i = 0; i < n; i++) {
+      int fd = socket(AF_INET, SOCK_STREAM, 0);
+      ASSERT_EQ(connect(fd, (struct sockaddr *)&addr, sizeof(addr)), 0);
+      clients.push_back(fd);
+    }
+  }
+  // the server side of accepted[i] goes away
+  void release(int i)
+  {
+    close(accepted[i]);
+    accepted.erase(accepted.begin() + i);
+    acceptor_limits_release(&limits);
+  }
+  void run(int iterations, int timeout_ms)
+  {
+    for (int i = 0; i < iterations; i++)
+      ASSERT_GE(reactor_run_once(r, timeout_ms), 0);
+  }
+};
+
+TEST_F(acceptor_test, per_tick_batches)
+{
+  start(0, 0, 2, 0);
+  connect_clients(5);
+  run(1, 100);
+  EXPECT_EQ(accepted.size(), 2u);
+  // the listener stays ready, the rest comes over the next iterations
+  run(1, 100);
+  EXPECT_EQ(accepted.size(), 4u);
+  run(1, 100);
+  EXPECT_EQ(accepted.size(), 5u);
+  EXPECT_EQ(a.stats.accepted, 5u);
+  EXPECT_EQ(limits.active, 5);
+  EXPECT_EQ(a.stats.pauses, 0u);
+}
+
+TEST_F(acceptor_test, limit_pauses_and_resumes)
+{
+  start(4, 2, 0, 0);
+  connect_clients(6);
+  run(3, 20);
+  EXPECT_EQ(accepted.size(), 4u);
+  EXPECT_EQ(limits.active, 4);
+  EXPECT_TRUE(a.paused);
+  EXPECT_EQ(a.stats.pauses, 1u);
+  EXPECT_EQ(a.stats.shed, 0u);
+
+  // below the cap but above the resume mark: stays paused
+  release(0);
+  run(3, 20);
+  EXPECT_TRUE(a.paused);
+  EXPECT_EQ(accepted.size(), 3u);
+
+  release(0);
+  uint64_t end = reactor_now_ms() + 1000;
+  while (accepted.size() < 4 && reactor_now_ms() < end)
+    run(1, 20);
+  // the two left in the queue take it back up to the cap
+  EXPECT_EQ(accepted.size(), 4u);
+  EXPECT_EQ(limits.active, 4);
+  EXPECT_EQ(a.stats.accepted, 6u);
+}
+
+TEST_F(acceptor_test, shed_resets_over_limit)
+{
+  start(1, 0, 0, ACCEPTOR_F_SHED);
+  connect_clients(3);
+  run(1, 100);
+  EXPECT_EQ(accepted.size(), 1u);
+  EXPECT_EQ(a.stats.accepted, 1u);
+  EXPECT_EQ(a.stats.shed, 2u);
+  EXPECT_EQ(limits.active, 1);
+  EXPECT_FALSE(a.paused);
+  // the shed clients see a reset, not a timeout
+  char c;
+  int reset = 0;
+  for (int fd : clients)
+    reset += recv(fd, &c, 1, MSG_DONTWAIT) == -1 && errno == ECONNRESET;
+  EXPECT_EQ(reset, 2);
+}
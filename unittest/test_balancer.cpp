@@ -0,0 +1,269 @@
+// backend selection and outlier ejection of the client-side balancer
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+#include "../balancer.h"
+
+// n backends on 127.0.0.1, nothing has to listen: picks never connect
+static struct balancer *make(int n, const struct balancer_options *opts)
+{
+  std::vector<std::string> names;
+  std::vector<const char *> addrs;
+  for (int i = 0; i < n; i++)
+    names.push_back("127.0.0.1:" + std::to_string(20000 + i));
+  for (auto &s : names)
+    addrs.push_back(s.c_str());
+  return balancer_create("tcp4", addrs.data(), n, opts);
+}
+
+// a loopback port nothing listens on
+static int closed_port(void)
+{
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in a = {};
+  socklen_t len = sizeof(a);
+  a.sin_family = AF_INET;
+  a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  bind(fd, (struct sockaddr *)&a, sizeof(a));
+  getsockname(fd, (struct sockaddr *)&a, &len);
+  close(fd);
+  return ntohs(a.sin_port);
+}
+
+static void fail(struct balancer *b, int backend, int times)
+{
+  for (int i = 0; i < times; i++)
+    balancer_report(b, backend, 0);
+}
+
+TEST(balancer, hash_grow_moves_keys_to_new_bucket_only)
+{
+  struct balancer_options opts = {};
+  opts.policy = BALANCER_HASH;
+  struct balancer *b10 = make(10, &opts), *b11 = make(11, &opts);
+  ASSERT_TRUE(b10 && b11);
+  int moved = 0, keys = 100000;
+  for (uint64_t key = 0; key < (uint64_t)keys; key++) {
+    int before = balancer_pick(b10, key), after = balancer_pick(b11, key);
+    ASSERT_GE(before, 0);
+    ASSERT_LT(before, 10);
+    if (after != before) {
+      EXPECT_EQ(after, 10) << key;
+      moved++;
+    }
+  }
+  // about 1/11 of the keys
+  EXPECT_NEAR(moved, keys / 11, keys / 100);
+  balancer_destroy(b10);
+  balancer_destroy(b11);
+}
+
+TEST(balancer, hash_spreads_keys)
+{
+  struct balancer_options opts = {};
+  opts.policy = BALANCER_HASH;
+  struct balancer *b = make(8, &opts);
+  int count[8] = {};
+  for (uint64_t key = 0; key < 80000; key++)
+    count[balancer_pick(b, key)]++;
+  for (int i = 0; i < 8; i++)
+    EXPECT_NEAR(count[i], 10000, 600) << i;
+  balancer_destroy(b);
+}
+
+TEST(balancer, hash_ejection_moves_only_its_keys)
+{
+  struct balancer_options opts = {};
+  opts.policy = BALANCER_HASH;
+  opts.eject_failures = 1;
+  struct balancer *b = make(10, &opts);
+  std::vector<int> home;
+  for (uint64_t key = 0; key < 10000; key++)
+    home.push_back(balancer_pick(b, key));
+  fail(b, 3, 1);
+  ASSERT_TRUE(balancer_ejected(b, 3));
+  for (uint64_t key = 0; key < 10000; key++) {
+    int now = balancer_pick(b, key);
+    if (home[key] == 3)
+      EXPECT_NE(now, 3) << key;
+    else
+      EXPECT_EQ(now, home[key]) << key;
+  }
+  balancer_destroy(b);
+}
+
+TEST(balancer, p2c_avoids_busy_backend)
+{
+  struct balancer *b = make(3, NULL);
+  for (int i = 0; i < 5; i++)
+    balancer_begin(b, 0);
+  // two distinct candidates, the busy one always loses
+  for (int i = 0; i < 10000; i++)
+    ASSERT_NE(balancer_pick(b, 0), 0);
+  for (int i = 0; i < 5; i++)
+    balancer_end(b, 0, 0);
+  int count[3] = {};
+  for (int i = 0; i < 30000; i++)
+    count[balancer_pick(b, 0)]++;
+  for (int i = 0; i < 3; i++)
+    EXPECT_GT(count[i], 5000) << i;
+  balancer_destroy(b);
+}
+
+TEST(balancer, ewma_avoids_slow_backend)
+{
+  struct balancer_options opts = {};
+  opts.policy = BALANCER_EWMA;
+  struct balancer *b = make(3, &opts);
+  for (int i = 0; i < 3; i++) {
+    balancer_begin(b, i);
+    balancer_end(b, i, i == 1 ? 5000000 : 100000);
+  }
+  for (int i = 0; i < 10000; i++)
+    ASSERT_NE(balancer_pick(b, 0), 1);
+  balancer_destroy(b);
+}
+
+TEST(balancer, eject_after_consecutive_failures)
+{
+  struct balancer_options opts = {};
+  opts.eject_failures = 3;
+  struct balancer *b = make(4, &opts);
+  fail(b, 1, 2);
+  EXPECT_FALSE(balancer_ejected(b, 1));
+  // a success starts the count over
+  balancer_report(b, 1, 1);
+  fail(b, 1, 2);
+  EXPECT_FALSE(balancer_ejected(b, 1));
+  fail(b, 1, 1);
+  EXPECT_TRUE(balancer_ejected(b, 1));
+  for (int i = 0; i < 10000; i++)
+    ASSERT_NE(balancer_pick(b, 0), 1);
+  balancer_destroy(b);
+}
+
+TEST(balancer, eject_capped_by_max_percent)
+{
+  struct balancer_options opts = {};
+  opts.eject_failures = 1;
+  opts.max_eject_percent = 50;
+  struct balancer *b = make(4, &opts);
+  for (int i = 0; i < 4; i++)
+    fail(b, i, 1);
+  int ejected = 0;
+  for (int i = 0; i < 4; i++)
+    ejected += balancer_ejected(b, i);
+  EXPECT_EQ(ejected, 2);
+  for (int i = 0; i < 10000; i++)
+    ASSERT_FALSE(balancer_ejected(b, balancer_pick(b, 0)));
+  balancer_destroy(b);
+}
+
+TEST(balancer, all_ejected_still_picks)
+{
+  struct balancer_options opts = {};
+  opts.eject_failures = 1;
+  opts.max_eject_percent = 100;
+  struct balancer *b = make(3, &opts);
+  for (int i = 0; i < 3; i++)
+    fail(b, i, 1);
+  for (int i = 0; i < 3; i++)
+    ASSERT_TRUE(balancer_ejected(b, i));
+  for (int i = 0; i < 1000; i++) {
+    int k = balancer_pick(b, 0);
+    ASSERT_GE(k, 0);
+    ASSERT_LT(k, 3);
+  }
+  balancer_destroy(b);
+}
+
+TEST(balancer, readmission_and_backoff)
+{
+  struct balancer_options opts = {};
+  opts.eject_failures = 1;
+  opts.eject_ms = 100;
+  opts.max_eject_ms = 1000;
+  opts.max_eject_percent = 25;
+  struct balancer *b = make(4, &opts);
+  fail(b, 0, 1);
+  ASSERT_TRUE(balancer_ejected(b, 0));
+  // the only slot is taken
+  fail(b, 1, 1);
+  EXPECT_FALSE(balancer_ejected(b, 1));
+
+  usleep(200 * 1000);
+  EXPECT_FALSE(balancer_ejected(b, 0));
+  // readmission returned the slot
+  fail(b, 1, 1);
+  EXPECT_TRUE(balancer_ejected(b, 1));
+  usleep(200 * 1000);
+  EXPECT_FALSE(balancer_ejected(b, 1));
+
+  // failing again right after readmission doubles the ejection
+  fail(b, 0, 1);
+  ASSERT_TRUE(balancer_ejected(b, 0));
+  usleep(120 * 1000);
+  EXPECT_TRUE(balancer_ejected(b, 0));
+  usleep(200 * 1000);
+  EXPECT_FALSE(balancer_ejected(b, 0));
+
+  // a success after readmission resets it
+  balancer_report(b, 0, 1);
+  fail(b, 0, 1);
+  ASSERT_TRUE(balancer_ejected(b, 0));
+  usleep(150 * 1000);
+  EXPECT_FALSE(balancer_ejected(b, 0));
+  balancer_destroy(b);
+}
+
+TEST(balancer, dial_counts_one_failure_per_backend)
+{
+  struct balancer_options opts = {};
+  opts.eject_failures = 2;
+  opts.max_eject_percent = 100;
+  // [::1] and 127.0.0.1, both refuse
+  std::string addr = ":" + std::to_string(closed_port());
+  const char *addrs[] = { addr.c_str() };
+  struct balancer *b = balancer_create("tcp", addrs, 1, &opts);
+  ASSERT_TRUE(b != NULL);
+  ASSERT_EQ(balancer_endpoint(b, 0)->count, 2);
+  EXPECT_EQ(BalancerDial(b, 0, NULL, NULL), -1);
+  EXPECT_FALSE(balancer_ejected(b, 0));
+  EXPECT_EQ(BalancerDial(b, 0, NULL, NULL), -1);
+  EXPECT_TRUE(balancer_ejected(b, 0));
+  balancer_destroy(b);
+}
+
+TEST(balancer, nonblocking_dial_leaves_report_to_caller)
+{
+  struct balancer_options opts = {};
+  opts.eject_failures = 3;
+  opts.max_eject_percent = 100;
+  std::string addr = "127.0.0.1:" + std::to_string(closed_port());
+  const char *addrs[] = { addr.c_str() };
+  struct balancer *b = balancer_create("tcp4", addrs, 1, &opts);
+  ASSERT_TRUE(b != NULL);
+  struct BuildNetParams params = {};
+  params.flags = XNET_F_NONBLOCK;
+  for (int i = 0; i < 3; i++) {
+    EXPECT_FALSE(balancer_ejected(b, 0)) << i;
+    int backend = -1;
+    int fd = BalancerDial(b, 0, &params, &backend);
+    // refused right away or once the connect completes
+    if (fd != -1) {
+      EXPECT_EQ(backend, 0);
+      EXPECT_EQ(WaitConnected(fd, 1000), -1);
+      balancer_report(b, backend, 0);
+      close(fd);
+    }
+  }
+  // the connects in progress did not count as successes in between
+  EXPECT_TRUE(balancer_ejected(b, 0));
+  balancer_destroy(b);
+}
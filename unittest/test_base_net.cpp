@@ -0,0 +1,117 @@
+// numeric host and port parsing behind ResolveEndpoint()
+
+#include <errno.h>
+#include <net/if.h>
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+#include "../base_net.h"
+
+// the formatted addresses, empty if resolving failed (errno is kept)
+static std::vector<std::string> resolve(const char *network, const char *address, int passive = 0)
+{
+  struct Endpoint ep;
+  std::vector<std::string> out;
+  if (ResolveEndpoint(&ep, network, address, passive) != 0)
+    return out;
+  for (int i = 0; i < ep.count; i++) {
+    char buf[80];
+    EXPECT_GT(format_sockaddr((const struct sockaddr *)&ep.addrs[i].addr, buf, sizeof(buf)), 0);
+    out.push_back(buf);
+  }
+  EndpointFree(&ep);
+  return out;
+}
+
+typedef std::vector<std::string> addrs;
+
+TEST(endpoint, ipv4)
+{
+  EXPECT_EQ(resolve("tcp4", "1.2.3.4:80"), addrs{"1.2.3.4:80"});
+  EXPECT_EQ(resolve("tcp", "0.0.0.0:0"), addrs{"0.0.0.0:0"});
+  EXPECT_EQ(resolve("tcp", "255.255.255.255:65535"), addrs{"255.255.255.255:65535"});
+  EXPECT_EQ(resolve("udp4", " 10.0.0.1:53 "), addrs{"10.0.0.1:53"});
+  // v4 on a v6 network is mapped
+  EXPECT_EQ(resolve("tcp6", "1.2.3.4:80"), addrs{"[::ffff:1.2.3.4]:80"});
+}
+
+TEST(endpoint, ipv4_leading_zeros)
+{
+  // not decimal: the resolver reads them as octal, like inet_aton()
+  EXPECT_EQ(resolve("tcp4", "010.0.0.1:80"), addrs{"8.0.0.1:80"});
+  EXPECT_EQ(resolve("tcp4", "0.0.0.010:80"), addrs{"0.0.0.8:80"});
+}
+
+TEST(endpoint, ipv4_out_of_range)
+{
+  EXPECT_TRUE(resolve("tcp4", "1.2.3.256:80").empty());
+  EXPECT_TRUE(resolve("tcp4", "1.2.3.4.5:80").empty());
+  EXPECT_TRUE(resolve("tcp4", "1.2.3.1000:80").empty());
+}
+
+TEST(endpoint, port)
+{
+  EXPECT_EQ(resolve("tcp4", "1.2.3.4:0080"), addrs{"1.2.3.4:80"});
+  EXPECT_EQ(resolve("tcp4", "1.2.3.4:"), addrs{"1.2.3.4:0"});
+  EXPECT_EQ(resolve("tcp4", "1.2.3.4"), addrs{"1.2.3.4:0"});
+  errno = 0;
+  EXPECT_TRUE(resolve("tcp4", "1.2.3.4:65536").empty());
+  EXPECT_EQ(errno, EINVAL);
+  errno = 0;
+  EXPECT_TRUE(resolve("tcp4", "1.2.3.4:99999999999999999999").empty());
+  EXPECT_EQ(errno, EINVAL);
+}
+
+TEST(endpoint, ipv6)
+{
+  EXPECT_EQ(resolve("tcp6", "[::1]:8080"), addrs{"[::1]:8080"});
+  EXPECT_EQ(resolve("tcp", "[2001:db8::1]:443"), addrs{"[2001:db8::1]:443"});
+  EXPECT_EQ(resolve("tcp", "[::1]"), addrs{"[::1]:0"});
+  errno = 0;
+  EXPECT_TRUE(resolve("tcp4", "[::1]:80").empty());
+  EXPECT_EQ(errno, EAFNOSUPPORT);
+}
+
+TEST(endpoint, ipv6_scope)
+{
+  char want[64];
+  snprintf(want, sizeof(want), "[fe80::1%%%u]:80", if_nametoindex("lo"));
+  EXPECT_EQ(resolve("tcp6", "[fe80::1%lo]:80"), addrs{want});
+}
+
+TEST(endpoint, malformed)
+{
+  errno = 0;
+  EXPECT_TRUE(resolve("tcp", "[]:80").empty());
+  EXPECT_EQ(errno, EINVAL);
+  EXPECT_TRUE(resolve("tcp", "[::1:80").empty());
+  EXPECT_TRUE(resolve("tcp", "[::1]80").empty());
+  EXPECT_TRUE(resolve("tcp", "").empty());
+  EXPECT_TRUE(resolve("sctp", "1.2.3.4:80").empty());
+}
+
+TEST(endpoint, wildcard)
+{
+  // same order as getaddrinfo(NULL, ...)
+  EXPECT_EQ(resolve("tcp", ":80", 1), (addrs{"0.0.0.0:80", "[::]:80"}));
+  EXPECT_EQ(resolve("tcp", "*:80", 1), (addrs{"0.0.0.0:80", "[::]:80"}));
+  EXPECT_EQ(resolve("tcp", ":80"), (addrs{"[::1]:80", "127.0.0.1:80"}));
+  EXPECT_EQ(resolve("tcp4", ":80"), addrs{"127.0.0.1:80"});
+}
+
+TEST(dial, tls_networks_need_ktls)
+{
+  // DialTLS()/ListenTLS() run the handshake, the plain entry points refuse
+  errno = 0;
+  EXPECT_EQ(Dial("tls", "127.0.0.1:1"), -1);
+  EXPECT_EQ(errno, EINVAL);
+  errno = 0;
+  EXPECT_EQ(Listen("tls4", "127.0.0.1:0"), -1);
+  EXPECT_EQ(errno, EINVAL);
+  struct BuildNetParams params = {};
+  params.network = "tls6";
+  params.local_address = "[::1]:0";
+  errno = 0;
+  EXPECT_EQ(Listen_ex(&params), -1);
+  EXPECT_EQ(errno, EINVAL);
+}
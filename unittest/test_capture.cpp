@@ -0,0 +1,184 @@
+// capture round trips across segment rotation
+
+#include <glob.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <map>
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+#include "../capture.h"
+
+#define SEGMENT (64 << 10)
+// segment and record headers
+#define HEADER_SIZE 64
+#define RECORD_SIZE 24
+
+static uint64_t now_ns(clockid_t clock)
+{
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// every byte is a packet
+static int frame_byte(const struct zbytes *zb)
+{
+  return zb_available(zb) > 0 ? 1 : 0;
+}
+
+static int process_byte(char *data, int length)
+{
+  (void)data;
+  (void)length;
+  return 0;
+}
+
+class capture_test : public ::testing::Test {
+protected:
+  char dir[64];
+  std::string prefix;
+
+  void SetUp() override
+  {
+    snprintf(dir, sizeof(dir), "/tmp/xnet_capture.XXXXXX");
+    ASSERT_TRUE(mkdtemp(dir) != NULL);
+    prefix = std::string(dir) + "/cap";
+  }
+  void TearDown() override
+  {
+    glob_t g;
+    if (glob((prefix + ".*").c_str(), 0, NULL, &g) == 0) {
+      for (size_t i = 0; i < g.gl_pathc; i++)
+        unlink(g.gl_pathv[i]);
+      globfree(&g);
+    }
+    rmdir(dir);
+  }
+  struct capture *open_capture()
+  {
+    struct capture_options opts = {};
+    opts.segment_bytes = SEGMENT;
+    return capture_open(prefix.c_str(), &opts);
+  }
+  // OPEN/CLOSE as "o<conn>"/"c<conn>", the data of every connection joined
+  void read_back(std::vector<std::string> *events, std::map<uint64_t, std::string> *data)
+  {
+    struct capture_reader *rd = capture_reader_open(prefix.c_str());
+    ASSERT_TRUE(rd != NULL);
+    struct capture_record rec;
+    int rc;
+    while ((rc = capture_reader_next(rd, &rec)) == 1) {
+      if (rec.type == CAPTURE_DATA)
+        (*data)[rec.conn].append(rec.data, (size_t)rec.len);
+      else
+        events->push_back((rec.type == CAPTURE_OPEN ? "o" : "c") + std::to_string(rec.conn));
+    }
+    EXPECT_EQ(rc, 0);
+    capture_reader_close(rd);
+  }
+};
+
+TEST_F(capture_test, close_at_segment_end)
+{
+  struct capture *c = open_capture();
+  ASSERT_TRUE(c != NULL);
+  ASSERT_EQ(capture_record(c, 1, CAPTURE_OPEN, NULL, 0), 0);
+  // leaves less than a record header: the CLOSE starts the next segment
+  std::string fill(SEGMENT - HEADER_SIZE - 2 * RECORD_SIZE - 16, 'x');
+  ASSERT_EQ(capture_record(c, 1, CAPTURE_DATA, fill.data(), (int)fill.size()), 0);
+  ASSERT_EQ(capture_record(c, 1, CAPTURE_CLOSE, NULL, 0), 0);
+  ASSERT_EQ(capture_record(c, 2, CAPTURE_OPEN, NULL, 0), 0);
+  struct capture_stats st;
+  capture_get_stats(c, &st);
+  EXPECT_EQ(st.segments, 2u);
+  EXPECT_EQ(st.records, 4u);
+  capture_close(c);
+
+  std::vector<std::string> events;
+  std::map<uint64_t, std::string> data;
+  read_back(&events, &data);
+  EXPECT_EQ(events, (std::vector<std::string>{"o1", "c1", "o2"}));
+  EXPECT_EQ(data[1], fill);
+}
+
+TEST_F(capture_test, many_rotations)
+{
+  struct capture *c = open_capture();
+  ASSERT_TRUE(c != NULL);
+  std::vector<std::string> want_events;
+  std::map<uint64_t, std::string> want_data;
+  uint32_t x = 2463534242u;
+  for (uint64_t conn = 1; conn <= 200; conn++) {
+    ASSERT_EQ(capture_record(c, conn, CAPTURE_OPEN, NULL, 0), 0);
+    want_events.push_back("o" + std::to_string(conn));
+    for (int i = 0; i < 3; i++) {
+      x ^= x << 13;
+      x ^= x >> 17;
+      x ^= x << 5;
+      std::string chunk((size_t)(x % 6000), (char)('a' + conn % 26));
+      ASSERT_EQ(capture_record(c, conn, CAPTURE_DATA, chunk.data(), (int)chunk.size()), 0);
+      want_data[conn] += chunk;
+    }
+    ASSERT_EQ(capture_record(c, conn, CAPTURE_CLOSE, NULL, 0), 0);
+    want_events.push_back("c" + std::to_string(conn));
+  }
+  struct capture_stats st;
+  capture_get_stats(c, &st);
+  EXPECT_GT(st.segments, 20u);
+  capture_close(c);
+
+  std::vector<std::string> events;
+  std::map<uint64_t, std::string> data;
+  read_back(&events, &data);
+  EXPECT_EQ(events, want_events);
+  for (auto &kv : want_data)
+    EXPECT_EQ(data[kv.first], kv.second) << kv.first;
+}
+
+TEST_F(capture_test, monotonic_stamps_and_segment_realtime)
+{
+  uint64_t mono0 = now_ns(CLOCK_MONOTONIC), real0 = now_ns(CLOCK_REALTIME);
+  struct capture *c = open_capture();
+  ASSERT_TRUE(c != NULL);
+  ASSERT_EQ(capture_record(c, 1, CAPTURE_OPEN, NULL, 0), 0);
+  usleep(50 * 1000);
+  ASSERT_EQ(capture_record(c, 1, CAPTURE_DATA, "ab", 2), 0);
+  uint64_t mono1 = now_ns(CLOCK_MONOTONIC), real1 = now_ns(CLOCK_REALTIME);
+  capture_close(c);
+
+  struct capture_reader *rd = capture_reader_open(prefix.c_str());
+  ASSERT_TRUE(rd != NULL);
+  struct capture_record open_rec, data_rec;
+  ASSERT_EQ(capture_reader_next(rd, &open_rec), 1);
+  ASSERT_EQ(capture_reader_next(rd, &data_rec), 1);
+  capture_reader_close(rd);
+  EXPECT_GE(open_rec.ns, mono0);
+  EXPECT_LE(data_rec.ns, mono1);
+  EXPECT_GE(data_rec.ns - open_rec.ns, 50000000u);
+  // the wall time comes from the segment header, same distance apart
+  EXPECT_GE(open_rec.realtime_ns, real0);
+  EXPECT_LE(data_rec.realtime_ns, real1);
+  EXPECT_EQ(data_rec.realtime_ns - open_rec.realtime_ns, data_rec.ns - open_rec.ns);
+}
+
+TEST_F(capture_test, replay_keeps_pace)
+{
+  struct capture *c = open_capture();
+  ASSERT_TRUE(c != NULL);
+  ASSERT_EQ(capture_record(c, 1, CAPTURE_DATA, "a", 1), 0);
+  usleep(60 * 1000);
+  ASSERT_EQ(capture_record(c, 1, CAPTURE_DATA, "b", 1), 0);
+  capture_close(c);
+
+  struct capture_replay_stats st;
+  ASSERT_EQ(capture_replay(prefix.c_str(), 1, frame_byte, process_byte, &st), 0);
+  EXPECT_EQ(st.packets, 2u);
+  EXPECT_GE(st.elapsed_ns, 60000000u);
+  // twice as fast
+  ASSERT_EQ(capture_replay(prefix.c_str(), 2, frame_byte, process_byte, &st), 0);
+  EXPECT_GE(st.elapsed_ns, 30000000u);
+  EXPECT_LT(st.elapsed_ns, 60000000u);
+}
@@ -0,0 +1,303 @@
+// coroutine dial and read helpers over a reactor
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <string>
+#include <gtest/gtest.h>
+extern "C" {
+#include "../zbytes.h"
+}
+#include "../co.h"
+
+// loopback listener on an ephemeral port, -1 on failure
+static int listen_loopback(int backlog, int *port)
+{
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in a = {};
+  socklen_t len = sizeof(a);
+  a.sin_family = AF_INET;
+  a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(fd, (struct sockaddr *)&a, sizeof(a)) != 0 || listen(fd, backlog) != 0 ||
+      getsockname(fd, (struct sockaddr *)&a, &len) != 0) {
+    close(fd);
+    return -1;
+  }
+  *port = ntohs(a.sin_port);
+  return fd;
+}
+
+// a port nothing listens on
+static int closed_port(void)
+{
+  int port = 0;
+  close(listen_loopback(1, &port));
+  return port;
+}
+
+struct session {
+  struct co co;
+  std::string network;
+  std::string address;
+  int ms;
+  int fd;
+  struct zbytes buf;
+  int rc;
+  int err;
+  int done;
+  int n;
+  const char *delim;
+  int max;
+};
+
+static void on_exit_session(struct co *co, int rc)
+{
+  struct session *s = (struct session *)co->arg;
+  s->done = 1;
+  s->rc = rc;
+}
+
+static int dial(struct co *co)
+{
+  struct session *s = (struct session *)co->arg;
+  int rc;
+  CO_BEGIN(co);
+  CO_AWAIT(co, rc, co_dial_timeout(co, s->network.c_str(), s->address.c_str(), s->ms));
+  s->err = rc == -1 ? errno : 0;
+  s->fd = rc;
+  CO_END(co);
+  return rc;
+}
+
+static int read_until(struct co *co)
+{
+  struct session *s = (struct session *)co->arg;
+  int rc;
+  CO_BEGIN(co);
+  if (co_attach(co, s->fd) != 0)
+    return -1;
+  CO_AWAIT(co, rc, co_read_until(co, s->fd, &s->buf, s->delim, (int)strlen(s->delim), s->max));
+  s->err = rc == -1 ? errno : 0;
+  CO_END(co);
+  return rc;
+}
+
+static int read_exact(struct co *co)
+{
+  struct session *s = (struct session *)co->arg;
+  int rc;
+  CO_BEGIN(co);
+  if (co_attach(co, s->fd) != 0)
+    return -1;
+  CO_AWAIT(co, rc, co_read_exact(co, s->fd, &s->buf, s->n));
+  s->err = rc == -1 ? errno : 0;
+  CO_END(co);
+  return rc;
+}
+
+class co_test : public ::testing::Test {
+protected:
+  struct reactor *r;
+  struct session s;
+  int peer;  // the other end of s.fd in the read tests
+
+  void SetUp() override
+  {
+    r = reactor_create(0);
+    ASSERT_TRUE(r != NULL);
+    s.fd = -1;
+    s.done = 0;
+    s.err = 0;
+    s.ms = -1;
+    peer = -1;
+    zb_init(&s.buf, 64);
+  }
+  void TearDown() override
+  {
+    if (s.fd >= 0) {
+      co_detach(&s.co, s.fd);
+      close(s.fd);
+    }
+    if (peer >= 0)
+      close(peer);
+    zb_destroy(&s.buf);
+    reactor_destroy(r);
+  }
+  // spawn fn and run the reactor until it finishes
+  int run(co_func fn)
+  {
+    co_spawn(&s.co, r, fn, &s, on_exit_session);
+    return wait_done();
+  }
+  int wait_done()
+  {
+    uint64_t end = reactor_now_ms() + 5000;
+    while (!s.done && reactor_now_ms() < end)
+      reactor_run_once(r, 50);
+    EXPECT_TRUE(s.done);
+    return s.rc;
+  }
+  // a few iterations, for a coroutine that must stay suspended
+  void spin()
+  {
+    for (int i = 0; i < 3; i++)
+      reactor_run_once(r, 10);
+  }
+  // s.fd is a non-blocking socketpair end, attached by the coroutine
+  void pair()
+  {
+    int sv[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv), 0);
+    s.fd = sv[0];
+    peer = sv[1];
+  }
+  void send_peer(const std::string &data)
+  {
+    ASSERT_EQ(write(peer, data.data(), data.size()), (ssize_t)data.size());
+  }
+  std::string buffered() const
+  {
+    return std::string(zb_data(&s.buf), (size_t)zb_available(&s.buf));
+  }
+};
+
+TEST_F(co_test, dial_connects)
+{
+  int port, l = listen_loopback(16, &port);
+  ASSERT_GE(l, 0);
+  s.network = "tcp4";
+  s.address = "127.0.0.1:" + std::to_string(port);
+  s.ms = 1000;
+  EXPECT_GE(run(dial), 0);
+  EXPECT_EQ(s.err, 0);
+  EXPECT_FALSE(reactor_timer_armed(&s.co.timer));
+  EXPECT_EQ(s.co.dial_ep.addrs, (struct endpoint_addr *)NULL);
+  close(l);
+}
+
+TEST_F(co_test, dial_refused)
+{
+  s.network = "tcp4";
+  s.address = "127.0.0.1:" + std::to_string(closed_port());
+  s.ms = 1000;
+  EXPECT_EQ(run(dial), -1);
+  EXPECT_EQ(s.err, ECONNREFUSED);
+  EXPECT_FALSE(reactor_timer_armed(&s.co.timer));
+}
+
+TEST_F(co_test, dial_tries_next_address)
+{
+  // ":port" resolves to [::1] then 127.0.0.1, only the second listens
+  int port, l = listen_loopback(16, &port);
+  ASSERT_GE(l, 0);
+  s.network = "tcp";
+  s.address = ":" + std::to_string(port);
+  s.ms = 1000;
+  EXPECT_GE(run(dial), 0);
+  EXPECT_EQ(s.err, 0);
+  struct sockaddr_storage peer_addr;
+  socklen_t len = sizeof(peer_addr);
+  ASSERT_EQ(getpeername(s.fd, (struct sockaddr *)&peer_addr, &len), 0);
+  EXPECT_EQ(peer_addr.ss_family, AF_INET);
+  close(l);
+}
+
+TEST_F(co_test, dial_timeout)
+{
+  // backlog 0 with one connection queued: the next SYNs are dropped
+  int port, l = listen_loopback(0, &port);
+  ASSERT_GE(l, 0);
+  int filler = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  struct sockaddr_in a = {};
+  a.sin_family = AF_INET;
+  a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  a.sin_port = htons((uint16_t)port);
+  connect(filler, (struct sockaddr *)&a, sizeof(a));
+  usleep(20 * 1000);
+
+  s.network = "tcp4";
+  s.address = "127.0.0.1:" + std::to_string(port);
+  s.ms = 100;
+  uint64_t start = reactor_now_ms();
+  EXPECT_EQ(run(dial), -1);
+  EXPECT_EQ(s.err, ETIMEDOUT);
+  EXPECT_GE(reactor_now_ms() - start, 100u);
+  EXPECT_LT(reactor_now_ms() - start, 1000u);
+  close(filler);
+  close(l);
+}
+
+TEST_F(co_test, dial_unresolvable)
+{
+  s.network = "tcp4";
+  s.address = "1.2.3.4:99999";
+  EXPECT_EQ(run(dial), -1);
+  EXPECT_EQ(s.err, EINVAL);
+}
+
+TEST_F(co_test, read_until_across_suspensions)
+{
+  pair();
+  s.delim = "\r\n";
+  s.max = 1024;
+  EXPECT_EQ(co_spawn(&s.co, r, read_until, &s, on_exit_session), CO_AGAIN);
+  send_peer("GET / HTTP/1.1\r");
+  spin();
+  EXPECT_FALSE(s.done);
+  // the delimiter straddles two reads
+  send_peer("\nHost: x\r\n");
+  EXPECT_EQ(wait_done(), 16);
+  EXPECT_EQ(buffered().substr(0, 16), "GET / HTTP/1.1\r\n");
+}
+
+TEST_F(co_test, read_until_max)
+{
+  pair();
+  s.delim = "\n";
+  s.max = 8;
+  send_peer("0123456789abcdef");
+  EXPECT_EQ(run(read_until), -1);
+  EXPECT_EQ(s.err, EMSGSIZE);
+}
+
+TEST_F(co_test, read_until_eof)
+{
+  pair();
+  s.delim = "\n";
+  s.max = 1024;
+  send_peer("no newline");
+  shutdown(peer, SHUT_WR);
+  EXPECT_EQ(run(read_until), 0);
+}
+
+TEST_F(co_test, read_exact_grows_buffer)
+{
+  pair();
+  // more than the buffer holds, delivered in pieces
+  std::string data(10000, 'x');
+  for (size_t i = 0; i < data.size(); i++)
+    data[i] = (char)('a' + i % 26);
+  s.n = (int)data.size();
+  EXPECT_EQ(co_spawn(&s.co, r, read_exact, &s, on_exit_session), CO_AGAIN);
+  for (size_t off = 0; off < data.size(); off += 3000) {
+    EXPECT_FALSE(s.done);
+    send_peer(data.substr(off, 3000));
+    spin();
+  }
+  EXPECT_EQ(wait_done(), (int)data.size());
+  EXPECT_EQ(buffered(), data);
+}
+
+TEST_F(co_test, read_deadline)
+{
+  pair();
+  s.n = 4;
+  EXPECT_EQ(co_spawn(&s.co, r, read_exact, &s, on_exit_session), CO_AGAIN);
+  ASSERT_EQ(co_set_deadline(&s.co, 30), 0);
+  send_peer("ab");
+  EXPECT_EQ(wait_done(), -1);
+  EXPECT_EQ(s.err, ETIMEDOUT);
+}
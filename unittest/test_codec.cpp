@@ -0,0 +1,194 @@
+// round trips and malformed input of the compression stage
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <string>
+#include <gtest/gtest.h>
+extern "C" {
+#include "../zbytes.h"
+}
+#include "../codec.h"
+
+static std::string text(size_t n)
+{
+  static const char words[] = "the quick brown fox jumps over the lazy dog ";
+  std::string s;
+  while (s.size() < n)
+    s += words;
+  s.resize(n);
+  return s;
+}
+
+static std::string noise(size_t n)
+{
+  std::string s(n, '\0');
+  uint32_t x = 2463534242u;
+  for (size_t i = 0; i < n; i++) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    s[i] = (char)x;
+  }
+  return s;
+}
+
+class codec_test : public ::testing::Test {
+protected:
+  struct codec enc, dec;
+  struct zbytes wire, plain;
+
+  void SetUp() override
+  {
+    ASSERT_EQ(codec_init(&enc, NULL), 0);
+    ASSERT_EQ(codec_init(&dec, NULL), 0);
+    zb_init(&wire, 1024);
+    zb_init(&plain, 1024);
+  }
+  void TearDown() override
+  {
+    codec_destroy(&enc);
+    codec_destroy(&dec);
+    zb_destroy(&wire);
+    zb_destroy(&plain);
+    codec_thread_release();
+  }
+  std::string decoded() const
+  {
+    return std::string(zb_data(&plain), (size_t)zb_available(&plain));
+  }
+  // a block header at the start of wire
+  void header(uint32_t wire_len, uint32_t plain_len)
+  {
+    uint32_t h[2] = { htonl(wire_len), htonl(plain_len) };
+    zb_reserve(&wire, sizeof(h));
+    zb_append(&wire, h, sizeof(h));
+  }
+};
+
+TEST_F(codec_test, deflated_round_trip)
+{
+  std::string msg = text(10000);
+  ASSERT_EQ(codec_encode(&enc, &wire, msg.data(), (int)msg.size()), 0);
+  EXPECT_EQ(enc.stats.deflated, 1u);
+  EXPECT_LT(zb_available(&wire), (int)msg.size() / 4);
+  EXPECT_EQ(codec_decode(&dec, &wire, &plain), (int)msg.size());
+  EXPECT_EQ(decoded(), msg);
+  EXPECT_TRUE(zb_empty(&wire));
+}
+
+TEST_F(codec_test, stored_round_trip)
+{
+  std::string small = text(100), random = noise(5000);
+  ASSERT_EQ(codec_encode(&enc, &wire, small.data(), (int)small.size()), 0);
+  ASSERT_EQ(codec_encode(&enc, &wire, random.data(), (int)random.size()), 0);
+  ASSERT_EQ(codec_encode(&enc, &wire, "", 0), 0);
+  // below min_size, and does not shrink
+  EXPECT_EQ(enc.stats.stored, 3u);
+  EXPECT_EQ(codec_decode(&dec, &wire, &plain), (int)(small.size() + random.size()));
+  EXPECT_EQ(decoded(), small + random);
+}
+
+TEST_F(codec_test, batch_round_trip)
+{
+  struct codec_options opts = {};
+  opts.mode = CODEC_PER_BATCH;
+  codec_destroy(&enc);
+  ASSERT_EQ(codec_init(&enc, &opts), 0);
+  std::string all;
+  for (int i = 0; i < 100; i++) {
+    std::string msg = text((size_t)(50 + i));
+    all += msg;
+    ASSERT_EQ(codec_encode(&enc, &wire, msg.data(), (int)msg.size()), 0);
+  }
+  EXPECT_TRUE(zb_empty(&wire));
+  ASSERT_EQ(codec_flush(&enc, &wire), 0);
+  EXPECT_EQ(enc.stats.deflated, 1u);
+  EXPECT_EQ(codec_decode(&dec, &wire, &plain), (int)all.size());
+  EXPECT_EQ(decoded(), all);
+}
+
+TEST_F(codec_test, partial_blocks)
+{
+  std::string msg = text(3000) + noise(3000);
+  ASSERT_EQ(codec_encode(&enc, &wire, msg.data(), 3000), 0);
+  ASSERT_EQ(codec_encode(&enc, &wire, msg.data() + 3000, 3000), 0);
+  // hand the wire bytes over one at a time, as short reads would
+  std::string bytes(zb_data(&wire), (size_t)zb_available(&wire));
+  struct zbytes in;
+  zb_init(&in, 16);
+  int total = 0;
+  for (char c : bytes) {
+    ASSERT_EQ(zb_reserve(&in, 1), 0);
+    zb_append_char(&in, c);
+    int n = codec_decode(&dec, &in, &plain);
+    ASSERT_GE(n, 0);
+    total += n;
+  }
+  EXPECT_EQ(total, (int)msg.size());
+  EXPECT_EQ(decoded(), msg);
+  zb_destroy(&in);
+}
+
+TEST_F(codec_test, corrupt_header)
+{
+  header(CODEC_MAX_BLOCK + 1, 10);
+  errno = 0;
+  EXPECT_EQ(codec_decode(&dec, &wire, &plain), -1);
+  EXPECT_EQ(errno, EPROTO);
+
+  zb_zero(&wire);
+  header(10 | CODEC_BLOCK_DEFLATE, CODEC_MAX_BLOCK + 1);
+  errno = 0;
+  EXPECT_EQ(codec_decode(&dec, &wire, &plain), -1);
+  EXPECT_EQ(errno, EPROTO);
+
+  // a stored block cannot change its length
+  zb_zero(&wire);
+  header(4, 5);
+  zb_reserve(&wire, 4);
+  zb_append(&wire, "abcd", 4);
+  errno = 0;
+  EXPECT_EQ(codec_decode(&dec, &wire, &plain), -1);
+  EXPECT_EQ(errno, EPROTO);
+}
+
+TEST_F(codec_test, short_block)
+{
+  std::string msg = text(4000);
+  ASSERT_EQ(codec_encode(&enc, &wire, msg.data(), (int)msg.size()), 0);
+  ASSERT_EQ(enc.stats.deflated, 1u);
+  uint32_t *plain_len = (uint32_t *)(zb_data(&wire) + 4);
+
+  // the header claims more than the data inflates to
+  *plain_len = htonl((uint32_t)msg.size() + 1);
+  errno = 0;
+  EXPECT_EQ(codec_decode(&dec, &wire, &plain), -1);
+  EXPECT_EQ(errno, EPROTO);
+
+  // and less
+  *plain_len = htonl((uint32_t)msg.size() - 1);
+  errno = 0;
+  EXPECT_EQ(codec_decode(&dec, &wire, &plain), -1);
+  EXPECT_EQ(errno, EPROTO);
+}
+
+TEST_F(codec_test, corrupt_data)
+{
+  std::string msg = text(4000);
+  ASSERT_EQ(codec_encode(&enc, &wire, msg.data(), (int)msg.size()), 0);
+  // a deflate block with a truncated stream: the last byte is dropped
+  uint32_t *wire_len = (uint32_t *)zb_data(&wire);
+  uint32_t n = ntohl(*wire_len) & ~CODEC_BLOCK_DEFLATE;
+  *wire_len = htonl((n - 1) | CODEC_BLOCK_DEFLATE);
+  wire.limit--;
+  errno = 0;
+  EXPECT_EQ(codec_decode(&dec, &wire, &plain), -1);
+  EXPECT_EQ(errno, EPROTO);
+}
+
+TEST_F(codec_test, oversized_message)
+{
+  errno = 0;
+  EXPECT_EQ(codec_encode(&enc, &wire, "", CODEC_MAX_BLOCK + 1), -1);
+  EXPECT_EQ(errno, EMSGSIZE);
+}
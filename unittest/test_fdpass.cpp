@@ -0,0 +1,98 @@
+// SCM_RIGHTS round trips over a socketpair
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <gtest/gtest.h>
+#include "../fdpass.h"
+
+class fdpass_test : public ::testing::Test {
+protected:
+  int sv[2];
+
+  void SetUp() override
+  {
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+  }
+  void TearDown() override
+  {
+    close(sv[0]);
+    close(sv[1]);
+  }
+};
+
+static bool same_file(int a, int b)
+{
+  struct stat sa, sb;
+  return fstat(a, &sa) == 0 && fstat(b, &sb) == 0 &&
+         sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+}
+
+TEST_F(fdpass_test, round_trip)
+{
+  int p[2];
+  ASSERT_EQ(pipe(p), 0);
+  ASSERT_EQ(SendFds(sv[0], p, 2, "hello", 5), 5);
+
+  int fds[4], nfds = 4;
+  char buf[16] = {};
+  ASSERT_EQ(RecvFds(sv[1], fds, &nfds, buf, sizeof(buf)), 5);
+  EXPECT_STREQ(buf, "hello");
+  ASSERT_EQ(nfds, 2);
+  EXPECT_TRUE(same_file(fds[0], p[0]));
+  EXPECT_TRUE(same_file(fds[1], p[1]));
+  EXPECT_TRUE(fcntl(fds[0], F_GETFD) & FD_CLOEXEC);
+
+  // the received write end feeds the original read end
+  ASSERT_EQ(write(fds[1], "x", 1), 1);
+  char c = 0;
+  ASSERT_EQ(read(p[0], &c, 1), 1);
+  EXPECT_EQ(c, 'x');
+  for (int fd : { p[0], p[1], fds[0], fds[1] })
+    close(fd);
+}
+
+TEST_F(fdpass_test, no_payload)
+{
+  int fd = dup(0);
+  ASSERT_GE(fd, 0);
+  // one dummy byte goes along, the message is not an EOF
+  ASSERT_EQ(SendFds(sv[0], &fd, 1, NULL, 0), 1);
+  int got, n = 1;
+  ASSERT_EQ(RecvFds(sv[1], &got, &n, NULL, 0), 1);
+  ASSERT_EQ(n, 1);
+  EXPECT_TRUE(same_file(got, fd));
+  close(got);
+  close(fd);
+}
+
+TEST_F(fdpass_test, too_many)
+{
+  int fds[3];
+  for (int &fd : fds)
+    fd = dup(0);
+  ASSERT_EQ(SendFds(sv[0], fds, 3, "abc", 3), 3);
+  int got[2], n = 2;
+  char buf[4];
+  errno = 0;
+  EXPECT_EQ(RecvFds(sv[1], got, &n, buf, sizeof(buf)), -1);
+  EXPECT_EQ(errno, EMSGSIZE);
+  EXPECT_EQ(n, 0);
+  for (int fd : fds)
+    close(fd);
+
+  errno = 0;
+  EXPECT_EQ(SendFds(sv[0], fds, XNET_MAX_PASS_FDS + 1, NULL, 0), -1);
+  EXPECT_EQ(errno, EINVAL);
+}
+
+TEST_F(fdpass_test, eof)
+{
+  int got[1], n = 1;
+  char buf[4];
+  shutdown(sv[0], SHUT_WR);
+  EXPECT_EQ(RecvFds(sv[1], got, &n, buf, sizeof(buf)), 0);
+  EXPECT_EQ(n, 0);
+}
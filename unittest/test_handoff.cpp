@@ -0,0 +1,202 @@
+// hot restart handoff between two processes
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <string>
+#include <gtest/gtest.h>
+extern "C" {
+#include "../packet.h"
+}
+#include "../handoff.h"
+#include "../fdpass.h"
+
+// wire format of handoff.c, for a predecessor that gives up after the ACK
+struct handoff_msg {
+  uint32_t magic;
+  uint32_t type;
+  uint32_t length;
+  char name[HANDOFF_NAME_MAX];
+};
+#define HANDOFF_MAGIC 0x78484f46u
+enum { HELLO = 1, LISTENER, CONN, DONE, ACK, COMMIT };
+
+static int listen_loopback(int *port)
+{
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in a = {};
+  socklen_t len = sizeof(a);
+  a.sin_family = AF_INET;
+  a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(fd, (struct sockaddr *)&a, sizeof(a)) != 0 || listen(fd, 16) != 0 ||
+      getsockname(fd, (struct sockaddr *)&a, &len) != 0) {
+    close(fd);
+    return -1;
+  }
+  *port = ntohs(a.sin_port);
+  return fd;
+}
+
+static int local_port(int fd)
+{
+  struct sockaddr_in a = {};
+  socklen_t len = sizeof(a);
+  if (getsockname(fd, (struct sockaddr *)&a, &len) != 0)
+    return -1;
+  return ntohs(a.sin_port);
+}
+
+class handoff_test : public ::testing::Test {
+protected:
+  std::string path;
+  pid_t child;
+
+  void SetUp() override
+  {
+    path = "/tmp/xnet-handoff-" + std::to_string(getpid());
+    child = -1;
+  }
+  void TearDown() override
+  {
+    if (child > 0) {
+      kill(child, SIGKILL);
+      waitpid(child, NULL, 0);
+    }
+    unlink(path.c_str());
+  }
+  // exit status of the successor, -1 if it did not exit
+  int wait_child()
+  {
+    int status;
+    if (waitpid(child, &status, 0) != child)
+      return -1;
+    child = -1;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+  }
+};
+
+TEST_F(handoff_test, successor_adopts)
+{
+  int port, l = listen_loopback(&port);
+  ASSERT_GE(l, 0);
+  char name[HANDOFF_NAME_MAX];
+  std::string addr = "127.0.0.1:" + std::to_string(port);
+  ASSERT_GT(handoff_name(name, sizeof(name), "tcp4", addr.c_str()), 0);
+  int sv[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+  struct handler conn = {};
+  conn.sockfd = sv[0];
+  ASSERT_TRUE(zb_init(&conn.buffer, 64) != NULL);
+  memcpy(conn.buffer.data, "buffered", 8);
+  conn.buffer.limit = 8;
+
+  int hl = HandoffListen(path.c_str());
+  ASSERT_GE(hl, 0);
+  child = fork();
+  ASSERT_GE(child, 0);
+  if (child == 0) {
+    struct handoff_set set;
+    if (HandoffReceive(path.c_str(), &set, 2000) != 0)
+      _exit(1);
+    int fd = HandoffAdopt(&set, name);
+    if (fd == -1 || local_port(fd) != port)
+      _exit(2);
+    if (set.nconns != 1 || zb_available(&set.conns[0].buffer) != 8 ||
+        memcmp(zb_data(&set.conns[0].buffer), "buffered", 8) != 0)
+      _exit(3);
+    // the connection still talks to the same peer
+    if (write(set.conns[0].sockfd, "x", 1) != 1)
+      _exit(4);
+    HandoffRelease(&set);
+    _exit(0);
+  }
+  struct handoff_listener ls = {};
+  memcpy(ls.name, name, sizeof(name));
+  ls.fd = l;
+  EXPECT_EQ(HandoffServe(hl, &ls, 1, &conn, 1, 2000), 0);
+  EXPECT_EQ(wait_child(), 0);
+  char c;
+  EXPECT_EQ(read(sv[1], &c, 1), 1);
+  EXPECT_EQ(c, 'x');
+  close(hl);
+  close(l);
+  close(sv[0]);
+  close(sv[1]);
+  zb_destroy(&conn.buffer);
+}
+
+TEST_F(handoff_test, no_commit_releases)
+{
+  int hl = HandoffListen(path.c_str());
+  ASSERT_GE(hl, 0);
+  int st[2];
+  ASSERT_EQ(pipe(st), 0);
+  child = fork();
+  ASSERT_GE(child, 0);
+  if (child == 0) {
+    struct handoff_set set;
+    char rc = 0;
+    if (HandoffReceive(path.c_str(), &set, 2000) != -1)
+      rc = 1;
+    else if (set.nlisteners != 0 || set.listeners != NULL)
+      rc = 2;
+    // stay alive, so only HandoffRelease() can have closed what it got
+    if (write(st[1], &rc, 1) != 1)
+      _exit(1);
+    pause();
+    _exit(0);
+  }
+  close(st[1]);
+  // a predecessor that times out on the ACK: sends everything, reads the
+  // ACK too late and closes without committing
+  int sockfd = accept4(hl, NULL, NULL, SOCK_CLOEXEC);
+  ASSERT_GE(sockfd, 0);
+  struct handoff_msg msg = {};
+  int fd = -1, nfds = 1;
+  ASSERT_EQ(RecvFds(sockfd, &fd, &nfds, &msg, sizeof(msg)), (int)sizeof(msg));
+  EXPECT_EQ(msg.type, (uint32_t)HELLO);
+  // the successor holds the only copy of the write end once it gets it
+  int p[2];
+  ASSERT_EQ(pipe2(p, O_NONBLOCK), 0);
+  memset(&msg, 0, sizeof(msg));
+  msg.magic = HANDOFF_MAGIC;
+  msg.type = LISTENER;
+  snprintf(msg.name, sizeof(msg.name), "tcp4 127.0.0.1:1");
+  ASSERT_EQ(SendFds(sockfd, &p[1], 1, &msg, sizeof(msg)), (int)sizeof(msg));
+  close(p[1]);
+  msg.type = DONE;
+  ASSERT_EQ(SendFds(sockfd, NULL, 0, &msg, sizeof(msg)), (int)sizeof(msg));
+  nfds = 1;
+  ASSERT_EQ(RecvFds(sockfd, &fd, &nfds, &msg, sizeof(msg)), (int)sizeof(msg));
+  EXPECT_EQ(msg.type, (uint32_t)ACK);
+  // the successor must still be waiting for the commit
+  usleep(50 * 1000);
+  char c;
+  EXPECT_EQ(read(p[0], &c, 1), -1);
+  EXPECT_EQ(errno, EAGAIN);
+  close(sockfd);
+
+  char rc = -1;
+  EXPECT_EQ(read(st[0], &rc, 1), 1);
+  EXPECT_EQ(rc, 0);
+  // it gave the descriptor back
+  EXPECT_EQ(read(p[0], &c, 1), 0);
+  close(p[0]);
+  close(st[0]);
+  close(hl);
+}
+
+TEST_F(handoff_test, no_predecessor)
+{
+  struct handoff_set set;
+  EXPECT_EQ(HandoffReceive(path.c_str(), &set, 100), -1);
+  EXPECT_EQ(set.nlisteners, 0);
+  EXPECT_EQ(set.nconns, 0);
+}
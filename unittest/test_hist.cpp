@@ -0,0 +1,125 @@
+// bucket boundaries and percentiles of the log-linear histogram
+
+#include <stdlib.h>
+#include <gtest/gtest.h>
+#include "../hist.h"
+
+static struct hist *hist_new(void)
+{
+  struct hist *h = (struct hist *)malloc(sizeof(*h));
+  hist_init(h);
+  return h;
+}
+
+TEST(hist, empty)
+{
+  struct hist *h = hist_new();
+  EXPECT_EQ(hist_percentile(h, 50), 0u);
+  EXPECT_EQ(hist_percentile(h, 100), 0u);
+  EXPECT_EQ(hist_mean(h), 0.0);
+  free(h);
+}
+
+TEST(hist, exact_below_128)
+{
+  // every value below 2 << HIST_SUB_BITS has its own bucket
+  for (uint64_t v = 0; v < 128; v++) {
+    struct hist *h = hist_new();
+    hist_record(h, v);
+    hist_record(h, 1000000);
+    EXPECT_EQ(hist_percentile(h, 50), v);
+    free(h);
+  }
+}
+
+TEST(hist, bucket_boundaries)
+{
+  // from 128 on, buckets are 1/64 of their power of two wide
+  struct {
+    uint64_t value;
+    uint64_t highest;
+  } cases[] = {
+    { 128, 129 }, { 129, 129 }, { 130, 131 }, { 255, 255 },
+    { 256, 259 }, { 259, 259 }, { 260, 263 },
+    { 1 << 20, (1 << 20) + (1 << 14) - 1 },
+    { (1ULL << 40) - 1, (1ULL << 40) - 1 },
+  };
+  for (auto &c : cases) {
+    struct hist *h = hist_new();
+    hist_record(h, c.value);
+    // a larger max, so the percentile is not capped at the value
+    hist_record(h, UINT64_MAX);
+    EXPECT_EQ(hist_percentile(h, 50), c.highest) << c.value;
+    free(h);
+  }
+}
+
+TEST(hist, relative_error)
+{
+  struct hist *h = hist_new();
+  for (uint64_t v = 1; v < (1ULL << 62); v = v * 3 + 1) {
+    hist_init(h);
+    hist_record(h, v);
+    hist_record(h, UINT64_MAX);
+    uint64_t got = hist_percentile(h, 50);
+    EXPECT_GE(got, v);
+    EXPECT_LE((double)(got - v), (double)v / 64) << v;
+  }
+  free(h);
+}
+
+TEST(hist, max_value)
+{
+  struct hist *h = hist_new();
+  hist_record(h, UINT64_MAX);
+  EXPECT_EQ(hist_percentile(h, 50), UINT64_MAX);
+  EXPECT_EQ(h->min, UINT64_MAX);
+  free(h);
+}
+
+TEST(hist, percentiles)
+{
+  struct hist *h = hist_new();
+  for (uint64_t v = 1; v <= 100; v++)
+    hist_record(h, v);
+  EXPECT_EQ(hist_percentile(h, 0), 1u);
+  EXPECT_EQ(hist_percentile(h, 1), 1u);
+  EXPECT_EQ(hist_percentile(h, 50), 50u);
+  EXPECT_EQ(hist_percentile(h, 50.5), 51u);
+  EXPECT_EQ(hist_percentile(h, 99), 99u);
+  EXPECT_EQ(hist_percentile(h, 99.9), 100u);
+  EXPECT_EQ(hist_percentile(h, 100), 100u);
+  EXPECT_DOUBLE_EQ(hist_mean(h), 50.5);
+  EXPECT_EQ(h->min, 1u);
+  EXPECT_EQ(h->max, 100u);
+  free(h);
+}
+
+TEST(hist, capped_at_max)
+{
+  // 1000 lands in the bucket [1000, 1007], the report stays at the max
+  struct hist *h = hist_new();
+  hist_record_n(h, 1000, 10);
+  EXPECT_EQ(hist_percentile(h, 50), 1000u);
+  free(h);
+}
+
+TEST(hist, merge)
+{
+  struct hist *a = hist_new(), *b = hist_new();
+  hist_record_n(a, 10, 90);
+  hist_record_n(b, 5000, 10);
+  hist_merge(a, b);
+  EXPECT_EQ(a->count, 100u);
+  EXPECT_EQ(a->min, 10u);
+  EXPECT_EQ(a->max, 5000u);
+  EXPECT_EQ(hist_percentile(a, 90), 10u);
+  EXPECT_EQ(hist_percentile(a, 91), 5000u);
+  // merging an empty one changes nothing
+  hist_init(b);
+  hist_merge(a, b);
+  EXPECT_EQ(a->count, 100u);
+  EXPECT_EQ(a->min, 10u);
+  free(a);
+  free(b);
+}
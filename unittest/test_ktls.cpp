@@ -0,0 +1,148 @@
+// kTLS key derivation against a userspace OpenSSL peer on loopback
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <string>
+#include <gtest/gtest.h>
+#include <openssl/evp.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include "../ktls.h"
+
+// self-signed P-256 certificate for 127.0.0.1, kept in memory
+static int use_self_signed(SSL_CTX *ctx)
+{
+  EVP_PKEY *key = EVP_EC_gen("P-256");
+  X509 *x = X509_new();
+  int rc = -1;
+  if (key && x) {
+    X509_set_version(x, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(x), 1);
+    X509_gmtime_adj(X509_getm_notBefore(x), 0);
+    X509_gmtime_adj(X509_getm_notAfter(x), 3600);
+    X509_set_pubkey(x, key);
+    X509_NAME *name = X509_get_subject_name(x);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *)"127.0.0.1", -1, -1, 0);
+    X509_set_issuer_name(x, name);
+    if (X509_sign(x, key, EVP_sha256()) > 0 && SSL_CTX_use_certificate(ctx, x) == 1 &&
+        SSL_CTX_use_PrivateKey(ctx, key) == 1)
+      rc = 0;
+  }
+  X509_free(x);
+  EVP_PKEY_free(key);
+  return rc;
+}
+
+struct server {
+  int listen_fd;
+  struct ktls_ctx *ctx;
+  int fd;
+  int err;
+};
+
+static void *serve(void *arg)
+{
+  struct server *s = (struct server *)arg;
+  s->fd = AcceptTLS(s->listen_fd, s->ctx);
+  s->err = s->fd == -1 ? errno : 0;
+  return NULL;
+}
+
+class ktls_test : public ::testing::TestWithParam<int> {
+protected:
+  struct server srv;
+  SSL_CTX *client_ctx;
+  SSL *client;
+  int client_fd;
+
+  void SetUp() override
+  {
+    srv.ctx = ktls_ctx_server(NULL, NULL);
+    ASSERT_TRUE(srv.ctx != NULL);
+    ASSERT_EQ(use_self_signed((SSL_CTX *)ktls_ctx_ssl_ctx(srv.ctx)), 0);
+    srv.listen_fd = ListenTLS("tls4", "127.0.0.1:0");
+    ASSERT_GE(srv.listen_fd, 0);
+    srv.fd = -1;
+    // the peer stays in userspace: it checks the keys the kernel got
+    client_ctx = SSL_CTX_new(TLS_client_method());
+    ASSERT_TRUE(client_ctx != NULL);
+    SSL_CTX_set_min_proto_version(client_ctx, GetParam());
+    SSL_CTX_set_max_proto_version(client_ctx, GetParam());
+    client = NULL;
+    client_fd = -1;
+  }
+  void TearDown() override
+  {
+    SSL_free(client);
+    SSL_CTX_free(client_ctx);
+    if (client_fd >= 0)
+      close(client_fd);
+    if (srv.fd >= 0)
+      close(srv.fd);
+    close(srv.listen_fd);
+    ktls_ctx_free(srv.ctx);
+  }
+  // handshake with the server thread. 0 : the server offloaded the fd,
+  // ENOPROTOOPT: it got as far as installing the keys, errno otherwise
+  int handshake()
+  {
+    struct sockaddr_in a = {};
+    socklen_t len = sizeof(a);
+    pthread_t th;
+    EXPECT_EQ(getsockname(srv.listen_fd, (struct sockaddr *)&a, &len), 0);
+    EXPECT_EQ(pthread_create(&th, NULL, serve, &srv), 0);
+    client_fd = socket(AF_INET, SOCK_STREAM, 0);
+    EXPECT_EQ(connect(client_fd, (struct sockaddr *)&a, sizeof(a)), 0);
+    client = SSL_new(client_ctx);
+    SSL_set_fd(client, client_fd);
+    int ok = SSL_connect(client) == 1;
+    pthread_join(th, NULL);
+    EXPECT_TRUE(ok);
+    return srv.err;
+  }
+};
+
+TEST_P(ktls_test, kernel_records_match_openssl)
+{
+  int err = handshake();
+  if (err == ENOPROTOOPT)
+    GTEST_SKIP() << "no tls ULP in this kernel, handshake and key derivation passed";
+  ASSERT_EQ(err, 0) << strerror(err);
+  EXPECT_EQ(SSL_version(client), GetParam());
+
+  // kernel encrypts, OpenSSL decrypts
+  std::string out = "hello from the kernel";
+  ASSERT_EQ(send(srv.fd, out.data(), out.size(), 0), (ssize_t)out.size());
+  char buf[64];
+  int n = SSL_read(client, buf, sizeof(buf));
+  ASSERT_EQ(n, (int)out.size());
+  EXPECT_EQ(std::string(buf, (size_t)n), out);
+
+  // and the other way, over more than one record
+  std::string in(40000, 'k');
+  for (size_t i = 0; i < in.size(); i++)
+    in[i] = (char)('a' + i % 26);
+  ASSERT_EQ(SSL_write(client, in.data(), (int)in.size()), (int)in.size());
+  std::string got;
+  while (got.size() < in.size()) {
+    char chunk[8192];
+    ssize_t r = recv(srv.fd, chunk, sizeof(chunk), 0);
+    ASSERT_GT(r, 0) << strerror(errno);
+    got.append(chunk, (size_t)r);
+  }
+  EXPECT_EQ(got, in);
+}
+
+INSTANTIATE_TEST_SUITE_P(versions, ktls_test, ::testing::Values(TLS1_2_VERSION, TLS1_3_VERSION));
+
+TEST(ktls, tls_networks_only)
+{
+  errno = 0;
+  EXPECT_EQ(ListenTLS("tcp4", "127.0.0.1:0"), -1);
+  EXPECT_EQ(errno, EINVAL);
+}
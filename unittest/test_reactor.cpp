@@ -0,0 +1,216 @@
+// timer heap of the reactor: ordering, re-arming and cancellation, and
+// how timers and io meet the spin-then-block wait
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+#include <gtest/gtest.h>
+#include "../reactor.h"
+
+struct fired_timer {
+  struct reactor_timer timer;
+  struct reactor *r;
+  int id;
+  std::vector<int> *fired;
+  struct reactor_timer *cancel;  // stopped from the callback
+};
+
+static void on_timer(void *arg)
+{
+  struct fired_timer *t = (struct fired_timer *)arg;
+  t->fired->push_back(t->id);
+  if (t->cancel)
+    reactor_timer_stop(t->r, t->cancel);
+}
+
+class reactor_test : public ::testing::Test {
+protected:
+  struct reactor *r;
+  std::vector<int> fired;
+
+  void SetUp() override
+  {
+    r = reactor_create(0);
+    ASSERT_TRUE(r != NULL);
+  }
+  void TearDown() override
+  {
+    reactor_destroy(r);
+  }
+  void arm(struct fired_timer *t, int id, int timeout_ms)
+  {
+    t->r = r;
+    t->id = id;
+    t->fired = &fired;
+    t->cancel = NULL;
+    reactor_timer_init(&t->timer);
+    ASSERT_EQ(reactor_timer_start(r, &t->timer, timeout_ms, on_timer, t), 0);
+  }
+  // until fired holds n ids or limit_ms passed
+  void run_until(size_t n, int limit_ms)
+  {
+    uint64_t end = reactor_now_ms() + (uint64_t)limit_ms;
+    while (fired.size() < n && reactor_now_ms() < end)
+      ASSERT_GE(reactor_run_once(r, 100), 0);
+  }
+};
+
+TEST_F(reactor_test, timers_fire_in_deadline_order)
+{
+  struct fired_timer t[4];
+  arm(&t[0], 40, 40);
+  arm(&t[1], 10, 10);
+  arm(&t[2], 30, 30);
+  arm(&t[3], 20, 20);
+  uint64_t start = reactor_now_ms();
+  run_until(4, 1000);
+  EXPECT_EQ(fired, (std::vector<int>{10, 20, 30, 40}));
+  EXPECT_GE(reactor_now_ms() - start, 40u);
+  for (auto &x : t)
+    EXPECT_FALSE(reactor_timer_armed(&x.timer));
+}
+
+TEST_F(reactor_test, heap_order_many)
+{
+  const int n = 300;
+  std::vector<fired_timer> t(n);
+  std::vector<uint64_t> deadlines;
+  srand(7);
+  for (int i = 0; i < n; i++)
+    arm(&t[i], i, rand() % 50);
+  // cancel every third, from the root, the leaves and the middle
+  int left = n;
+  for (int i = 0; i < n; i += 3) {
+    reactor_timer_stop(r, &t[i].timer);
+    EXPECT_FALSE(reactor_timer_armed(&t[i].timer));
+    left--;
+  }
+  // stopping twice is harmless
+  reactor_timer_stop(r, &t[0].timer);
+  run_until((size_t)left, 1000);
+  ASSERT_EQ((int)fired.size(), left);
+  for (int id : fired) {
+    EXPECT_NE(id % 3, 0) << id;
+    deadlines.push_back(t[id].timer.deadline);
+  }
+  for (size_t i = 1; i < deadlines.size(); i++)
+    EXPECT_LE(deadlines[i - 1], deadlines[i]) << i;
+}
+
+TEST_F(reactor_test, rearm_moves_deadline)
+{
+  struct fired_timer a, b;
+  arm(&a, 1, 10);
+  arm(&b, 2, 20);
+  // later than b now
+  ASSERT_EQ(reactor_timer_start(r, &a.timer, 40, on_timer, &a), 0);
+  run_until(2, 1000);
+  EXPECT_EQ(fired, (std::vector<int>{2, 1}));
+}
+
+TEST_F(reactor_test, stop_from_callback)
+{
+  struct fired_timer a, b, c;
+  arm(&a, 1, 5);
+  arm(&b, 2, 5);
+  arm(&c, 3, 20);
+  // whichever of a and b fires first cancels the other
+  a.cancel = &b.timer;
+  b.cancel = &a.timer;
+  run_until(2, 1000);
+  ASSERT_EQ(fired.size(), 2u);
+  EXPECT_EQ(fired[1], 3);
+  // nothing left
+  run_until(3, 50);
+  EXPECT_EQ(fired.size(), 2u);
+}
+
+TEST_F(reactor_test, zero_timeout_runs_next_iteration)
+{
+  struct fired_timer a;
+  arm(&a, 1, 0);
+  EXPECT_EQ(reactor_run_once(r, -1), 0);
+  EXPECT_EQ(fired, std::vector<int>{1});
+}
+
+static void on_readable(struct reactor *r, int fd, uint32_t events, void *arg)
+{
+  char buf[16];
+  (void)r;
+  (void)events;
+  if (read(fd, buf, sizeof(buf)) > 0)
+    (*(int *)arg)++;
+}
+
+// writes a byte to the pipe after a delay
+struct late_writer {
+  int fd;
+  int delay_ms;
+};
+
+static void *write_late(void *arg)
+{
+  struct late_writer *w = (struct late_writer *)arg;
+  usleep((useconds_t)w->delay_ms * 1000);
+  ssize_t n = write(w->fd, "x", 1);
+  (void)n;
+  return NULL;
+}
+
+TEST_F(reactor_test, timer_cuts_the_spin_short)
+{
+  // a budget far longer than the timer
+  ASSERT_EQ(reactor_set_spin(r, 100000, 200000), 0);
+  struct fired_timer a;
+  arm(&a, 1, 5);
+  uint64_t start = reactor_now_ms();
+  run_until(1, 1000);
+  ASSERT_EQ(fired, std::vector<int>{1});
+  uint64_t took = reactor_now_ms() - start;
+  EXPECT_GE(took, 5u);
+  EXPECT_LT(took, 50u);
+  struct reactor_spin_stats st;
+  reactor_get_spin_stats(r, &st);
+  EXPECT_EQ(st.hits, 0u);
+  // each spin stopped at the timer and handed over to epoll_wait
+  EXPECT_GE(st.parks, 1u);
+  EXPECT_LT(st.spin_ns, 50000000u);
+}
+
+TEST_F(reactor_test, spin_hit_and_park)
+{
+  int p[2], reads = 0;
+  ASSERT_EQ(pipe(p), 0);
+  ASSERT_EQ(reactor_add(r, p[0], EPOLLIN, on_readable, &reads), 0);
+  ASSERT_EQ(reactor_set_spin(r, 1000, 2000), 0);
+  struct reactor_spin_stats st;
+
+  // ready before the wait: found spinning
+  ASSERT_EQ(write(p[1], "x", 1), 1);
+  EXPECT_EQ(reactor_run_once(r, 1000), 1);
+  reactor_get_spin_stats(r, &st);
+  EXPECT_EQ(st.hits, 1u);
+  EXPECT_EQ(st.parks, 0u);
+
+  // long after the budget ran out: blocked in epoll_wait instead
+  struct late_writer w = { p[1], 30 };
+  pthread_t th;
+  ASSERT_EQ(pthread_create(&th, NULL, write_late, &w), 0);
+  uint64_t start = reactor_now_ms();
+  EXPECT_EQ(reactor_run_once(r, 1000), 1);
+  uint64_t took = reactor_now_ms() - start;
+  pthread_join(th, NULL);
+  EXPECT_EQ(reads, 2);
+  EXPECT_GE(took, 25u);
+  reactor_get_spin_stats(r, &st);
+  EXPECT_EQ(st.hits, 1u);
+  EXPECT_EQ(st.parks, 1u);
+  // spun for the budget only, not the whole wait
+  EXPECT_LT(st.spin_ns, 15000000u);
+  EXPECT_LE(st.budget_us, 2000);
+
+  reactor_remove(r, p[0]);
+  close(p[0]);
+  close(p[1]);
+}
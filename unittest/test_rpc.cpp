@@ -0,0 +1,255 @@
+// pending table of the rpc client against a loopback server
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+extern "C" {
+#include "../zbytes.h"
+}
+#include "../rpc.h"
+
+struct result {
+  int index;
+  int err;
+  std::string data;
+};
+
+struct test_call {
+  struct rpc_call call;
+  int index;
+  int runs;
+  std::vector<result> *results;
+};
+
+static void on_done(struct rpc_call *call, int err, const char *data, int len)
+{
+  struct test_call *t = (struct test_call *)call->arg;
+  t->runs++;
+  t->results->push_back({ t->index, err, std::string(data ? data : "", (size_t)len) });
+}
+
+struct frame {
+  uint32_t id;
+  std::string data;
+};
+
+class rpc_test : public ::testing::Test {
+protected:
+  struct reactor *r;
+  struct rpc_client *c;
+  int l;
+  int server;  // accepted side of the client's connection
+  std::vector<test_call> calls;
+  std::vector<result> results;
+
+  void SetUp() override
+  {
+    r = reactor_create(0);
+    ASSERT_TRUE(r != NULL);
+    l = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in a = {};
+    socklen_t len = sizeof(a);
+    a.sin_family = AF_INET;
+    a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ASSERT_EQ(bind(l, (struct sockaddr *)&a, sizeof(a)), 0);
+    ASSERT_EQ(listen(l, 16), 0);
+    ASSERT_EQ(getsockname(l, (struct sockaddr *)&a, &len), 0);
+    struct Endpoint ep;
+    std::string addr = "127.0.0.1:" + std::to_string(ntohs(a.sin_port));
+    ASSERT_EQ(ResolveEndpoint(&ep, "tcp4", addr.c_str(), 0), 0);
+    c = rpc_client_create(r, &ep, 1, 0);
+    EndpointFree(&ep);
+    ASSERT_TRUE(c != NULL);
+    server = -1;
+    // no reallocation, the client holds pointers into it
+    calls.resize(256);
+  }
+  void TearDown() override
+  {
+    rpc_client_destroy(c);
+    if (server >= 0)
+      close(server);
+    close(l);
+    reactor_destroy(r);
+  }
+  // calls[i] sends its own index as the payload
+  void call(int i, int timeout_ms = 0)
+  {
+    struct test_call *t = &calls[(size_t)i];
+    std::string req = std::to_string(i);
+    t->index = i;
+    t->runs = 0;
+    t->results = &results;
+    ASSERT_EQ(rpc_call(c, &t->call, req.data(), (int)req.size(), timeout_ms, on_done, t), 0);
+  }
+  void run(int iterations)
+  {
+    for (int i = 0; i < iterations; i++)
+      ASSERT_GE(reactor_run_once(r, 10), 0);
+  }
+  void run_until(size_t n)
+  {
+    uint64_t end = reactor_now_ms() + 2000;
+    while (results.size() < n && reactor_now_ms() < end)
+      ASSERT_GE(reactor_run_once(r, 10), 0);
+  }
+  void accept_client()
+  {
+    server = accept(l, NULL, NULL);
+    ASSERT_GE(server, 0);
+    struct timeval tv = { 2, 0 };
+    setsockopt(server, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  }
+  void read_full(void *buf, size_t len)
+  {
+    for (size_t off = 0; off < len;) {
+      ssize_t n = recv(server, (char *)buf + off, len - off, 0);
+      ASSERT_GT(n, 0) << strerror(errno);
+      off += (size_t)n;
+    }
+  }
+  // the next n requests, flushing the client as it goes
+  std::vector<frame> receive(int n)
+  {
+    std::vector<frame> out;
+    run(2);
+    if (server == -1)
+      accept_client();
+    for (int i = 0; i < n; i++) {
+      uint32_t hdr[2];
+      read_full(hdr, sizeof(hdr));
+      frame f = { ntohl(hdr[1]), std::string(ntohl(hdr[0]), '\0') };
+      read_full(&f.data[0], f.data.size());
+      out.push_back(f);
+    }
+    return out;
+  }
+  void reply(const frame &f)
+  {
+    struct zbytes zb;
+    ASSERT_TRUE(zb_init(&zb, 64) != NULL);
+    ASSERT_EQ(rpc_append_frame(&zb, f.id, f.data.data(), (int)f.data.size()), 0);
+    ASSERT_EQ(send(server, zb_data(&zb), (size_t)zb_available(&zb), 0), zb_available(&zb));
+    zb_destroy(&zb);
+  }
+  struct rpc_client_stats stats()
+  {
+    struct rpc_client_stats st;
+    rpc_client_get_stats(c, &st);
+    return st;
+  }
+};
+
+TEST_F(rpc_test, out_of_order_completion)
+{
+  for (int i = 0; i < 3; i++)
+    call(i);
+  std::vector<frame> req = receive(3);
+  ASSERT_EQ(req.size(), 3u);
+  // one send() for the three of them
+  EXPECT_EQ(stats().writes, 1u);
+  reply(req[2]);
+  reply(req[0]);
+  reply(req[1]);
+  run_until(3);
+  ASSERT_EQ(results.size(), 3u);
+  int order[] = { 2, 0, 1 };
+  for (int i = 0; i < 3; i++) {
+    EXPECT_EQ(results[(size_t)i].index, order[i]);
+    EXPECT_EQ(results[(size_t)i].err, 0);
+    // the server echoes, so the payload says which request it answered
+    EXPECT_EQ(results[(size_t)i].data, std::to_string(order[i]));
+  }
+  EXPECT_EQ(stats().completed, 3u);
+  EXPECT_EQ(stats().late, 0u);
+}
+
+TEST_F(rpc_test, erase_shifts_probe_chain)
+{
+  // the first call stays in flight while the ids move on, until they wrap
+  // around the 64 slots and probe past it
+  call(0);
+  std::vector<frame> first = receive(1);
+  ASSERT_EQ(first[0].id, 1u);
+  for (int i = 1; i < 64; i++) {
+    call(i);
+    reply(receive(1)[0]);
+    run_until((size_t)i);
+  }
+  ASSERT_EQ(results.size(), 63u);
+  // ids 65, 66 and 67: homes 1, 2 and 3, displaced by one
+  for (int i = 64; i < 67; i++)
+    call(i);
+  std::vector<frame> chain = receive(3);
+  EXPECT_EQ(chain[0].id, 65u);
+  // erasing the head moves the chain back, the lookups still find it
+  reply(first[0]);
+  reply(chain[1]);
+  reply(chain[0]);
+  reply(chain[2]);
+  run_until(67);
+  ASSERT_EQ(results.size(), 67u);
+  EXPECT_EQ(results[63].index, 0);
+  EXPECT_EQ(results[64].index, 65);
+  EXPECT_EQ(results[65].index, 64);
+  EXPECT_EQ(results[66].index, 66);
+  for (auto &res : results) {
+    EXPECT_EQ(res.err, 0);
+    EXPECT_EQ(res.data, std::to_string(res.index));
+  }
+  EXPECT_EQ(stats().late, 0u);
+}
+
+TEST_F(rpc_test, deadline_expires)
+{
+  call(0, 30);
+  call(1);
+  std::vector<frame> req = receive(2);
+  run_until(1);
+  ASSERT_EQ(results.size(), 1u);
+  EXPECT_EQ(results[0].index, 0);
+  EXPECT_EQ(results[0].err, ETIMEDOUT);
+  EXPECT_EQ(stats().timeouts, 1u);
+  // the late response is dropped, the other call is unaffected
+  reply(req[0]);
+  reply(req[1]);
+  run_until(2);
+  ASSERT_EQ(results.size(), 2u);
+  EXPECT_EQ(results[1].index, 1);
+  EXPECT_EQ(results[1].err, 0);
+  EXPECT_EQ(calls[0].runs, 1);
+  EXPECT_EQ(stats().late, 1u);
+}
+
+TEST_F(rpc_test, connection_loss_fails_all)
+{
+  for (int i = 0; i < 5; i++)
+    call(i, 1000);
+  receive(5);
+  close(server);
+  server = -1;
+  run_until(5);
+  ASSERT_EQ(results.size(), 5u);
+  for (auto &res : results)
+    EXPECT_EQ(res.err, ECONNRESET);
+  for (int i = 0; i < 5; i++) {
+    EXPECT_EQ(calls[(size_t)i].runs, 1);
+    EXPECT_FALSE(reactor_timer_armed(&calls[(size_t)i].call.timer));
+  }
+  EXPECT_EQ(stats().failed, 5u);
+
+  // the next call dials again
+  call(5);
+  std::vector<frame> req = receive(1);
+  reply(req[0]);
+  run_until(6);
+  ASSERT_EQ(results.size(), 6u);
+  EXPECT_EQ(results[5].err, 0);
+}
@@ -0,0 +1,152 @@
+// the work-stealing deques and the inboxes of the scheduler
+
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <vector>
+#include <gtest/gtest.h>
+#include "../sched.h"
+
+struct spawn_task {
+  struct sched_task task;
+  struct sched *s;
+  int index;
+  int worker;  // that ran it
+  std::vector<int> *order;
+  std::vector<spawn_task> *children;
+  int *runs;
+};
+
+static void burn(int n)
+{
+  volatile int x = 0;
+  for (int i = 0; i < n; i++)
+    x = x + i;
+}
+
+static void child_run(struct sched_task *task)
+{
+  struct spawn_task *t = (struct spawn_task *)task;
+  t->worker = sched_current_worker();
+  __atomic_add_fetch(&t->runs[t->index], 1, __ATOMIC_RELAXED);
+  // only the worker that owns the deque appends, see lifo_on_owner
+  if (t->order)
+    t->order->push_back(t->index);
+  burn(2000);
+}
+
+// pushes every child on the deque of the worker it runs on
+static void root_run(struct sched_task *task)
+{
+  struct spawn_task *t = (struct spawn_task *)task;
+  t->worker = sched_current_worker();
+  for (auto &c : *t->children)
+    ASSERT_EQ(sched_submit(t->s, &c.task), 0);
+}
+
+static void init_task(struct spawn_task *t, struct sched *s, int index, sched_task_func func)
+{
+  memset(t, 0, sizeof(*t));
+  t->task.func = func;
+  t->s = s;
+  t->index = index;
+  t->worker = -1;
+}
+
+TEST(sched, lifo_on_owner)
+{
+  // more than the initial deque, so it grows while full
+  const int n = 1000;
+  struct sched *s = sched_create(1, SCHED_F_NOSTEAL);
+  ASSERT_TRUE(s != NULL);
+  std::vector<int> order, runs(n);
+  std::vector<spawn_task> children(n);
+  struct spawn_task root;
+  init_task(&root, s, 0, root_run);
+  root.children = &children;
+  for (int i = 0; i < n; i++) {
+    init_task(&children[i], s, i, child_run);
+    children[i].order = &order;
+    children[i].runs = runs.data();
+  }
+  ASSERT_EQ(sched_submit(s, &root.task), 0);
+  sched_destroy(s);
+
+  EXPECT_EQ(root.worker, 0);
+  ASSERT_EQ((int)order.size(), n);
+  for (int i = 0; i < n; i++)
+    EXPECT_EQ(order[i], n - 1 - i);
+}
+
+TEST(sched, steal_under_contention)
+{
+  const int n = 20000;
+  struct sched *s = sched_create(4, 0);
+  ASSERT_TRUE(s != NULL);
+  std::vector<int> runs(n);
+  std::vector<spawn_task> children(n);
+  struct spawn_task root;
+  init_task(&root, s, 0, root_run);
+  root.children = &children;
+  for (int i = 0; i < n; i++) {
+    init_task(&children[i], s, i, child_run);
+    children[i].runs = runs.data();
+  }
+  ASSERT_EQ(sched_submit(s, &root.task), 0);
+  // the owner pops from one end while the other workers steal from the
+  // other, sched_destroy() would run the rest on the way out
+  struct sched_stats st;
+  do {
+    sched_yield();
+    sched_get_stats(s, &st);
+  } while (st.executed < (uint64_t)n + 1);
+  sched_destroy(s);
+
+  // every task exactly once, whether the owner took it or a thief did
+  int on_other = 0;
+  for (int i = 0; i < n; i++) {
+    ASSERT_EQ(runs[i], 1) << i;
+    on_other += children[i].worker != root.worker;
+  }
+  EXPECT_GT(st.stolen, 0u);
+  EXPECT_GT(on_other, 0);
+}
+
+TEST(sched, external_submit_keeps_affinity)
+{
+  const int n = 1000, nworkers = 3;
+  struct sched *s = sched_create(nworkers, SCHED_F_NOSTEAL);
+  ASSERT_TRUE(s != NULL);
+  EXPECT_EQ(sched_nworkers(s), nworkers);
+  EXPECT_EQ(sched_current_worker(), -1);
+  std::vector<int> runs(n);
+  std::vector<spawn_task> tasks(n);
+  for (int i = 0; i < n; i++) {
+    init_task(&tasks[i], s, i, child_run);
+    tasks[i].runs = runs.data();
+    tasks[i].task.affinity = (unsigned)i;
+  }
+  // several submitting threads race on the inboxes
+  std::vector<pthread_t> th(4);
+  struct submitter {
+    struct sched *s;
+    std::vector<spawn_task> *tasks;
+    int first;
+  } sub[4];
+  for (int k = 0; k < 4; k++) {
+    sub[k] = { s, &tasks, k };
+    pthread_create(&th[k], NULL, [](void *arg) -> void * {
+      struct submitter *sb = (struct submitter *)arg;
+      for (size_t i = (size_t)sb->first; i < sb->tasks->size(); i += 4)
+        sched_submit(sb->s, &(*sb->tasks)[i].task);
+      return NULL;
+    }, &sub[k]);
+  }
+  for (auto &t : th)
+    pthread_join(t, NULL);
+  sched_destroy(s);
+  for (int i = 0; i < n; i++) {
+    ASSERT_EQ(runs[i], 1) << i;
+    EXPECT_EQ(tasks[i].worker, i % nworkers) << i;
+  }
+}
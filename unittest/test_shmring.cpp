@@ -0,0 +1,187 @@
+// the shared-memory rings: handshake, wraparound and corrupt indexes
+
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <gtest/gtest.h>
+extern "C" {
+#include "../zbytes.h"
+}
+#include "../shmring.h"
+
+// the ring indexes, as laid out in shmring.c
+struct ring_ctl {
+  uint64_t head __attribute__((aligned(64)));
+  uint32_t writer_waiting;
+  uint64_t tail __attribute__((aligned(64)));
+  uint32_t reader_waiting;
+};
+
+class shmring_test : public ::testing::Test {
+protected:
+  // a writes on its tx, b reads it on its rx, and the other way round
+  struct shm_channel a, b;
+  size_t size;
+
+  void SetUp() override
+  {
+    int sv[2];
+    size = (size_t)sysconf(_SC_PAGESIZE);
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    ASSERT_EQ(shm_channel_offer(&a, sv[0], size), 0);
+    ASSERT_EQ(shm_channel_accept(&b, sv[1]), 0);
+    close(sv[0]);
+    close(sv[1]);
+    ASSERT_EQ(a.tx.size, size);
+    ASSERT_EQ(b.rx.size, size);
+  }
+  void TearDown() override
+  {
+    shm_channel_close(&a);
+    shm_channel_close(&b);
+  }
+};
+
+TEST_F(shmring_test, both_directions)
+{
+  struct zbytes zb;
+  zb_init(&zb, 64);
+  EXPECT_EQ(shm_channel_write(&a, "ping", 4), 4);
+  EXPECT_EQ(shm_channel_read(&b, &zb), 4);
+  EXPECT_EQ(std::string(zb_data(&zb), 4), "ping");
+  zb_zero(&zb);
+  EXPECT_EQ(shm_channel_write(&b, "pong", 4), 4);
+  EXPECT_EQ(shm_channel_read(&a, &zb), 4);
+  EXPECT_EQ(std::string(zb_data(&zb), 4), "pong");
+  // empty
+  EXPECT_EQ(shm_channel_read(&a, &zb), 0);
+  zb_destroy(&zb);
+}
+
+TEST_F(shmring_test, contiguous_across_the_end)
+{
+  std::string fill(size - 100, 'f');
+  ASSERT_EQ(shm_channel_write(&a, fill.data(), (int)fill.size()), (int)fill.size());
+  int len;
+  shm_channel_read_begin(&b, &len);
+  ASSERT_EQ(len, (int)fill.size());
+  shm_channel_read_commit(&b, len);
+
+  // the whole ring is free and one span, though it wraps after 100 bytes
+  char *w = shm_channel_write_begin(&a, &len);
+  ASSERT_EQ(len, (int)size);
+  std::string msg(size, '\0');
+  for (size_t i = 0; i < size; i++)
+    msg[i] = (char)(i * 7);
+  memcpy(w, msg.data(), size);
+  shm_channel_write_commit(&a, len);
+  EXPECT_EQ(shm_channel_write(&a, "x", 1), 0);
+
+  const char *r = shm_channel_read_begin(&b, &len);
+  ASSERT_EQ(len, (int)size);
+  EXPECT_EQ(std::string(r, size), msg);
+  shm_channel_read_commit(&b, len);
+}
+
+struct spsc {
+  struct shm_channel *ch;
+  uint64_t total;
+  int failed;
+};
+
+// writes total bytes of a counter pattern in uneven pieces
+static void *producer(void *arg)
+{
+  struct spsc *p = (struct spsc *)arg;
+  uint64_t sent = 0;
+  unsigned piece = 1;
+  while (sent < p->total) {
+    int room;
+    char *w = shm_channel_write_begin(p->ch, &room);
+    if (!w) {
+      p->failed = 1;
+      break;
+    }
+    if (room == 0) {
+      shm_channel_wait(p->ch, SHM_WAIT_WRITE, 1000);
+      continue;
+    }
+    piece = piece * 1103515245 + 12345;
+    uint64_t n = 1 + (piece >> 8) % 3000;
+    if (n > (uint64_t)room)
+      n = (uint64_t)room;
+    if (n > p->total - sent)
+      n = p->total - sent;
+    for (uint64_t i = 0; i < n; i++)
+      w[i] = (char)((sent + i) % 251);
+    shm_channel_write_commit(p->ch, (int)n);
+    sent += n;
+  }
+  return NULL;
+}
+
+TEST_F(shmring_test, spsc_wraparound)
+{
+  // thousands of laps around a one page ring, reader and writer racing
+  struct spsc p = { &a, 8 << 20, 0 };
+  pthread_t th;
+  ASSERT_EQ(pthread_create(&th, NULL, producer, &p), 0);
+  uint64_t got = 0, bad = 0;
+  while (got < p.total && !HasFatalFailure()) {
+    int len;
+    const char *r = shm_channel_read_begin(&b, &len);
+    ASSERT_TRUE(r != NULL);
+    if (len == 0) {
+      ASSERT_GE(shm_channel_wait(&b, SHM_WAIT_READ, 1000), 0);
+      continue;
+    }
+    ASSERT_LE(len, (int)size);
+    for (int i = 0; i < len; i++)
+      bad += (unsigned char)r[i] != (got + (uint64_t)i) % 251;
+    // release a part only, so the spans start anywhere
+    int n = len > 1 ? len / 2 + 1 : len;
+    shm_channel_read_commit(&b, n);
+    got += (uint64_t)n;
+  }
+  pthread_join(th, NULL);
+  EXPECT_EQ(got, p.total);
+  EXPECT_EQ(bad, 0u);
+  EXPECT_EQ(p.failed, 0);
+}
+
+TEST_F(shmring_test, corrupt_indexes)
+{
+  // b's mapping of the ring a writes to, as a peer would scribble on it
+  struct ring_ctl *rx = (struct ring_ctl *)b.rx.ctl;
+  struct zbytes zb;
+  zb_init(&zb, 64);
+  int len = -1;
+
+  // a head more than a ring ahead of the tail
+  rx->head = rx->tail + size + 1;
+  errno = 0;
+  EXPECT_EQ(shm_channel_read_begin(&b, &len), (const char *)NULL);
+  EXPECT_EQ(errno, EPROTO);
+  EXPECT_EQ(len, 0);
+  EXPECT_EQ(shm_channel_read(&b, &zb), -1);
+  EXPECT_EQ(shm_channel_prepare_wait(&b, SHM_WAIT_READ), 1);
+  // the writer sees it as well instead of a negative-wrapped room
+  EXPECT_EQ(shm_channel_write_begin(&a, &len), (char *)NULL);
+  EXPECT_EQ(shm_channel_write(&a, "x", 1), -1);
+
+  // a tail past the head
+  rx->head = 10;
+  rx->tail = 11;
+  EXPECT_EQ(shm_channel_read_begin(&b, &len), (const char *)NULL);
+  EXPECT_EQ(shm_channel_write_begin(&a, &len), (char *)NULL);
+
+  // exactly full is fine
+  rx->tail = 10;
+  rx->head = 10 + size;
+  EXPECT_TRUE(shm_channel_read_begin(&b, &len) != NULL);
+  EXPECT_EQ(len, (int)size);
+  EXPECT_TRUE(shm_channel_write_begin(&a, &len) != NULL);
+  EXPECT_EQ(len, 0);
+  zb_destroy(&zb);
+}
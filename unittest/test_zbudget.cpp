@@ -0,0 +1,182 @@
+// soft limit backpressure and the hard limit of the zbytes memory budget
+
+#include <errno.h>
+#include <gtest/gtest.h>
+extern "C" {
+#include "../zbytes.h"
+}
+#include "../zbudget.h"
+
+#define KB 1024
+
+struct budget_conn {
+  struct zb_budget_conn bc;
+  struct zbytes buf;
+  int pauses;
+  int resumes;
+};
+
+static void on_pause(struct zb_budget_conn *c, int paused)
+{
+  struct budget_conn *bc = (struct budget_conn *)c->arg;
+  if (paused)
+    bc->pauses++;
+  else
+    bc->resumes++;
+}
+
+class zbudget_test : public ::testing::Test {
+protected:
+  struct budget_conn conns[3];
+  struct zb_budget_group g;
+  int64_t base;
+
+  void SetUp() override
+  {
+    struct zb_usage u;
+    zb_get_usage(&u);
+    // whatever other tests still hold
+    base = u.used;
+    ASSERT_EQ(zb_budget_group_init(&g, NULL, 0), 0);
+    for (auto &c : conns) {
+      zb_budget_conn_init(&c.bc, 0, on_pause, &c);
+      c.pauses = c.resumes = 0;
+      ASSERT_TRUE(zb_init(&c.buf, KB) != NULL);
+      zb_set_account(&c.buf, &c.bc.account);
+      ASSERT_EQ(zb_budget_add(&g, &c.bc), 0);
+    }
+    base += 3 * KB;
+  }
+  void TearDown() override
+  {
+    zb_set_limits(0, 0);
+    for (auto &c : conns) {
+      zb_budget_remove(&g, &c.bc);
+      zb_destroy(&c.buf);
+    }
+    zb_budget_group_destroy(&g);
+  }
+  void grow(int i, int bytes)
+  {
+    ASSERT_EQ(zb_resize(&conns[i].buf, (size_t)bytes), 0);
+  }
+  // resize connection i so the process holds used bytes in total
+  void use(int i, int64_t used)
+  {
+    struct zb_usage u;
+    zb_get_usage(&u);
+    grow(i, (int)(conns[i].buf.cap + used - u.used));
+  }
+};
+
+TEST_F(zbudget_test, accounts)
+{
+  grow(0, 100 * KB);
+  EXPECT_EQ(conns[0].bc.account.used, 100 * KB);
+  zb_set_account(&conns[0].buf, NULL);
+  EXPECT_EQ(conns[0].bc.account.used, 0);
+  zb_set_account(&conns[0].buf, &conns[0].bc.account);
+  struct zb_usage u;
+  zb_get_usage(&u);
+  EXPECT_EQ(u.used, base + 99 * KB);
+}
+
+TEST_F(zbudget_test, under_soft_limit)
+{
+  zb_set_limits(base + 1024 * KB, 0);
+  grow(0, 512 * KB);
+  grow(1, 256 * KB);
+  EXPECT_EQ(zb_budget_check(&g), 0);
+  EXPECT_FALSE(zb_over_soft_limit());
+  // no soft limit, nothing is ever paused
+  zb_set_limits(0, 0);
+  grow(2, 4096 * KB);
+  EXPECT_EQ(zb_budget_check(&g), 0);
+}
+
+TEST_F(zbudget_test, pause_fattest_then_resume)
+{
+  int64_t soft = base + 512 * KB;
+  zb_set_limits(soft, 0);
+  grow(0, 64 * KB);
+  grow(1, 400 * KB);
+  grow(2, 200 * KB);
+  // about 150K over, the 400K connection alone covers it
+  ASSERT_TRUE(zb_over_soft_limit());
+  EXPECT_EQ(zb_budget_check(&g), 1);
+  EXPECT_TRUE(conns[1].bc.paused);
+  EXPECT_EQ(conns[1].pauses, 1);
+  EXPECT_EQ(conns[0].pauses + conns[2].pauses, 0);
+
+  // still over: the paused one already holds the excess, no new pause
+  EXPECT_EQ(zb_budget_check(&g), 1);
+  EXPECT_EQ(conns[1].pauses, 1);
+
+  // more than it holds: the next fattest goes too
+  grow(0, 450 * KB);
+  EXPECT_EQ(zb_budget_check(&g), 2);
+  EXPECT_TRUE(conns[0].bc.paused);
+  EXPECT_FALSE(conns[2].bc.paused);
+
+  // under the soft limit but above 7/8 of it: stay paused
+  grow(0, 64 * KB);
+  use(1, soft - soft / 16);
+  ASSERT_FALSE(zb_over_soft_limit());
+  EXPECT_EQ(zb_budget_check(&g), 2);
+
+  // below 7/8: everyone resumes
+  use(1, soft - soft / 8);
+  EXPECT_EQ(zb_budget_check(&g), 0);
+  EXPECT_EQ(conns[0].resumes, 1);
+  EXPECT_EQ(conns[1].resumes, 1);
+  EXPECT_EQ(conns[2].resumes, 0);
+  EXPECT_EQ(g.pauses, 2u);
+}
+
+TEST_F(zbudget_test, hard_limit_refuses)
+{
+  zb_set_limits(base + 256 * KB, base + 1024 * KB);
+  struct zb_usage before, after;
+  zb_get_usage(&before);
+  grow(0, 600 * KB);
+  errno = 0;
+  EXPECT_EQ(zb_resize(&conns[1].buf, 600 * KB), -1);
+  EXPECT_EQ(errno, ENOBUFS);
+  EXPECT_EQ(conns[1].buf.cap, KB);
+  zb_get_usage(&after);
+  EXPECT_EQ(after.failures, before.failures + 1);
+  EXPECT_LE(after.used, after.hard_limit);
+
+  // near the limit a reserve settles for what it needs instead of doubling
+  ASSERT_EQ(zb_reserve(&conns[0].buf, 700 * KB), 0);
+  EXPECT_EQ(conns[0].buf.cap, 700 * KB);
+
+  // far above the soft limit, the fattest one covers the excess
+  EXPECT_EQ(zb_budget_check(&g), 1);
+  EXPECT_TRUE(conns[0].bc.paused);
+}
+
+TEST_F(zbudget_test, account_limit)
+{
+  conns[2].bc.account.limit = 128 * KB;
+  grow(2, 128 * KB);
+  errno = 0;
+  EXPECT_EQ(zb_resize(&conns[2].buf, 128 * KB + 1), -1);
+  EXPECT_EQ(errno, ENOBUFS);
+  // no process limit, the others still grow
+  grow(0, 1024 * KB);
+}
+
+TEST_F(zbudget_test, remove_paused)
+{
+  zb_set_limits(base + 64 * KB, 0);
+  grow(0, 256 * KB);
+  EXPECT_EQ(zb_budget_check(&g), 1);
+  zb_budget_remove(&g, &conns[0].bc);
+  EXPECT_EQ(g.npaused, 0);
+  EXPECT_EQ(g.n, 2);
+  // the caller closes it, no resume
+  EXPECT_EQ(conns[0].resumes, 0);
+  zb_budget_remove(&g, &conns[0].bc);
+  EXPECT_EQ(g.n, 2);
+}
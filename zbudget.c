@@ -0,0 +1,113 @@
+#include "zbudget.h"
+#include <stdlib.h>
+#include <string.h>
+
+void zb_budget_conn_init(struct zb_budget_conn *c, int64_t limit,
+                         zb_budget_pause_func pause, void *arg)
+{
+  memset(c, 0, sizeof(*c));
+  c->account.limit = limit;
+  c->pause = pause;
+  c->arg = arg;
+  c->index = -1;
+}
+
+static void zb_budget_on_timer(void *arg)
+{
+  struct zb_budget_group *g = arg;
+  zb_budget_check(g);
+  reactor_timer_start(g->r, &g->timer, g->interval_ms, zb_budget_on_timer, g);
+}
+
+int zb_budget_group_init(struct zb_budget_group *g, struct reactor *r, int interval_ms)
+{
+  memset(g, 0, sizeof(*g));
+  g->r = r;
+  g->interval_ms = interval_ms;
+  reactor_timer_init(&g->timer);
+  if (interval_ms > 0)
+    return reactor_timer_start(r, &g->timer, interval_ms, zb_budget_on_timer, g);
+  return 0;
+}
+
+void zb_budget_group_destroy(struct zb_budget_group *g)
+{
+  reactor_timer_stop(g->r, &g->timer);
+  for (int i = 0; i < g->n; i++)
+    g->conns[i]->index = -1;
+  free(g->conns);
+  g->conns = NULL;
+  g->n = g->cap = 0;
+}
+
+int zb_budget_add(struct zb_budget_group *g, struct zb_budget_conn *c)
+{
+  if (g->n == g->cap) {
+    int cap = g->cap ? g->cap * 2 : 64;
+    struct zb_budget_conn **conns = realloc(g->conns, sizeof(*conns) * (size_t)cap);
+    if (!conns)
+      return -1;
+    g->conns = conns;
+    g->cap = cap;
+  }
+  c->index = g->n;
+  g->conns[g->n++] = c;
+  return 0;
+}
+
+void zb_budget_remove(struct zb_budget_group *g, struct zb_budget_conn *c)
+{
+  int i = c->index;
+  if (i < 0)
+    return;
+  if (c->paused)
+    g->npaused--;
+  g->conns[i] = g->conns[--g->n];
+  g->conns[i]->index = i;
+  c->index = -1;
+}
+
+static void zb_budget_set(struct zb_budget_group *g, struct zb_budget_conn *c, int paused)
+{
+  c->paused = paused;
+  g->npaused += paused ? 1 : -1;
+  if (paused)
+    g->pauses++;
+  c->pause(c, paused);
+}
+
+int zb_budget_check(struct zb_budget_group *g)
+{
+  struct zb_usage u;
+  zb_get_usage(&u);
+  if (u.soft_limit <= 0)
+    return g->npaused;
+
+  if (u.used > u.soft_limit) {
+    int64_t excess = u.used - u.soft_limit;
+    int64_t held = 0;
+    for (int i = 0; i < g->n; i++) {
+      if (g->conns[i]->paused)
+        held += g->conns[i]->account.used;
+    }
+    // fattest first; repeated scans, only a handful is ever paused at once
+    while (held < excess) {
+      struct zb_budget_conn *fat = NULL;
+      for (int i = 0; i < g->n; i++) {
+        struct zb_budget_conn *c = g->conns[i];
+        if (!c->paused && c->account.used > 0 && (!fat || c->account.used > fat->account.used))
+          fat = c;
+      }
+      if (!fat)
+        break;
+      held += fat->account.used;
+      zb_budget_set(g, fat, 1);
+    }
+  } else if (g->npaused > 0 && u.used <= u.soft_limit - u.soft_limit / 8) {
+    for (int i = 0; i < g->n; i++) {
+      if (g->conns[i]->paused)
+        zb_budget_set(g, g->conns[i], 0);
+    }
+  }
+  return g->npaused;
+}
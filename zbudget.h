@@ -0,0 +1,63 @@
+#ifndef XNET_ZBUDGET_H_
+#define XNET_ZBUDGET_H_
+
+#include <stdint.h>
+#include "reactor.h"
+#include "zbytes.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Backpressure on the zbytes memory budget (zb_set_limits).
+//
+// The connections of one reactor charge their buffers to a zb_budget_conn
+// account and join a group. While the process is above the soft limit the
+// group pauses reading on its fattest connections, until the memory they
+// hold covers the excess; once usage is back below 7/8 of the soft limit
+// every paused connection resumes. A slow consumer then stalls its own
+// peer instead of growing its buffers, and the hard limit is only hit by
+// bursts the soft limit could not catch.
+
+struct zb_budget_conn;
+// stop (paused 1) or restart (paused 0) reading from the connection,
+// e.g. reactor_modify() without EPOLLIN
+typedef void (*zb_budget_pause_func)(struct zb_budget_conn *c, int paused);
+
+struct zb_budget_conn {
+  struct zb_account account;  // zb_set_account() every buffer of the connection
+  zb_budget_pause_func pause;
+  void *arg;
+  int paused;
+  int index;  // in the group, -1 if not added
+};
+
+struct zb_budget_group {
+  struct reactor *r;
+  struct zb_budget_conn **conns;
+  int n;
+  int cap;
+  int npaused;
+  uint64_t pauses;
+  struct reactor_timer timer;
+  int interval_ms;
+};
+
+// limit: per-connection cap in bytes, 0 none
+void zb_budget_conn_init(struct zb_budget_conn *c, int64_t limit,
+                         zb_budget_pause_func pause, void *arg);
+
+// interval_ms > 0 checks the budget on a reactor timer, otherwise call
+// zb_budget_check() yourself (e.g. after every read). 0 : success, -1 fail
+int zb_budget_group_init(struct zb_budget_group *g, struct reactor *r, int interval_ms);
+void zb_budget_group_destroy(struct zb_budget_group *g);
+int zb_budget_add(struct zb_budget_group *g, struct zb_budget_conn *c);
+// c is not resumed, the caller is about to close it
+void zb_budget_remove(struct zb_budget_group *g, struct zb_budget_conn *c);
+// pause or resume as described above. number of paused connections
+int zb_budget_check(struct zb_budget_group *g);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -1,4 +1,5 @@
 #include "zbytes.h"
+#include <errno.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -20,13 +21,78 @@ void zb_Assert(int cond, const char *fmt, ...);
 }
 #endif
 
+static struct {
+    int64_t used;
+    int64_t peak;
+    int64_t soft_limit;
+    int64_t hard_limit;
+    uint64_t failures;
+} zb_budget;
+
+// account for delta bytes of capacity, before growing or after shrinking.
+// 0 : ok, -1 over a limit (ENOBUFS)
+static int zb_charge(struct zb_account *account, int64_t delta)
+{
+    if (delta > 0) {
+        if (account && account->limit > 0 && account->used + delta > account->limit)
+            goto refuse;
+        int64_t hard = __atomic_load_n(&zb_budget.hard_limit, __ATOMIC_RELAXED);
+        int64_t used = __atomic_add_fetch(&zb_budget.used, delta, __ATOMIC_RELAXED);
+        if (hard > 0 && used > hard) {
+            __atomic_sub_fetch(&zb_budget.used, delta, __ATOMIC_RELAXED);
+            goto refuse;
+        }
+        int64_t peak = __atomic_load_n(&zb_budget.peak, __ATOMIC_RELAXED);
+        while (used > peak &&
+               !__atomic_compare_exchange_n(&zb_budget.peak, &peak, used, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            ;
+    } else {
+        __atomic_add_fetch(&zb_budget.used, delta, __ATOMIC_RELAXED);
+    }
+    if (account)
+        account->used += delta;
+    return 0;
+
+refuse:
+    __atomic_add_fetch(&zb_budget.failures, 1, __ATOMIC_RELAXED);
+    errno = ENOBUFS;
+    return -1;
+}
+
+void zb_set_limits(int64_t soft_limit, int64_t hard_limit)
+{
+    __atomic_store_n(&zb_budget.soft_limit, soft_limit, __ATOMIC_RELAXED);
+    __atomic_store_n(&zb_budget.hard_limit, hard_limit, __ATOMIC_RELAXED);
+}
+
+void zb_get_usage(struct zb_usage *usage)
+{
+    usage->used = __atomic_load_n(&zb_budget.used, __ATOMIC_RELAXED);
+    usage->peak = __atomic_load_n(&zb_budget.peak, __ATOMIC_RELAXED);
+    usage->soft_limit = __atomic_load_n(&zb_budget.soft_limit, __ATOMIC_RELAXED);
+    usage->hard_limit = __atomic_load_n(&zb_budget.hard_limit, __ATOMIC_RELAXED);
+    usage->failures = __atomic_load_n(&zb_budget.failures, __ATOMIC_RELAXED);
+}
+
+bool zb_over_soft_limit(void)
+{
+    int64_t soft = __atomic_load_n(&zb_budget.soft_limit, __ATOMIC_RELAXED);
+    return soft > 0 && __atomic_load_n(&zb_budget.used, __ATOMIC_RELAXED) > soft;
+}
+
 struct zbytes *zb_init(struct zbytes *zb, int hint_capability)
 {
     if (hint_capability<=0)
         hint_capability = (1<<16)-8;
+    zb->account = NULL;
+    if (zb_charge(NULL, hint_capability) != 0)
+        return NULL;
     char *bb = malloc((size_t )hint_capability);
-    if (!bb)
+    if (!bb) {
+        zb_charge(NULL, -hint_capability);
         return NULL;
+    }
     zb->cap = hint_capability;
     zb->pos = 0;zb->limit = 0;
     zb->data = bb;
@@ -37,28 +103,60 @@ void zb_destroy(struct zbytes *zb)
     if (zb->data) {
         free(zb->data);
         zb->data = NULL;
+        zb_charge(zb->account, -(int64_t)zb->cap);
     }
     zb->pos = zb->limit = 0;
+    zb->cap = 0;
+}
+void zb_set_account(struct zbytes *zb, struct zb_account *account)
+{
+    if (zb->data) {
+        if (zb->account)
+            zb->account->used -= zb->cap;
+        if (account)
+            account->used += zb->cap;
+    }
+    zb->account = account;
 }
 int zb_reserve(struct zbytes *zb, size_t n)
 {
     if (zb_free_size(zb) >= n)
         return 0;
 
-    size_t cap = zb->limit + n;
+    size_t need = zb->limit + n;
+    size_t cap = need;
     if (cap < zb->cap * 2)
         cap = (size_t) (zb->cap * 2);
-    return zb_resize(zb, cap);
+    if (zb_resize(zb, cap) == 0)
+        return 0;
+    // near a limit, settle for what is needed
+    return cap > need && errno == ENOBUFS ? zb_resize(zb, need) : -1;
 }
 
 int zb_resize(struct zbytes *zb, size_t new_size)
 {
+    int64_t delta = (int64_t)new_size - zb->cap;
+    if (delta > 0 && zb_charge(zb->account, delta) != 0)
+        return -1;
     char *bb = realloc(zb->data, new_size);
-    if (!bb)
+    if (!bb) {
+        if (delta > 0)
+            zb_charge(zb->account, -delta);
         return -1;
+    }
+    if (delta < 0)
+        zb_charge(zb->account, delta);
     zb->data = bb;
+    zb->cap = (int)new_size;
     return 0;
 }
+int zb_shrink(struct zbytes *zb, int baseline)
+{
+    if (!zb->data || baseline <= 0 || zb->cap <= baseline || zb_available(zb) > baseline)
+        return 0;
+    zb_move(zb);
+    return zb_resize(zb, (size_t)baseline) == 0;
+}
 void zb_move(struct zbytes *zb)
 {
     if (zb->pos) {
@@ -16,14 +16,43 @@ void zb_Assert(int cond, const char *fmt, ...);
 // valid data is [pos, limit), free space is cap-limit
 // pos is a read/write pointer
 
+// buffer memory charged to one owner, e.g. all buffers of a connection.
+// not thread-safe: the buffers of an account belong to one thread
+struct zb_account {
+    int64_t used;   // bytes of capacity
+    int64_t limit;  // 0: no per-account limit
+};
+
 struct zbytes {
     char *data;
     int pos;
     int limit;
     int cap;
+    struct zb_account *account;  // may be NULL
 };
 struct zbytes * zb_init(struct zbytes *zb, int hint_capability);
 void zb_destroy(struct zbytes *zb);
+// charge zb's capacity to account (NULL: none) from now on
+void zb_set_account(struct zbytes *zb, struct zb_account *account);
+
+//// MEMORY BUDGET
+// all zbytes capacity of the process is counted. Above the hard limit and
+// above the limit of its account, growing a buffer fails with ENOBUFS
+// instead of allocating. The soft limit is advisory, see zbudget.h.
+struct zb_usage {
+    int64_t used;
+    int64_t peak;
+    int64_t soft_limit;
+    int64_t hard_limit;
+    uint64_t failures;  // allocations refused by a limit
+};
+// 0: no limit
+void zb_set_limits(int64_t soft_limit, int64_t hard_limit);
+void zb_get_usage(struct zb_usage *usage);
+bool zb_over_soft_limit(void);
+// give back memory of a drained buffer: shrink the capacity to baseline if
+// no more than baseline bytes are buffered. 1 : shrunk, 0 : not
+int zb_shrink(struct zbytes *zb, int baseline);
 static inline char *zb_data(const struct zbytes *zb)
 {
     return zb->data + zb->pos;
@@ -54,6 +83,7 @@ void zb_move(struct zbytes *zb);
 static inline void zb_append(struct zbytes *zb, const void *data, size_t len)
 {
     memcpy(zb->data+zb->limit, data, len);
+    zb->limit += (int)len;
     zb_Assert(zb->limit<=zb->cap, "append overflow");
 }
 static inline void zb_append_cstring(struct zbytes *zb, const char *str)